@@ -32,10 +32,20 @@ static char rcsId[] =
 
 #include "config.h"
 
+#if defined(HAVE_THREAD_H) && !defined(_AIX)
+#include <thread.h>
+#elif defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <syslog.h>
 #include <netinet/in.h>
@@ -132,20 +142,252 @@ _nss_ldap_getdnsdn (char *src_domain,
   return NSS_SUCCESS;
 }
 
+/*
+ * SRV targets for one query name, kept until the smallest
+ * TTL of the records expires.
+ */
+struct srv_target
+{
+  unsigned priority;
+  unsigned weight;
+  unsigned port;
+  char *target;
+};
+
+struct srv_cache
+{
+  char *domain;
+  time_t expires;
+  int count;
+  struct srv_target *targets;
+};
+
+static struct srv_cache __srv_cache;
+static unsigned long __srv_seed = 0;
+NSS_LDAP_DEFINE_LOCK (__srv_cache_lock);
+
+static void
+srv_cache_free (struct srv_cache *c)
+{
+  int i;
+
+  for (i = 0; i < c->count; i++)
+    free (c->targets[i].target);
+
+  free (c->targets);
+  free (c->domain);
+  memset (c, 0, sizeof (*c));
+}
+
+static int
+srv_cache_add (struct srv_cache *c, unsigned priority, unsigned weight,
+	       unsigned port, const char *target)
+{
+  struct srv_target *t;
+
+  t = (struct srv_target *) realloc (c->targets,
+				     (c->count + 1) * sizeof (*t));
+  if (t == NULL)
+    return -1;
+
+  c->targets = t;
+  t += c->count;
+  t->target = strdup (target);
+  if (t->target == NULL)
+    return -1;
+
+  t->priority = priority;
+  t->weight = weight;
+  t->port = port;
+  c->count++;
+
+  return 0;
+}
+
+static int
+srv_cache_from_reply (struct dns_reply *r, const char *domain,
+		      struct srv_cache *c)
+{
+  struct resource_record *rr;
+  unsigned ttl = 0;
+  int first = 1;
+
+  for (rr = r->head; rr != NULL; rr = rr->next)
+    {
+      if (rr->type != T_SRV)
+	continue;
+
+      if (srv_cache_add (c, rr->u.srv->priority, rr->u.srv->weight,
+			 rr->u.srv->port, rr->u.srv->target) != 0)
+	return -1;
+
+      if (first || rr->ttl < ttl)
+	ttl = rr->ttl;
+      first = 0;
+    }
+
+  c->domain = strdup (domain);
+  if (c->domain == NULL)
+    return -1;
+
+  c->expires = time (NULL) + ttl;
+
+  return 0;
+}
+
+/*
+ * The cache file holds the query name and expiry time on the
+ * first line, followed by one "priority weight port target" line
+ * per record. Only files that cannot have been written by an
+ * unprivileged user are trusted.
+ */
 static int
-priority_sort(const void *r1, const void *r2)
+srv_cache_load (const char *path, const char *domain, struct srv_cache *c)
 {
-  struct resource_record **rr1 = (struct resource_record **)r1;
-  struct resource_record **rr2 = (struct resource_record **)r2;
-  int ret;
+  char buf[NSS_BUFSIZ], name[NSS_BUFSIZ];
+  unsigned priority, weight, port;
+  struct stat st;
+  long expires;
+  FILE *fp;
+
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+
+  if (fstat (fileno (fp), &st) != 0 || !S_ISREG (st.st_mode) ||
+      st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      fgets (buf, sizeof (buf), fp) == NULL ||
+      sscanf (buf, "%1023s %ld", name, &expires) != 2 ||
+      strcasecmp (name, domain) != 0 || (time_t) expires <= time (NULL))
+    {
+      fclose (fp);
+      return -1;
+    }
 
-  ret = (*rr1)->u.srv->priority - (*rr2)->u.srv->priority;
-  if (ret == 0)
+  while (fgets (buf, sizeof (buf), fp) != NULL)
     {
-      ret = (*rr2)->u.srv->weight - (*rr1)->u.srv->weight;
+      if (sscanf (buf, "%u %u %u %1023s", &priority, &weight, &port,
+		  name) != 4)
+	continue;
+
+      if (srv_cache_add (c, priority, weight, port, name) != 0)
+	break;
     }
 
-  return ret;
+  fclose (fp);
+
+  c->domain = strdup (domain);
+  if (c->count == 0 || c->domain == NULL)
+    {
+      srv_cache_free (c);
+      return -1;
+    }
+
+  c->expires = (time_t) expires;
+
+  debug (":== srv_cache_load: loaded %d SRV records from %s", c->count,
+	 path);
+
+  return 0;
+}
+
+static void
+srv_cache_store (const char *path, struct srv_cache *c)
+{
+  char tmp[MAXPATHLEN];
+  FILE *fp;
+  int fd, i;
+
+  if (geteuid () != 0 || c->expires <= time (NULL))
+    return;
+
+  snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ());
+
+  fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return;
+
+  fp = fdopen (fd, "w");
+  if (fp == NULL)
+    {
+      close (fd);
+      unlink (tmp);
+      return;
+    }
+
+  fprintf (fp, "%s %ld\n", c->domain, (long) c->expires);
+  for (i = 0; i < c->count; i++)
+    fprintf (fp, "%u %u %u %s\n", c->targets[i].priority,
+	     c->targets[i].weight, c->targets[i].port, c->targets[i].target);
+
+  /* replace the old file atomically so readers never see a partial one */
+  if (fclose (fp) != 0 || rename (tmp, path) != 0)
+    unlink (tmp);
+}
+
+static unsigned long
+srv_random (void)
+{
+  if (__srv_seed == 0)
+    __srv_seed = (unsigned long) time (NULL) ^ ((unsigned long) getpid () << 16) ^
+      (unsigned long) &__srv_seed;
+
+  __srv_seed = __srv_seed * 1103515245UL + 12345UL;
+
+  return (__srv_seed >> 16) & 0x7fff;
+}
+
+/*
+ * Order targets by priority and, within each priority, at
+ * random weighted by their SRV weight, as described in
+ * RFC 2782.
+ */
+static void
+srv_weighted_order (struct srv_target *t, int count, int *order)
+{
+  int i, j, band, n;
+  unsigned long total, sum, pick;
+
+  /* stable by priority, zero weights first within a priority */
+  for (i = 0; i < count; i++)
+    {
+      for (j = i; j > 0 &&
+	   (t[order[j - 1]].priority > t[i].priority ||
+	    (t[order[j - 1]].priority == t[i].priority &&
+	     t[order[j - 1]].weight != 0 && t[i].weight == 0)); j--)
+	order[j] = order[j - 1];
+      order[j] = i;
+    }
+
+  for (band = 0; band < count; band += n)
+    {
+      for (n = 1; band + n < count &&
+	   t[order[band + n]].priority == t[order[band]].priority; n++)
+	;
+
+      /* select each position of the band in turn */
+      for (i = band; i < band + n - 1; i++)
+	{
+	  int tmp;
+
+	  for (total = 0, j = i; j < band + n; j++)
+	    total += t[order[j]].weight;
+
+	  pick = ((srv_random () << 15) | srv_random ()) % (total + 1);
+
+	  for (sum = 0, j = i; j < band + n - 1; j++)
+	    {
+	      sum += t[order[j]].weight;
+	      if (sum >= pick)
+		break;
+	    }
+
+	  /* move it to the front, keeping the rest in order */
+	  tmp = order[j];
+	  memmove (&order[i + 1], &order[i], (j - i) * sizeof (int));
+	  order[i] = tmp;
+	}
+    }
 }
 
 NSS_STATUS
@@ -154,13 +396,12 @@ _nss_ldap_mergeconfigfromdns (ldap_config_t * result,
 {
   NSS_STATUS stat = NSS_SUCCESS;
   struct dns_reply *r;
-  struct resource_record *rr;
+  struct srv_target *t;
   char domain[MAXHOSTNAMELEN + 1];
   char *pDomain;
   char uribuf[NSS_BUFSIZ];
-  int srv_count = 0;
+  int *order;
   int i;
-  struct resource_record **srr;
 
   debug ("==> _nss_ldap_mergeconfigfromdns");
 
@@ -182,42 +423,55 @@ _nss_ldap_mergeconfigfromdns (ldap_config_t * result,
     }
   pDomain = domain;
 
-  r = dns_lookup (pDomain, "srv");
-  if (r == NULL)
-    {
-      return NSS_NOTFOUND;
-    }
+  NSS_LDAP_LOCK (__srv_cache_lock);
 
-  for (rr = r->head; rr != NULL; rr = rr->next)
+  if (__srv_cache.domain == NULL ||
+      strcasecmp (__srv_cache.domain, pDomain) != 0 ||
+      __srv_cache.expires <= time (NULL))
     {
-      if (rr->type == T_SRV)
-	srv_count++;
+      srv_cache_free (&__srv_cache);
+
+      if (result->ldc_srv_cache == NULL ||
+	  srv_cache_load (result->ldc_srv_cache, pDomain, &__srv_cache) != 0)
+	{
+	  r = dns_lookup (pDomain, "srv");
+	  if (r != NULL)
+	    {
+	      if (srv_cache_from_reply (r, pDomain, &__srv_cache) != 0)
+		srv_cache_free (&__srv_cache);
+	      else if (result->ldc_srv_cache != NULL)
+		srv_cache_store (result->ldc_srv_cache, &__srv_cache);
+
+	      dns_free_data (r);
+	    }
+	}
     }
 
-  debug (":== _nss_ldap_mergeconfigfromdns: retrieved %d SRV records", srv_count);
+  debug (":== _nss_ldap_mergeconfigfromdns: %d SRV records", __srv_cache.count);
 
-  srr = (struct resource_record **)calloc (srv_count, sizeof(struct resource_record *));
-  if (srr == NULL)
+  if (__srv_cache.count == 0)
     {
-      dns_free_data (r);
+      srv_cache_free (&__srv_cache);
+      NSS_LDAP_UNLOCK (__srv_cache_lock);
       return NSS_NOTFOUND;
     }
 
-  for (rr = r->head, i = 0; rr != NULL; rr = rr->next, i++)
+  order = (int *) calloc (__srv_cache.count, sizeof (int));
+  if (order == NULL)
     {
-      if (rr->type == T_SRV)
-	srr[i] = rr;
+      NSS_LDAP_UNLOCK (__srv_cache_lock);
+      return NSS_NOTFOUND;
     }
 
-  qsort(srr, srv_count, sizeof(struct resource_record *), priority_sort);
+  srv_weighted_order (__srv_cache.targets, __srv_cache.count, order);
 
-  for (i = 0; i < srv_count; i++)
+  for (i = 0; i < __srv_cache.count; i++)
     {
-      rr = srr[i];
+      t = &__srv_cache.targets[order[i]];
       snprintf (uribuf, sizeof(uribuf), "ldap%s://%s:%d",
-		(rr->u.srv->port == LDAPS_PORT) ? "s" : "",
-		rr->u.srv->target,
-		rr->u.srv->port);
+		(t->port == LDAPS_PORT) ? "s" : "",
+		t->target,
+		t->port);
 
       stat = _nss_ldap_add_uri (result, uribuf, buffer, buflen);
       if (stat != NSS_SUCCESS)
@@ -226,10 +480,11 @@ _nss_ldap_mergeconfigfromdns (ldap_config_t * result,
 	}
     }
 
+  NSS_LDAP_UNLOCK (__srv_cache_lock);
+
   debug (":== _nss_ldap_mergeconfigfromdns: processed sort array");
-  free(srr);
+  free (order);
 
-  dns_free_data (r);
   stat = NSS_SUCCESS;
 
   if (result->ldc_base == NULL)
@@ -242,4 +497,3 @@ _nss_ldap_mergeconfigfromdns (ldap_config_t * result,
 
   return stat;
 }
-
@@ -0,0 +1,960 @@
+/* This file is part of the nss_ldap library.
+
+   The nss_ldap library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The nss_ldap library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the nss_ldap library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+ */
+
+static char rcsId[] =
+  "$Id$";
+
+#include "config.h"
+
+#ifdef HAVE_PORT_BEFORE_H
+#include <port_before.h>
+#endif
+
+#if defined(HAVE_THREAD_H) && !defined(_AIX)
+#include <thread.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <syslog.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <pwd.h>
+#include <grp.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#ifdef HAVE_LBER_H
+#include <lber.h>
+#endif
+#ifdef HAVE_LDAP_H
+#include <ldap.h>
+#endif
+
+#include "ldap-nss.h"
+#include "ldap-cache.h"
+#include "util.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYNC_BUILTINS)
+#define LDAP_CACHE_SHM
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_PORT_AFTER_H
+#include <port_after.h>
+#endif
+
+/*
+ * Entries are spread over a number of shards, each with its own
+ * lock, so that concurrent lookups rarely contend on the cache.
+ */
+#define LDAP_CACHE_SHARDS	16
+#define LDAP_CACHE_BUCKETS	256	/* hash chains per shard */
+
+typedef struct ldap_cache_entry
+{
+  struct ldap_cache_entry *lce_next;	/* hash chain */
+  struct ldap_cache_entry *lce_newer;	/* age list */
+  struct ldap_cache_entry *lce_older;
+  unsigned long lce_hash;
+  ldap_map_selector_t lce_sel;
+  const char *lce_filter;
+  ldap_args_types_t lce_type;
+  int lce_root;			/* filled by root, which sees secrets */
+  long lce_number;
+  char *lce_string;
+  time_t lce_expires;
+  NSS_STATUS lce_stat;
+  void *lce_result;		/* parsed entry, if lce_stat is NSS_SUCCESS */
+  size_t lce_datalen;		/* buffer space lce_result refers to */
+} ldap_cache_entry_t;
+
+typedef struct ldap_cache_shard
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lcs_lock;
+#endif
+  ldap_cache_entry_t *lcs_buckets[LDAP_CACHE_BUCKETS];
+  ldap_cache_entry_t *lcs_newest;
+  ldap_cache_entry_t *lcs_oldest;
+  int lcs_count;
+} ldap_cache_shard_t;
+
+static ldap_cache_shard_t __cache_shards[LDAP_CACHE_SHARDS];
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t __cache_once = PTHREAD_ONCE_INIT;
+
+static void
+do_cache_init (void)
+{
+  int i;
+
+  for (i = 0; i < LDAP_CACHE_SHARDS; i++)
+    pthread_mutex_init (&__cache_shards[i].lcs_lock, NULL);
+}
+
+#define cache_init()		(void) pthread_once (&__cache_once, do_cache_init)
+#define cache_lock(s)		pthread_mutex_lock (&(s)->lcs_lock)
+#define cache_unlock(s)		pthread_mutex_unlock (&(s)->lcs_lock)
+#else
+NSS_LDAP_DEFINE_LOCK (__cache_lock);
+
+#define cache_init()
+#define cache_lock(s)		NSS_LDAP_LOCK (__cache_lock)
+#define cache_unlock(s)		NSS_LDAP_UNLOCK (__cache_lock)
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Maps whose entries may be cached. The secret field is replaced
+ * with "x" in the shared cache, which every user can read.
+ */
+static struct
+{
+  ldap_map_selector_t sel;
+  size_t size;
+  ldap_cache_copier_t copier;
+  ldap_cache_reloc_t reloc;
+  size_t secret;
+}
+__cache_maps[] =
+{
+  { LM_PASSWD, sizeof (struct passwd), _nss_ldap_copy_pw,
+    _nss_ldap_reloc_pw, offsetof (struct passwd, pw_passwd) },
+  { LM_GROUP, sizeof (struct group), _nss_ldap_copy_gr,
+    _nss_ldap_reloc_gr, offsetof (struct group, gr_passwd) },
+  { LM_NONE, 0, NULL, NULL, 0 }
+};
+
+#ifdef LDAP_CACHE_SHM
+static int do_shm_get (ldap_config_t * cfg, int map,
+		       const ldap_args_t * args,
+		       ldap_map_selector_t sel, void *result,
+		       char *buffer, size_t buflen,
+		       int *errnop, NSS_STATUS * statp);
+static void do_shm_put (ldap_config_t * cfg, int map,
+			const ldap_args_t * args,
+			ldap_map_selector_t sel, NSS_STATUS stat,
+			const void *result, time_t ttl);
+#else
+#define do_shm_get(cfg, map, args, sel, result, buffer, buflen, errnop, statp)	(0)
+#define do_shm_put(cfg, map, args, sel, stat, result, ttl)
+#endif /* LDAP_CACHE_SHM */
+
+static int
+do_cache_map (ldap_map_selector_t sel)
+{
+  int i;
+
+  for (i = 0; __cache_maps[i].sel != LM_NONE; i++)
+    {
+      if (__cache_maps[i].sel == sel)
+	return i;
+    }
+
+  return -1;
+}
+
+/*
+ * Only simple lookups by name or number against the default
+ * search base are cached.
+ */
+static int
+do_cache_key_ok (const ldap_args_t * args)
+{
+  if (args->la_base != NULL || args->la_arg2.la_string != NULL)
+    return 0;
+
+  switch (args->la_type)
+    {
+    case LA_TYPE_STRING:
+      return (args->la_arg1.la_string != NULL);
+    case LA_TYPE_NUMBER:
+      return 1;
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+static unsigned long
+do_cache_hash (const ldap_args_t * args, const char *filterprot,
+	       ldap_map_selector_t sel, int root)
+{
+  unsigned long h = 2166136261UL;
+  const unsigned char *p;
+  unsigned long n;
+  size_t i;
+
+  h = (h ^ (unsigned long) sel) * 16777619UL;
+  h = (h ^ (unsigned long) filterprot) * 16777619UL;
+  h = (h ^ (unsigned long) root) * 16777619UL;
+
+  if (args->la_type == LA_TYPE_STRING)
+    {
+      for (p = (const unsigned char *) args->la_arg1.la_string; *p != '\0';
+	   p++)
+	h = (h ^ *p) * 16777619UL;
+    }
+  else
+    {
+      n = (unsigned long) args->la_arg1.la_number;
+      for (i = 0; i < sizeof (n); i++, n >>= 8)
+	h = (h ^ (n & 0xff)) * 16777619UL;
+    }
+
+  return h;
+}
+
+static int
+do_cache_match (const ldap_cache_entry_t * e, unsigned long hash,
+		const ldap_args_t * args, const char *filterprot,
+		ldap_map_selector_t sel, int root)
+{
+  if (e->lce_hash != hash || e->lce_sel != sel ||
+      e->lce_filter != filterprot || e->lce_type != args->la_type ||
+      e->lce_root != root)
+    return 0;
+
+  if (args->la_type == LA_TYPE_STRING)
+    return (strcmp (e->lce_string, args->la_arg1.la_string) == 0);
+
+  return (e->lce_number == args->la_arg1.la_number);
+}
+
+/*
+ * Unlink an entry from its shard and free it. Caller holds the
+ * shard lock.
+ */
+static void
+do_cache_remove (ldap_cache_shard_t * shard, ldap_cache_entry_t * e)
+{
+  ldap_cache_entry_t **pp;
+
+  for (pp = &shard->lcs_buckets[(e->lce_hash / LDAP_CACHE_SHARDS) %
+				LDAP_CACHE_BUCKETS];
+       *pp != NULL; pp = &(*pp)->lce_next)
+    {
+      if (*pp == e)
+	{
+	  *pp = e->lce_next;
+	  break;
+	}
+    }
+
+  if (e->lce_newer != NULL)
+    e->lce_newer->lce_older = e->lce_older;
+  else
+    shard->lcs_newest = e->lce_older;
+
+  if (e->lce_older != NULL)
+    e->lce_older->lce_newer = e->lce_newer;
+  else
+    shard->lcs_oldest = e->lce_newer;
+
+  shard->lcs_count--;
+
+  free (e);
+}
+
+static ldap_cache_entry_t *
+do_cache_find (ldap_cache_shard_t * shard, unsigned long hash,
+	       const ldap_args_t * args, const char *filterprot,
+	       ldap_map_selector_t sel, int root)
+{
+  ldap_cache_entry_t *e;
+
+  for (e = shard->lcs_buckets[(hash / LDAP_CACHE_SHARDS) % LDAP_CACHE_BUCKETS];
+       e != NULL; e = e->lce_next)
+    {
+      if (do_cache_match (e, hash, args, filterprot, sel, root))
+	return e;
+    }
+
+  return NULL;
+}
+
+int
+_nss_ldap_cache_get (ldap_config_t * cfg,
+		     const ldap_args_t * args,
+		     const char *filterprot,
+		     ldap_map_selector_t sel,
+		     void *result,
+		     char *buffer, size_t buflen,
+		     int *errnop, NSS_STATUS * statp)
+{
+  ldap_cache_shard_t *shard;
+  ldap_cache_entry_t *e;
+  unsigned long hash;
+  int map, root, found = 0;
+  size_t needed;
+
+  if (cfg == NULL ||
+      (cfg->ldc_cache_ttl == 0 && cfg->ldc_cache_negative_ttl == 0))
+    return 0;
+
+  map = do_cache_map (sel);
+  if (map < 0 || !do_cache_key_ok (args))
+    return 0;
+
+  /* never answer from a cache filled under an outdated configuration */
+  if (_nss_ldap_validateconfig (cfg) != NSS_SUCCESS)
+    return 0;
+
+  debug ("==> _nss_ldap_cache_get");
+
+  cache_init ();
+
+  /* entries filled by root hold secrets that others must not see */
+  root = (geteuid () == 0);
+  hash = do_cache_hash (args, filterprot, sel, root);
+  shard = &__cache_shards[hash % LDAP_CACHE_SHARDS];
+
+  cache_lock (shard);
+
+  e = do_cache_find (shard, hash, args, filterprot, sel, root);
+  if (e != NULL && e->lce_expires < time (NULL))
+    {
+      do_cache_remove (shard, e);
+      e = NULL;
+    }
+
+  if (e != NULL)
+    {
+      found = 1;
+      *statp = e->lce_stat;
+
+      if (e->lce_stat == NSS_SUCCESS)
+	{
+	  needed = (*__cache_maps[map].copier) (e->lce_result, result,
+						buffer, buflen);
+	  if (needed > buflen)
+	    {
+	      *errnop = ERANGE;
+	      *statp = NSS_TRYAGAIN;
+	    }
+	}
+    }
+
+  cache_unlock (shard);
+
+  if (!found)
+    found = do_shm_get (cfg, map, args, sel, result,
+			buffer, buflen, errnop, statp);
+
+  debug ("<== _nss_ldap_cache_get: %s", found ? "hit" : "miss");
+
+  return found;
+}
+
+void
+_nss_ldap_cache_put (ldap_config_t * cfg,
+		     const ldap_args_t * args,
+		     const char *filterprot,
+		     ldap_map_selector_t sel,
+		     NSS_STATUS stat, const void *result)
+{
+  ldap_cache_shard_t *shard;
+  ldap_cache_entry_t *e, *old;
+  ldap_cache_entry_t **bucket;
+  unsigned long hash;
+  size_t keylen = 0, datalen = 0, size;
+  time_t ttl;
+  int map, limit, root;
+  char *p;
+
+  if (cfg == NULL)
+    return;
+
+  ttl = (stat == NSS_SUCCESS) ? cfg->ldc_cache_ttl :
+    cfg->ldc_cache_negative_ttl;
+  if (ttl == 0 || (stat != NSS_SUCCESS && stat != NSS_NOTFOUND))
+    return;
+
+  map = do_cache_map (sel);
+  if (map < 0 || !do_cache_key_ok (args))
+    return;
+
+  debug ("==> _nss_ldap_cache_put");
+
+  cache_init ();
+
+  if (args->la_type == LA_TYPE_STRING)
+    keylen = strlen (args->la_arg1.la_string) + 1;
+
+  /* entry, parsed result, key and the strings the result refers to */
+  size = sizeof (*e);
+  if (stat == NSS_SUCCESS)
+    {
+      datalen = (*__cache_maps[map].copier) (result, NULL, NULL, 0);
+      size += __cache_maps[map].size + datalen;
+    }
+  size += keylen;
+
+  e = (ldap_cache_entry_t *) malloc (size);
+  if (e == NULL)
+    {
+      debug ("<== _nss_ldap_cache_put: out of memory");
+      return;
+    }
+
+  root = (geteuid () == 0);
+
+  memset (e, 0, sizeof (*e));
+  e->lce_hash = hash = do_cache_hash (args, filterprot, sel, root);
+  e->lce_sel = sel;
+  e->lce_filter = filterprot;
+  e->lce_type = args->la_type;
+  e->lce_root = root;
+  e->lce_expires = time (NULL) + ttl;
+  e->lce_stat = stat;
+
+  p = (char *) (e + 1);
+  if (stat == NSS_SUCCESS)
+    {
+      e->lce_result = p;
+      p += __cache_maps[map].size;
+      e->lce_datalen = datalen;
+      (void) (*__cache_maps[map].copier) (result, e->lce_result, p, datalen);
+      p += datalen;
+    }
+
+  if (args->la_type == LA_TYPE_STRING)
+    {
+      e->lce_string = p;
+      memcpy (p, args->la_arg1.la_string, keylen);
+    }
+  else
+    {
+      e->lce_number = args->la_arg1.la_number;
+    }
+
+  limit = (cfg->ldc_cache_max_entries + LDAP_CACHE_SHARDS - 1) /
+    LDAP_CACHE_SHARDS;
+  if (limit < 1)
+    limit = 1;
+
+  shard = &__cache_shards[hash % LDAP_CACHE_SHARDS];
+
+  cache_lock (shard);
+
+  old = do_cache_find (shard, hash, args, filterprot, sel, root);
+  if (old != NULL)
+    do_cache_remove (shard, old);
+
+  /* evict the oldest entries to stay within nss_cache_max_entries */
+  while (shard->lcs_count >= limit && shard->lcs_oldest != NULL)
+    do_cache_remove (shard, shard->lcs_oldest);
+
+  bucket = &shard->lcs_buckets[(hash / LDAP_CACHE_SHARDS) % LDAP_CACHE_BUCKETS];
+  e->lce_next = *bucket;
+  *bucket = e;
+
+  e->lce_older = shard->lcs_newest;
+  if (shard->lcs_newest != NULL)
+    shard->lcs_newest->lce_newer = e;
+  else
+    shard->lcs_oldest = e;
+  shard->lcs_newest = e;
+  shard->lcs_count++;
+
+  cache_unlock (shard);
+
+  do_shm_put (cfg, map, args, sel, stat, result, ttl);
+
+  debug ("<== _nss_ldap_cache_put");
+}
+
+void
+_nss_ldap_cache_flush (void)
+{
+  ldap_cache_shard_t *shard;
+  int i;
+
+  debug ("==> _nss_ldap_cache_flush");
+
+  cache_init ();
+
+  for (i = 0; i < LDAP_CACHE_SHARDS; i++)
+    {
+      shard = &__cache_shards[i];
+
+      cache_lock (shard);
+      while (shard->lcs_oldest != NULL)
+	do_cache_remove (shard, shard->lcs_oldest);
+      cache_unlock (shard);
+    }
+
+  debug ("<== _nss_ldap_cache_flush");
+}
+
+char *
+_nss_ldap_cache_copy_string (const char *s, char **buffer, size_t * buflen,
+			     size_t * needed)
+{
+  size_t len;
+  char *p;
+
+  if (s == NULL)
+    return NULL;
+
+  len = strlen (s) + 1;
+  *needed += len;
+
+  if (*buflen < len)
+    {
+      *buflen = 0;
+      return NULL;
+    }
+
+  p = *buffer;
+  memcpy (p, s, len);
+  *buffer += len;
+  *buflen -= len;
+
+  return p;
+}
+
+#ifdef LDAP_CACHE_SHM
+/*
+ * The shared cache is a file of fixed size records, mapped by every
+ * process. Each key hashes to one record, which the latest writer
+ * replaces. Records are protected by a sequence number that writers
+ * make odd while they update the record, so that readers need no
+ * lock: they copy the record and retry nothing if the sequence has
+ * changed meanwhile. Only root processes write; a record that a
+ * writer found busy is simply not updated, unless it has been busy
+ * so long that its writer must have died. As that writer may only
+ * have been stopped, and resume writing once the record has been
+ * taken over, readers also check a checksum of the record.
+ *
+ * Records are keyed by map, configuration file and name or number,
+ * not by filter, so that they can be found before the filters have
+ * been set up, and carry the modification time of the configuration
+ * they were found under, so that a changed configuration misses.
+ *
+ * Records hold struct passwd and struct group with their pointers
+ * stored as offsets from the entry, so the file is only usable by
+ * processes of the ABI that created it.
+ */
+#define LDAP_SHM_MAGIC		0x6e73736cU
+#define LDAP_SHM_VERSION	2
+#define LDAP_SHM_RECORDS	4096
+#define LDAP_SHM_RECORD_SIZE	1024	/* bytes, record header included */
+#define LDAP_SHM_KEYSIZ		64
+#define LDAP_SHM_CLAIM_TIMEOUT	60	/* seconds a record may stay busy */
+
+typedef struct ldap_shm_header
+{
+  unsigned int lsh_magic;
+  unsigned int lsh_version;
+  unsigned int lsh_records;
+  unsigned int lsh_record_size;
+  unsigned int lsh_pointer_size;	/* sizeof (void *) of the creator */
+  unsigned int lsh_long_size;
+  unsigned int lsh_time_size;
+} ldap_shm_header_t;
+
+typedef struct ldap_shm_record
+{
+  volatile unsigned int lsr_seq;	/* odd while being written */
+  unsigned int lsr_checksum;	/* of the fields below and the entry */
+  time_t lsr_claimed;		/* when the last writer claimed it */
+  unsigned int lsr_hash;
+  int lsr_sel;
+  int lsr_type;
+  int lsr_stat;
+  unsigned int lsr_datalen;	/* entry and strings */
+  long lsr_number;
+  time_t lsr_expires;
+  time_t lsr_config_mtime;	/* of the configuration in force */
+  char lsr_string[LDAP_SHM_KEYSIZ];
+} ldap_shm_record_t;
+
+/* the part of a record a writer fills in after claiming it */
+#define LDAP_SHM_FILL_OFFSET	offsetof (ldap_shm_record_t, lsr_checksum)
+/* the part of a record covered by its checksum */
+#define LDAP_SHM_SUM_OFFSET	offsetof (ldap_shm_record_t, lsr_hash)
+
+/* the entry follows the record header, with pointers relative to it */
+#define LDAP_SHM_ENTRY_OFFSET	((sizeof (ldap_shm_record_t) + 15) & ~15)
+#define LDAP_SHM_ENTRY_SIZE	(LDAP_SHM_RECORD_SIZE - LDAP_SHM_ENTRY_OFFSET)
+#define LDAP_SHM_FILE_SIZE	((LDAP_SHM_RECORDS + 1) * LDAP_SHM_RECORD_SIZE)
+
+static char *__shm_base = NULL;
+static int __shm_writable = 0;
+static volatile int __shm_tried = 0;
+
+NSS_LDAP_DEFINE_LOCK (__shm_lock);
+
+/*
+ * Map the shared cache file, once per process. Only a regular file
+ * owned by root and writable by nobody else is trusted; root creates
+ * it if necessary.
+ */
+static char *
+do_shm_map (ldap_config_t * cfg)
+{
+  ldap_shm_header_t *h;
+  struct stat st;
+  void *p;
+  int fd, writable;
+
+  if (cfg->ldc_shm_cache == NULL)
+    return NULL;
+
+  if (__shm_tried)
+    return __shm_base;
+
+  NSS_LDAP_LOCK (__shm_lock);
+
+  if (__shm_tried)
+    {
+      NSS_LDAP_UNLOCK (__shm_lock);
+      return __shm_base;
+    }
+
+  debug ("==> do_shm_map");
+
+  writable = (geteuid () == 0);
+  fd = open (cfg->ldc_shm_cache, writable ? (O_RDWR | O_CREAT) : O_RDONLY,
+	     0644);
+  if (fd >= 0)
+    {
+      if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_uid == 0 &&
+	  (st.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+	  (st.st_size >= LDAP_SHM_FILE_SIZE ||
+	   (writable && ftruncate (fd, LDAP_SHM_FILE_SIZE) == 0)))
+	{
+	  p = mmap (NULL, LDAP_SHM_FILE_SIZE,
+		    writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		    MAP_SHARED, fd, 0);
+	  if (p != MAP_FAILED)
+	    {
+	      h = (ldap_shm_header_t *) p;
+
+	      /* a new file is all zeroes */
+	      if (writable && h->lsh_magic == 0)
+		{
+		  h->lsh_version = LDAP_SHM_VERSION;
+		  h->lsh_records = LDAP_SHM_RECORDS;
+		  h->lsh_record_size = LDAP_SHM_RECORD_SIZE;
+		  h->lsh_pointer_size = sizeof (void *);
+		  h->lsh_long_size = sizeof (long);
+		  h->lsh_time_size = sizeof (time_t);
+		  __sync_synchronize ();
+		  h->lsh_magic = LDAP_SHM_MAGIC;
+		}
+
+	      if (h->lsh_magic == LDAP_SHM_MAGIC &&
+		  h->lsh_version == LDAP_SHM_VERSION &&
+		  h->lsh_records == LDAP_SHM_RECORDS &&
+		  h->lsh_record_size == LDAP_SHM_RECORD_SIZE &&
+		  h->lsh_pointer_size == sizeof (void *) &&
+		  h->lsh_long_size == sizeof (long) &&
+		  h->lsh_time_size == sizeof (time_t))
+		{
+		  __shm_base = (char *) p;
+		  __shm_writable = writable;
+		}
+	      else
+		{
+		  syslog (LOG_ERR, "nss_ldap: ignoring incompatible cache file %s",
+			  cfg->ldc_shm_cache);
+		  munmap (p, LDAP_SHM_FILE_SIZE);
+		}
+	    }
+	}
+      close (fd);
+    }
+
+  __sync_synchronize ();
+  __shm_tried = 1;
+
+  NSS_LDAP_UNLOCK (__shm_lock);
+
+  debug ("<== do_shm_map: %s", __shm_base != NULL ? "mapped" : "not mapped");
+
+  return __shm_base;
+}
+
+/*
+ * Unlike the in-process cache, which keys on the address of the
+ * filter, this keys on the map and the configuration file, which
+ * are known before the filters are.
+ */
+static unsigned int
+do_shm_hash (ldap_config_t * cfg, const ldap_args_t * args,
+	     ldap_map_selector_t sel)
+{
+  unsigned int h = 2166136261U;
+  const unsigned char *p;
+  unsigned long n;
+  size_t i;
+
+  h = (h ^ (unsigned int) sel) * 16777619U;
+
+  if (cfg->ldc_config_filename != NULL)
+    {
+      for (p = (const unsigned char *) cfg->ldc_config_filename;
+	   *p != '\0'; p++)
+	h = (h ^ *p) * 16777619U;
+    }
+
+  h = (h ^ (unsigned int) args->la_type) * 16777619U;
+
+  if (args->la_type == LA_TYPE_STRING)
+    {
+      for (p = (const unsigned char *) args->la_arg1.la_string; *p != '\0';
+	   p++)
+	h = (h ^ *p) * 16777619U;
+    }
+  else
+    {
+      n = (unsigned long) args->la_arg1.la_number;
+      for (i = 0; i < sizeof (n); i++, n >>= 8)
+	h = (h ^ (n & 0xff)) * 16777619U;
+    }
+
+  return h;
+}
+
+/*
+ * Checksum of a record and its entry, so that readers can tell a
+ * record two writers have filled at once.
+ */
+static unsigned int
+do_shm_checksum (const ldap_shm_record_t * r, const char *entry)
+{
+  unsigned int h = 2166136261U;
+  const unsigned char *p, *end;
+
+  p = (const unsigned char *) r + LDAP_SHM_SUM_OFFSET;
+  end = (const unsigned char *) r + sizeof (*r);
+  for (; p < end; p++)
+    h = (h ^ *p) * 16777619U;
+
+  p = (const unsigned char *) entry;
+  end = p + r->lsr_datalen;
+  for (; p < end; p++)
+    h = (h ^ *p) * 16777619U;
+
+  return h;
+}
+
+static ldap_shm_record_t *
+do_shm_record (char *base, unsigned int hash)
+{
+  return (ldap_shm_record_t *) (base + LDAP_SHM_RECORD_SIZE *
+				(1 + hash % LDAP_SHM_RECORDS));
+}
+
+static int
+do_shm_get (ldap_config_t * cfg, int map,
+	    const ldap_args_t * args,
+	    ldap_map_selector_t sel, void *result,
+	    char *buffer, size_t buflen, int *errnop, NSS_STATUS * statp)
+{
+  union
+  {
+    char buf[LDAP_SHM_ENTRY_SIZE];
+    void *p;
+    long l;
+    double d;
+  } entry;
+  ldap_shm_record_t *r, copy;
+  unsigned int hash, seq;
+  char *base;
+  size_t needed;
+
+  /* records have the secret field blanked, which root should see */
+  if (geteuid () == 0)
+    return 0;
+
+  base = do_shm_map (cfg);
+  if (base == NULL)
+    return 0;
+
+  hash = do_shm_hash (cfg, args, sel);
+  r = do_shm_record (base, hash);
+
+  seq = r->lsr_seq;
+  if (seq & 1)
+    return 0;
+
+  __sync_synchronize ();
+
+  memcpy (&copy, (const void *) r, sizeof (copy));
+  if (copy.lsr_datalen > LDAP_SHM_ENTRY_SIZE)
+    return 0;
+  memcpy (entry.buf, (char *) r + LDAP_SHM_ENTRY_OFFSET, copy.lsr_datalen);
+
+  __sync_synchronize ();
+
+  /* the copy is only consistent if no writer intervened */
+  if (r->lsr_seq != seq ||
+      copy.lsr_checksum != do_shm_checksum (&copy, entry.buf))
+    return 0;
+
+  if (copy.lsr_hash != hash || copy.lsr_sel != (int) sel ||
+      copy.lsr_type != (int) args->la_type ||
+      copy.lsr_config_mtime != cfg->ldc_mtime ||
+      copy.lsr_expires < time (NULL))
+    return 0;
+
+  if (args->la_type == LA_TYPE_STRING)
+    {
+      copy.lsr_string[LDAP_SHM_KEYSIZ - 1] = '\0';
+      if (strcmp (copy.lsr_string, args->la_arg1.la_string) != 0)
+	return 0;
+    }
+  else if (copy.lsr_number != args->la_arg1.la_number)
+    {
+      return 0;
+    }
+
+  debug (":== do_shm_get: hit");
+
+  *statp = (NSS_STATUS) copy.lsr_stat;
+
+  if (*statp == NSS_SUCCESS)
+    {
+      (*__cache_maps[map].reloc) (entry.buf, NULL, entry.buf);
+      needed = (*__cache_maps[map].copier) (entry.buf, result,
+					    buffer, buflen);
+      if (needed > buflen)
+	{
+	  *errnop = ERANGE;
+	  *statp = NSS_TRYAGAIN;
+	}
+    }
+
+  return 1;
+}
+
+static void
+do_shm_put (ldap_config_t * cfg, int map,
+	    const ldap_args_t * args,
+	    ldap_map_selector_t sel, NSS_STATUS stat,
+	    const void *result, time_t ttl)
+{
+  union
+  {
+    struct passwd pw;
+    struct group gr;
+  } tmp;
+  union
+  {
+    char buf[LDAP_SHM_ENTRY_SIZE];
+    void *p;
+    long l;
+    double d;
+  } entry;
+  ldap_shm_record_t *r, rec;
+  unsigned int seq;
+  size_t size = 0, datalen = 0;
+  char *base, **secret;
+  time_t now;
+
+  base = do_shm_map (cfg);
+  if (base == NULL || !__shm_writable)
+    return;
+
+  if (args->la_type == LA_TYPE_STRING &&
+      strlen (args->la_arg1.la_string) >= LDAP_SHM_KEYSIZ)
+    return;
+
+  now = time (NULL);
+
+  /* build the record privately, so that it is only copied in place */
+  memset (&rec, 0, sizeof (rec));
+  rec.lsr_claimed = now;
+  rec.lsr_hash = do_shm_hash (cfg, args, sel);
+  rec.lsr_sel = sel;
+  rec.lsr_type = args->la_type;
+  rec.lsr_stat = stat;
+  rec.lsr_expires = now + ttl;
+  rec.lsr_config_mtime = cfg->ldc_mtime;
+
+  if (args->la_type == LA_TYPE_STRING)
+    strcpy (rec.lsr_string, args->la_arg1.la_string);
+  else
+    rec.lsr_number = args->la_arg1.la_number;
+
+  if (stat == NSS_SUCCESS)
+    {
+      size = __cache_maps[map].size;
+      assert (size <= sizeof (tmp));
+
+      memcpy (&tmp, result, size);
+      secret = (char **) ((char *) &tmp + __cache_maps[map].secret);
+      if (*secret != NULL)
+	*secret = "x";
+
+      datalen = (*__cache_maps[map].copier) (&tmp, NULL, NULL, 0);
+      if (size + datalen > LDAP_SHM_ENTRY_SIZE)
+	return;
+
+      (void) (*__cache_maps[map].copier) (&tmp, entry.buf, entry.buf + size,
+					  LDAP_SHM_ENTRY_SIZE - size);
+      (*__cache_maps[map].reloc) (entry.buf, entry.buf, NULL);
+      rec.lsr_datalen = size + datalen;
+    }
+
+  rec.lsr_checksum = do_shm_checksum (&rec, entry.buf);
+
+  r = do_shm_record (base, rec.lsr_hash);
+
+  /*
+   * Claim the record; if another writer has it, let that one win,
+   * unless it claimed the record too long ago to be still alive.
+   */
+  seq = r->lsr_seq;
+  if (seq & 1)
+    {
+      if (r->lsr_claimed + LDAP_SHM_CLAIM_TIMEOUT >= now ||
+	  !__sync_bool_compare_and_swap (&r->lsr_seq, seq, seq + 2))
+	return;
+      seq++;
+      debug (":== do_shm_put: reclaimed a stale record");
+    }
+  else if (!__sync_bool_compare_and_swap (&r->lsr_seq, seq, seq + 1))
+    return;
+
+  memcpy ((char *) r + LDAP_SHM_FILL_OFFSET,
+	  (const char *) &rec + LDAP_SHM_FILL_OFFSET,
+	  sizeof (rec) - LDAP_SHM_FILL_OFFSET);
+  memcpy ((char *) r + LDAP_SHM_ENTRY_OFFSET, entry.buf, rec.lsr_datalen);
+
+  /* publish, unless the record was reclaimed from under us */
+  if (!__sync_bool_compare_and_swap (&r->lsr_seq, seq + 1, seq + 2))
+    return;
+
+  debug (":== do_shm_put: stored");
+}
+#endif /* LDAP_CACHE_SHM */
@@ -0,0 +1,96 @@
+/* This file is part of the nss_ldap library.
+
+   The nss_ldap library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The nss_ldap library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the nss_ldap library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _LDAP_NSS_LDAP_LDAP_CACHE_H
+#define _LDAP_NSS_LDAP_LDAP_CACHE_H
+
+/*
+ * In-process cache of parsed entries returned by
+ * _nss_ldap_getbyname(), keyed by map selector, filter, arguments
+ * and whether the caller is root. Negative results are cached too.
+ * If nss_shm_cache is set, misses by other users are looked up in
+ * a file mapped by all processes, which root processes fill.
+ */
+
+/*
+ * Copies a parsed entry, and the strings it refers to, into dst
+ * and buffer. Returns the buffer space needed for the copy; the
+ * copy is only complete if that is no more than buflen. If dst
+ * is NULL, only the size is computed.
+ */
+typedef size_t (*ldap_cache_copier_t) (const void *src, void *dst,
+				       char *buffer, size_t buflen);
+
+/*
+ * Look up a cached result; returns non-zero on a hit, with the
+ * entry copied into result and buffer and its status in *statp.
+ */
+int _nss_ldap_cache_get (ldap_config_t * cfg,
+			 const ldap_args_t * args,
+			 const char *filterprot,
+			 ldap_map_selector_t sel,
+			 void *result,
+			 char *buffer, size_t buflen,
+			 int *errnop, NSS_STATUS * statp);
+
+/*
+ * Record the outcome of a lookup; stat is NSS_SUCCESS with the
+ * parsed entry in result, or NSS_NOTFOUND.
+ */
+void _nss_ldap_cache_put (ldap_config_t * cfg,
+			  const ldap_args_t * args,
+			  const char *filterprot,
+			  ldap_map_selector_t sel,
+			  NSS_STATUS stat, const void *result);
+
+/*
+ * Discard all cached entries.
+ */
+void _nss_ldap_cache_flush (void);
+
+/*
+ * Helper for copiers: copy a string into the buffer if it fits,
+ * adding its size to *needed.
+ */
+char *_nss_ldap_cache_copy_string (const char *s, char **buffer,
+				   size_t * buflen, size_t * needed);
+
+/*
+ * Rebases the pointers of a copied entry, which together with the
+ * strings it refers to occupies a contiguous block at ent, so that
+ * addresses relative to from become relative to to. Entries in the
+ * shared cache file are stored relative to a base of zero.
+ */
+typedef void (*ldap_cache_reloc_t) (void *ent, const char *from,
+				    const char *to);
+
+#define NSS_LDAP_RELOC(p, from, to)	do { \
+		if ((p) != NULL) \
+			(p) = (void *) ((size_t) (p) - (size_t) (from) + \
+					(size_t) (to)); \
+	} while (0)
+
+/* copiers for the cached maps */
+size_t _nss_ldap_copy_pw (const void *src, void *dst,
+			  char *buffer, size_t buflen);
+size_t _nss_ldap_copy_gr (const void *src, void *dst,
+			  char *buffer, size_t buflen);
+void _nss_ldap_reloc_pw (void *ent, const char *from, const char *to);
+void _nss_ldap_reloc_gr (void *ent, const char *from, const char *to);
+
+#endif /* _LDAP_NSS_LDAP_LDAP_CACHE_H */
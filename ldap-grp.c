@@ -54,6 +54,7 @@ static char rcsId[] =
 
 #include "ldap-nss.h"
 #include "ldap-grp.h"
+#include "ldap-cache.h"
 #include "util.h"
 
 #ifdef HAVE_PORT_AFTER_H
@@ -70,8 +71,12 @@ typedef struct ldap_initgroups_args
   char *grplist;
   size_t listlen;
   int depth;
-  struct name_list *known_groups;
+  void *known_groups;
+  char **next_level;
+  size_t next_count;
+  size_t next_size;
   int backlink;
+  int chain_hits;
 }
 ldap_initgroups_args_t;
 #else
@@ -80,8 +85,16 @@ typedef struct ldap_initgroups_args
 {
   struct nss_groupsbymem *gbm;
   int depth;
-  struct name_list *known_groups;
+  void *known_groups;
+  char **next_level;
+  size_t next_count;
+  size_t next_size;
   int backlink;
+  int chain_hits;
+  gid_t *gid_set;
+  size_t gid_set_count;
+  size_t gid_set_size;
+  int gid_set_has_empty;
 }
 ldap_initgroups_args_t;
 # else
@@ -93,18 +106,28 @@ typedef struct ldap_initgroups_args
   gid_t **groups;
   long int limit;
   int depth;
-  struct name_list *known_groups;
+  void *known_groups;
+  char **next_level;
+  size_t next_count;
+  size_t next_size;
   int backlink;
+  int chain_hits;
+  gid_t *gid_set;
+  size_t gid_set_count;
+  size_t gid_set_size;
+  int gid_set_has_empty;
 }
 ldap_initgroups_args_t;
 # endif
+
+/* marks a free slot in the open-addressed gid set */
+#define NG_GID_SET_EMPTY	((gid_t) -1)
 #endif /* HAVE_USERSEC_H */
 
 static NSS_STATUS
-ng_chase (const char *dn, ldap_initgroups_args_t * lia);
-
+ng_remember (ldap_initgroups_args_t * lia, const char *dn);
 static NSS_STATUS
-ng_chase_backlink (const char ** membersOf, ldap_initgroups_args_t * lia);
+ng_enqueue (ldap_initgroups_args_t * lia, const char *dn);
 
 /*
  * Range retrieval logic was reimplemented from example in
@@ -146,7 +169,7 @@ do_parse_range (const char *attributeType,
     }
 
   /* XXX need to copy as strtok() is destructive */
-  attribute = strdup (attributeDescription);
+  attribute = _nss_ldap_arena_strdup (attributeDescription);
   if (attribute == NULL)
     {
       debug ("<== do_parse_range: returns NSS_TRYAGAIN");
@@ -166,7 +189,6 @@ do_parse_range (const char *attributeType,
 	{
 	  if (strcasecmp (p, attributeType) != 0)
 	    {
-	      free (attribute);
 	      debug ("<== do_parse_range: returns NSS_NOTFOUND");
 	      return NSS_NOTFOUND;
 	    }
@@ -178,7 +200,6 @@ do_parse_range (const char *attributeType,
 	  q = strchr (p, '-');
 	  if (q == NULL)
 	    {
-	      free (attribute);
 	      debug ("<== do_parse_range: returns NSS_NOTFOUND");
 	      return NSS_NOTFOUND;
 	    }
@@ -196,7 +217,6 @@ do_parse_range (const char *attributeType,
 	}
     }
 
-  free (attribute);
   debug ("<== do_parse_range: returns %s(%d)", __nss_ldap_status2string(stat), stat);
   return stat;
 }
@@ -327,9 +347,12 @@ do_parse_group_members (LDAPMessage * e,
   LDAPMessage *res = NULL;
   int start, end = 0;
   char *groupdn = NULL;
+  ldap_async_read_t nextRange;
 
   debug ("==> do_parse_group_members");
 
+  nextRange.lar_msgid = -1;
+
   uniquemember_attr = ATM (LM_GROUP, uniqueMember);
 
   uniquemember_attrs[0] = uniquemember_attr;
@@ -358,7 +381,7 @@ do_parse_group_members (LDAPMessage * e,
     }
 
   /* store group DN for nested group loop detection */
-  stat = _nss_ldap_namelist_push (pKnownGroups, groupdn);
+  stat = _nss_ldap_namelist_push_arena (pKnownGroups, groupdn);
   if (stat != NSS_SUCCESS)
     {
       goto out;
@@ -388,10 +411,33 @@ do_parse_group_members (LDAPMessage * e,
 	  groupMembersCount += ldap_count_values (uidValues);
 	}
 
+      /*
+       * Ask for the next range for Active Directory compat now, so
+       * that the server returns it while we resolve this one. The
+       * range is left open so that the server sizes each slice.
+       */
+      if (end != -1)
+	{
+	  stat = do_construct_range_attribute (uniquemember_attr,
+					       end + 1,
+					       -1,
+					       buffer,
+					       buflen,
+					       &uniquemember_attrs[0]);
+	  if (stat != NSS_SUCCESS)
+	    goto out;
+
+	  /* on failure, the range is read synchronously below */
+	  (void) _nss_ldap_read_async (groupdn, uniquemember_attrs,
+				       &nextRange);
+	}
+
       /*
        * Check whether we need to increase the group membership buffer.
        * As an optimization the buffer is preferentially allocated off
-       * the stack
+       * the stack. It stays on the heap rather than in the lookup
+       * arena, as it grows with every range of a large group and the
+       * arena could only extend it in place if nothing came between.
        */
       if ((*pGroupMembersCount + groupMembersCount) * sizeof (char *) >=
 	  *pGroupMembersBufferSize)
@@ -414,7 +460,7 @@ do_parse_group_members (LDAPMessage * e,
 	    (char **) realloc (*pGroupMembers, *pGroupMembersBufferSize);
 	  if (*pGroupMembers == NULL)
 	    {
-	      *pGroupMembersBufferIsMalloced = 0; /* don't try to free */
+	      /* groupMembers is still the old buffer, for the caller to free */
 	      stat = NSS_TRYAGAIN;
 	      goto out;
 	    }
@@ -433,11 +479,9 @@ do_parse_group_members (LDAPMessage * e,
       /* Parse distinguished name members */
       if (dnValues != NULL)
 	{
+	  /* strip any optional UID from nameAndOptionalUID syntax */
 	  for (valiter = dnValues; *valiter != NULL; valiter++)
 	    {
-	      LDAPMessage *res;
-	      NSS_STATUS parseStat;
-	      int isNestedGroup = 0;
 	      char *uid;
 
 	      uid = strrchr (*valiter, '#');
@@ -445,6 +489,16 @@ do_parse_group_members (LDAPMessage * e,
 		{
 		  *uid = '\0';
 		}
+	    }
+
+	  /* resolve uncached members in a few searches, not one each */
+	  _nss_ldap_dn2uid_prefetch (dnValues);
+
+	  for (valiter = dnValues; *valiter != NULL; valiter++)
+	    {
+	      LDAPMessage *res;
+	      NSS_STATUS parseStat;
+	      int isNestedGroup = 0;
 
 	      parseStat = _nss_ldap_dn2uid (*valiter, &groupMembers[i],
 					    buffer, buflen, &isNestedGroup,
@@ -505,47 +559,48 @@ do_parse_group_members (LDAPMessage * e,
 	    }
 	}
 
-      /* Get next range for Active Directory compat */
+      /* Collect the next range for Active Directory compat */
       if (end != -1)
 	{
-	  stat = do_construct_range_attribute (uniquemember_attr,
-					       end + 1,
-					       -1,
-					       buffer,
-					       buflen,
-					       &uniquemember_attrs[0]);
-	  if (stat == NSS_SUCCESS)
+	  if (dnValues != NULL)
 	    {
-	      if (dnValues != NULL)
-		{
-		  debug (":== do_parse_group_members: call ldap_value_free on dnValues");
-		  ldap_value_free (dnValues);
-		  dnValues = NULL;
-		}
-	      if (uidValues != NULL)
-		{
-		  debug (":== do_parse_group_members: call ldap_value_free on uidValues");
-		  ldap_value_free (uidValues);
-		  uidValues = NULL;
-		}
-	      if (res != NULL)
-		{
-		  debug (":== do_parse_group_members: call ldap_msgfree");
-		  ldap_msgfree (res);
-		  res = NULL;
-		}
+	      debug (":== do_parse_group_members: call ldap_value_free on dnValues");
+	      ldap_value_free (dnValues);
+	      dnValues = NULL;
+	    }
+	  if (uidValues != NULL)
+	    {
+	      debug (":== do_parse_group_members: call ldap_value_free on uidValues");
+	      ldap_value_free (uidValues);
+	      uidValues = NULL;
+	    }
+	  if (res != NULL)
+	    {
+	      debug (":== do_parse_group_members: call ldap_msgfree");
+	      ldap_msgfree (res);
+	      res = NULL;
+	    }
 
+	  stat = _nss_ldap_read_result (&nextRange, &res);
+	  if (stat == NSS_TRYAGAIN)
+	    {
+	      /* the pipelined read was lost; read the range again */
 	      stat = _nss_ldap_read (groupdn, uniquemember_attrs, &res);
-	      if (stat != NSS_SUCCESS)
-		goto out;
-
-	      e = _nss_ldap_first_entry (res);
 	    }
+	  if (stat != NSS_SUCCESS)
+	    goto out;
+
+	  e = _nss_ldap_first_entry (res);
 	}
     }
   while (end != -1);
 
 out:
+  if (nextRange.lar_msgid >= 0)
+    {
+      debug (":== do_parse_group_members: abandon next range");
+      _nss_ldap_read_abandon (&nextRange);
+    }
   if (dnValues != NULL)
     {
       debug (":== do_parse_group_members: call ldap_value_free on dnValues");
@@ -684,7 +739,6 @@ _nss_ldap_parse_gr (LDAPMessage * e,
 	{
 	  if (groupMembersBufferIsMalloced)
 	    free (groupMembers);
-	  _nss_ldap_namelist_destroy (&knownGroups);
 	  debug ("<== _nss_ldap_parse_gr: returns %s(%d)", __nss_ldap_status2string(stat), stat);
 	  return stat;
 	}
@@ -694,7 +748,6 @@ _nss_ldap_parse_gr (LDAPMessage * e,
 
       if (groupMembersBufferIsMalloced)
 	free (groupMembers);
-      _nss_ldap_namelist_destroy (&knownGroups);
     }
   else
     {
@@ -707,6 +760,302 @@ _nss_ldap_parse_gr (LDAPMessage * e,
   return stat;
 }
 
+/*
+ * RFC 2307bis members are only known once member DNs and nested
+ * groups have been resolved, so expand them as the parser does, into
+ * scratch buffers that double in size until they fit, and add the
+ * space used to *size.
+ */
+static NSS_STATUS
+do_size_group_members (LDAPMessage * e, size_t * pGroupMembersCount,
+		       size_t * size)
+{
+  NSS_STATUS stat = NSS_TRYAGAIN;
+  char *scratch, *buffer;
+  size_t scratchlen, buflen = 0;
+  char **groupMembers;
+  size_t groupMembersCount = 0, groupMembersAttrCount;
+  size_t groupMembersBufferSize;
+  char *groupMembersBuffer[LDAP_NSS_NGROUPS];
+  int groupMembersBufferIsMalloced;
+  int depth;
+  struct name_list *knownGroups;
+
+  debug ("==> do_size_group_members");
+
+  for (scratchlen = LDAP_NSS_BUFLEN_GROUP;
+       stat == NSS_TRYAGAIN && scratchlen <= LDAP_NSS_BUFLEN_HINT_MAX;
+       scratchlen *= 2)
+    {
+      scratch = (char *) malloc (scratchlen);
+      if (scratch == NULL)
+	break;
+
+      groupMembers = groupMembersBuffer;
+      groupMembersAttrCount = 0;
+      groupMembersCount = 0;
+      groupMembersBufferSize = sizeof (groupMembersBuffer);
+      groupMembersBufferIsMalloced = 0;
+      depth = 0;
+      knownGroups = NULL;
+      buffer = scratch;
+      buflen = scratchlen;
+
+      stat = do_parse_group_members (e, &groupMembers,
+				     &groupMembersAttrCount,
+				     &groupMembersCount,
+				     &groupMembersBufferSize,
+				     &groupMembersBufferIsMalloced, &buffer,
+				     &buflen, &depth, &knownGroups, 0);
+
+      if (groupMembersBufferIsMalloced)
+	free (groupMembers);
+      free (scratch);
+
+      if (stat == NSS_SUCCESS)
+	{
+	  *size += scratchlen - buflen;
+	  *pGroupMembersCount = groupMembersCount;
+	}
+    }
+
+  debug ("<== do_size_group_members: returns %s(%d)", __nss_ldap_status2string(stat), stat);
+
+  return stat;
+}
+
+/*
+ * The buffer space _nss_ldap_parse_gr() needs for e.
+ */
+NSS_STATUS
+_nss_ldap_size_gr (LDAPMessage * e, ldap_state_t * pvt, size_t * size)
+{
+  NSS_STATUS stat;
+  size_t groupMembersCount;
+
+  debug ("==> _nss_ldap_size_gr");
+
+  *size = 0;
+
+  stat = _nss_ldap_size_attrval (e, ATM (LM_GROUP, gidNumber), size);
+  if (stat == NSS_SUCCESS)
+    stat = _nss_ldap_size_attrval (e, ATM (LM_GROUP, cn), size);
+  if (stat == NSS_SUCCESS)
+    stat = _nss_ldap_size_userpassword (e, ATM (LM_GROUP, userPassword),
+					size);
+  if (stat != NSS_SUCCESS)
+    {
+      debug ("<== _nss_ldap_size_gr: returns %s(%d)", __nss_ldap_status2string(stat), stat);
+      return stat;
+    }
+
+  if (_nss_ldap_test_config_flag (NSS_LDAP_FLAGS_RFC2307BIS))
+    {
+      stat = do_size_group_members (e, &groupMembersCount, size);
+      if (stat == NSS_SUCCESS)
+	{
+	  /* as do_fix_group_members_buffer(), at the worst alignment */
+	  *size += alignof (char *) - 1 +
+	    (groupMembersCount + 1) * sizeof (char *);
+	}
+    }
+  else
+    {
+      stat = _nss_ldap_size_attrvals (e, ATM (LM_GROUP, memberUid), NULL,
+				      size);
+    }
+
+  debug ("<== _nss_ldap_size_gr: returns %s(%d)", __nss_ldap_status2string(stat), stat);
+  return stat;
+}
+
+/*
+ * Copy a parsed group entry, for the entry cache.
+ */
+size_t
+_nss_ldap_copy_gr (const void *src, void *dst, char *buffer, size_t buflen)
+{
+  const struct group *from = (const struct group *) src;
+  struct group tmp;
+  struct group *gr = (dst != NULL) ? (struct group *) dst : &tmp;
+  size_t needed, len;
+  char *member;
+  int i, n;
+
+  *gr = *from;
+
+  for (n = 0; from->gr_mem != NULL && from->gr_mem[n] != NULL; n++)
+    ;
+
+  /* the member array is pointer aligned; allow for the padding */
+  len = (n + 1) * sizeof (char *);
+  needed = len + alignof (char *) - 1;
+
+  gr->gr_mem = NULL;
+  if (buffer != NULL && bytesleft (buffer, buflen, char *) >= len)
+    {
+      align (buffer, buflen, char *);
+      gr->gr_mem = (char **) buffer;
+      buffer += len;
+      buflen -= len;
+    }
+  else
+    {
+      buflen = 0;
+    }
+
+  gr->gr_name =
+    _nss_ldap_cache_copy_string (from->gr_name, &buffer, &buflen, &needed);
+  gr->gr_passwd =
+    _nss_ldap_cache_copy_string (from->gr_passwd, &buffer, &buflen, &needed);
+
+  for (i = 0; i < n; i++)
+    {
+      member = _nss_ldap_cache_copy_string (from->gr_mem[i], &buffer, &buflen,
+					    &needed);
+      if (gr->gr_mem != NULL)
+	gr->gr_mem[i] = member;
+    }
+  if (gr->gr_mem != NULL)
+    gr->gr_mem[n] = NULL;
+
+  return needed;
+}
+
+void
+_nss_ldap_reloc_gr (void *ent, const char *from, const char *to)
+{
+  struct group *gr = (struct group *) ent;
+  char **mem;
+  int i;
+
+  NSS_LDAP_RELOC (gr->gr_name, from, to);
+  NSS_LDAP_RELOC (gr->gr_passwd, from, to);
+
+  if (gr->gr_mem != NULL)
+    {
+      /* find the member array within the block before rebasing it */
+      mem = (char **) ((char *) ent +
+		       ((size_t) gr->gr_mem - (size_t) from));
+      for (i = 0; mem[i] != NULL; i++)
+	NSS_LDAP_RELOC (mem[i], from, to);
+
+      NSS_LDAP_RELOC (gr->gr_mem, from, to);
+    }
+}
+
+#ifndef HAVE_USERSEC_H
+static size_t
+ng_gid_hash (gid_t gid, size_t size)
+{
+  /* Fibonacci hashing; size is always a power of two */
+  return (size_t) (((unsigned long) gid * 2654435761UL) & (size - 1));
+}
+
+/*
+ * Insert gid into the per-call set of groups already returned.
+ * Returns NSS_SUCCESS if the gid was added, NSS_NOTFOUND if it
+ * was already present, and NSS_TRYAGAIN if the table could not
+ * be grown.
+ */
+static NSS_STATUS
+ng_gid_set_add (ldap_initgroups_args_t * lia, gid_t gid)
+{
+  size_t i;
+
+  if (gid == NG_GID_SET_EMPTY)
+    {
+      /* cannot be stored in the table, so track it separately */
+      if (lia->gid_set_has_empty)
+	return NSS_NOTFOUND;
+      lia->gid_set_has_empty = 1;
+      return NSS_SUCCESS;
+    }
+
+  /* keep the load factor at or below one half */
+  if (2 * (lia->gid_set_count + 1) > lia->gid_set_size)
+    {
+      gid_t *old_set = lia->gid_set;
+      size_t old_size = lia->gid_set_size;
+      size_t new_size = (old_size == 0) ? 2 * LDAP_NSS_NGROUPS : 2 * old_size;
+      gid_t *new_set;
+
+      new_set = (gid_t *) malloc (new_size * sizeof (gid_t));
+      if (new_set == NULL)
+	return NSS_TRYAGAIN;
+
+      for (i = 0; i < new_size; i++)
+	new_set[i] = NG_GID_SET_EMPTY;
+
+      for (i = 0; i < old_size; i++)
+	{
+	  size_t j;
+
+	  if (old_set[i] == NG_GID_SET_EMPTY)
+	    continue;
+
+	  j = ng_gid_hash (old_set[i], new_size);
+	  while (new_set[j] != NG_GID_SET_EMPTY)
+	    j = (j + 1) & (new_size - 1);
+	  new_set[j] = old_set[i];
+	}
+
+      if (old_set != NULL)
+	free (old_set);
+
+      lia->gid_set = new_set;
+      lia->gid_set_size = new_size;
+    }
+
+  i = ng_gid_hash (gid, lia->gid_set_size);
+  while (lia->gid_set[i] != NG_GID_SET_EMPTY)
+    {
+      if (lia->gid_set[i] == gid)
+	return NSS_NOTFOUND;
+      i = (i + 1) & (lia->gid_set_size - 1);
+    }
+
+  lia->gid_set[i] = gid;
+  lia->gid_set_count++;
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Build the gid set from the groups the caller handed us, so that
+ * entries already in the list (such as the primary group) are
+ * weeded out along with those we add ourselves.
+ */
+static NSS_STATUS
+ng_gid_set_seed (ldap_initgroups_args_t * lia)
+{
+  long int i, count;
+  gid_t *list;
+  NSS_STATUS stat;
+
+# ifdef HAVE_NSSWITCH_H
+  list = lia->gbm->gid_array;
+  count = lia->gbm->numgids;
+# else
+  list = *(lia->groups);
+  count = (list != NULL) ? *(lia->start) : 0;
+
+  stat = ng_gid_set_add (lia, lia->group);
+  if (stat == NSS_TRYAGAIN)
+    return stat;
+# endif /* HAVE_NSSWITCH_H */
+
+  for (i = 0; i < count; i++)
+    {
+      stat = ng_gid_set_add (lia, list[i]);
+      if (stat == NSS_TRYAGAIN)
+	return stat;
+    }
+
+  return NSS_SUCCESS;
+}
+#endif /* !HAVE_USERSEC_H */
+
 /*
  * Add a group ID to a group list, and optionally the group IDs
  * of any groups to which this group belongs (RFC2307bis nested
@@ -718,9 +1067,13 @@ do_parse_initgroups (LDAPMessage * e,
 		     char *buffer, size_t buflen)
 {
   char **values;
-  ssize_t i;
   gid_t gid;
   ldap_initgroups_args_t *lia = (ldap_initgroups_args_t *) result;
+#ifdef HAVE_USERSEC_H
+  ssize_t i;
+#else
+  NSS_STATUS stat;
+#endif
 
   debug ("==> do_parse_initgroups");
 
@@ -766,17 +1119,25 @@ do_parse_initgroups (LDAPMessage * e,
       return NSS_NOTFOUND;
     }
 
-# ifdef HAVE_NSSWITCH_H
-  /* weed out duplicates; is this really our resposibility? */
-  for (i = 0; i < lia->gbm->numgids; i++)
+  if (lia->gid_set == NULL)
     {
-      if (lia->gbm->gid_array[i] == (gid_t) gid)
+      stat = ng_gid_set_seed (lia);
+      if (stat != NSS_SUCCESS)
 	{
-	  debug ("<== do_parse_initgroups: returns NSS_NOTFOUND");
-	  return NSS_NOTFOUND;
+	  debug ("<== do_parse_initgroups: returns NSS_TRYAGAIN");
+	  return stat;
 	}
     }
 
+# ifdef HAVE_NSSWITCH_H
+  /* weed out duplicates; is this really our resposibility? */
+  stat = ng_gid_set_add (lia, (gid_t) gid);
+  if (stat != NSS_SUCCESS)
+    {
+      debug ("<== do_parse_initgroups: returns %d", stat);
+      return stat;
+    }
+
   if (lia->gbm->numgids == lia->gbm->maxgids)
     {
       /* can't fit any more */
@@ -836,13 +1197,11 @@ do_parse_initgroups (LDAPMessage * e,
     }
 
   /* weed out duplicates; is this really our responsibility? */
-  for (i = 0; i < *(lia->start); i++)
+  stat = ng_gid_set_add (lia, gid);
+  if (stat != NSS_SUCCESS)
     {
-      if ((*(lia->groups))[i] == gid)
-	{
-	  debug ("<== do_parse_initgroups: returns NSS_NOTFOUND");
-	  return NSS_NOTFOUND;
-	}
+      debug ("<== do_parse_initgroups: returns %d", stat);
+      return stat;
     }
 
   /* add to group list */
@@ -879,41 +1238,36 @@ do_parse_initgroups_nested (LDAPMessage * e,
       return NSS_NOTFOUND;
     }
 
+  /*
+   * Queue the groups to search at the next level; ng_chase()
+   * expands them once this level has been read.
+   */
   if (lia->backlink != 0)
     {
-      /*
-       * Now add the GIDs of any groups of which this group is
-       * a member.
-       */
+      /* the groups of which this group is a member */
       values = _nss_ldap_get_values (e, ATM (LM_GROUP, memberOf));
       if (values != NULL)
 	{
-	  NSS_STATUS stat;
+	  char **valiter;
 
-	  lia->depth++;
-	  stat = ng_chase_backlink ((const char **)values, lia);
-	  lia->depth--;
+	  for (valiter = values; *valiter != NULL; valiter++)
+	    {
+	      stat = ng_enqueue (lia, *valiter);
+	      if (stat != NSS_NOTFOUND)
+		break;
+	    }
 
 	  debug ("<== do_parse_initgroups_nested: calls ldap_value_free");
 	  ldap_value_free (values);
- 
-	  debug ("<== do_parse_initgroups_nested: returns %s(%d)", __nss_ldap_status2string(stat), stat);
-	  return stat;
 	}
     }
   else
     {
-      /*
-       * Now add the GIDs of any groups which refer to this group
-       */
+      /* the groups which refer to this group */
       groupdn = _nss_ldap_get_dn (e);
       if (groupdn != NULL)
 	{
-	  NSS_STATUS stat;
-
-	  lia->depth++;
-	  stat = ng_chase (groupdn, lia);
-	  lia->depth--;
+	  stat = ng_enqueue (lia, groupdn);
 #ifdef HAVE_LDAP_MEMFREE
 	  debug ("<== do_parse_initgroups_nested: calls ldap_memfree");
 	  ldap_memfree (groupdn);
@@ -927,25 +1281,70 @@ do_parse_initgroups_nested (LDAPMessage * e,
   return stat;
 }
 
+/*
+ * Parser for groups found with the in-chain matching rule; these
+ * already include nested groups, so there is nothing to chase.
+ * They are remembered so that chasing the parents of groups found
+ * later by memberUid stops when it reaches one of them.
+ */
 static NSS_STATUS
-ng_chase (const char *dn, ldap_initgroups_args_t * lia)
+do_parse_initgroups_chain (LDAPMessage * e,
+			   ldap_state_t * pvt, void *result,
+			   char *buffer, size_t buflen)
+{
+  ldap_initgroups_args_t *lia = (ldap_initgroups_args_t *) result;
+  NSS_STATUS stat;
+  char *groupdn;
+
+  lia->chain_hits++;
+
+  stat = do_parse_initgroups (e, pvt, result, buffer, buflen);
+  if (stat != NSS_NOTFOUND)
+    return stat;
+
+  groupdn = _nss_ldap_get_dn (e);
+  if (groupdn != NULL)
+    {
+      stat = ng_remember (lia, groupdn);
+      if (stat == NSS_SUCCESS)
+	stat = NSS_NOTFOUND;
+#ifdef HAVE_LDAP_MEMFREE
+      ldap_memfree (groupdn);
+#else
+      free (groupdn);
+#endif
+    }
+
+  return stat;
+}
+
+/*
+ * Find the groups of which userdn is a direct or nested member
+ * with a single search using the in-chain matching rule, as
+ * supported by Active Directory. Sets *pDone unless the caller
+ * still needs to chase nested groups itself, either because the
+ * server rejected the rule or because, having found nothing on a
+ * server not yet known to support it, we cannot tell whether the
+ * rule was understood.
+ */
+static NSS_STATUS
+ng_chase_transitive (const char *userdn, ldap_initgroups_args_t * lia,
+		     int *errnop, int *pDone)
 {
   ldap_args_t a;
   NSS_STATUS stat;
   ent_context_t *ctx = NULL;
   const char *gidnumber_attrs[2];
-  int erange;
+  int state, rc;
 
-  debug ("==> ng_chase");
-  if (lia->depth > LDAP_NSS_MAXGR_DEPTH)
-    {
-      debug ("<== ns_chase: returns NSS_NOTFOUND");
-      return NSS_NOTFOUND;
-    }
+  debug ("==> ng_chase_transitive");
+
+  *pDone = 0;
 
-  if (_nss_ldap_namelist_find (lia->known_groups, dn))
+  state = _nss_ldap_get_transitive_state ();
+  if (state == NSS_LDAP_TRANSITIVE_REJECTED)
     {
-      debug ("<== ns_chase: returns NSS_NOTFOUND");
+      debug ("<== ng_chase_transitive: rejected by server");
       return NSS_NOTFOUND;
     }
 
@@ -953,121 +1352,201 @@ ng_chase (const char *dn, ldap_initgroups_args_t * lia)
   gidnumber_attrs[1] = NULL;
 
   LA_INIT (a);
-  LA_STRING (a) = dn;
+  LA_STRING (a) = userdn;
   LA_TYPE (a) = LA_TYPE_STRING;
 
   if (_nss_ldap_ent_context_init_internal_locked (&ctx) == NULL)
     {
-      debug ("<== ns_chase: returns NSS_UNAVAIL");
+      debug ("<== ng_chase_transitive: returns NSS_UNAVAIL");
       return NSS_UNAVAIL;
     }
 
-  stat = _nss_ldap_getent_ex (&a, &ctx, lia, NULL, 0,
-			      &erange, _nss_ldap_filt_getgroupsbydn,
+  lia->chain_hits = 0;
+
+  stat = _nss_ldap_getent_ex (&a, &ctx, lia, NULL, 0, errnop,
+			      _nss_ldap_filt_getgroupsbydn_chain,
 			      LM_GROUP, gidnumber_attrs,
-			      do_parse_initgroups_nested);
+			      do_parse_initgroups_chain);
 
-  if (stat == NSS_SUCCESS)
+  _nss_ldap_ent_context_release (&ctx);
+
+  rc = _nss_ldap_get_ld_errno (NULL, NULL);
+
+  if (stat == NSS_TRYAGAIN)
     {
-      stat = _nss_ldap_namelist_push (&lia->known_groups, dn);
+      /* the group list is full */
+      *pDone = 1;
+    }
+  else if (stat != NSS_UNAVAIL && lia->chain_hits > 0)
+    {
+      _nss_ldap_set_transitive_state (NSS_LDAP_TRANSITIVE_SUPPORTED);
+      *pDone = 1;
+    }
+  else if (rc == LDAP_INAPPROPRIATE_MATCHING || rc == LDAP_UNWILLING_TO_PERFORM
+	   || rc == LDAP_FILTER_ERROR || rc == LDAP_PROTOCOL_ERROR)
+    {
+      _nss_ldap_set_transitive_state (NSS_LDAP_TRANSITIVE_REJECTED);
+      stat = NSS_NOTFOUND;
+    }
+  else if (stat != NSS_UNAVAIL && state == NSS_LDAP_TRANSITIVE_SUPPORTED)
+    {
+      *pDone = 1;
     }
 
-  _nss_ldap_ent_context_release (&ctx);
-
-  debug ("<== ns_chase: returns %s(%d)", __nss_ldap_status2string(stat), stat);
+  debug ("<== ng_chase_transitive: returns %s(%d)", __nss_ldap_status2string(stat), stat);
   return stat;
 }
 
+/*
+ * Record that a group DN has been seen. Returns NSS_NOTFOUND if
+ * it had been seen before.
+ */
 static NSS_STATUS
-ng_chase_backlink (const char ** membersOf, ldap_initgroups_args_t * lia)
+ng_remember (ldap_initgroups_args_t * lia, const char *dn)
 {
-  ldap_args_t a;
-  NSS_STATUS stat;
-  ent_context_t *ctx = NULL;
-  const char *gidnumber_attrs[3];
-  const char **memberP;
-  const char **filteredMembersOf; /* remove already traversed groups */
-  size_t memberCount, i;
-  int erange;
+  ldap_datum_t key, val;
 
-  debug ("==> ng_chase_backlink");
-  if (lia->depth > LDAP_NSS_MAXGR_DEPTH)
+  if (lia->known_groups == NULL)
     {
-      debug ("<== ng_chase_backlink: returns NSS_NOTFOUND");
-      return NSS_NOTFOUND;
+      lia->known_groups = _nss_ldap_db_open ();
+      if (lia->known_groups == NULL)
+	return NSS_TRYAGAIN;
     }
 
-  for (memberCount = 0; membersOf[memberCount] != NULL; memberCount++)
-    ;
+  key.data = (void *) dn;
+  key.size = strlen (dn);
 
-  /* Build a list of membersOf values without any already traversed groups */
-  filteredMembersOf = (const char **) malloc(sizeof(char *) * (memberCount + 1));
-  if (filteredMembersOf == NULL)
-    {
-      debug ("<== ns_chase_backlink: returns NSS_TRYAGAIN");
-      return NSS_TRYAGAIN;
-    }
+  if (_nss_ldap_db_get (lia->known_groups, NSS_LDAP_DB_NORMALIZE_CASE,
+			&key, &val) == NSS_SUCCESS)
+    return NSS_NOTFOUND;
 
-  memberP = filteredMembersOf;
+  if (_nss_ldap_db_put (lia->known_groups, NSS_LDAP_DB_NORMALIZE_CASE,
+			&key, &key) != NSS_SUCCESS)
+    return NSS_TRYAGAIN;
 
-  for (i = 0; i < memberCount; i++)
+  return NSS_SUCCESS;
+}
+
+/*
+ * Queue a group DN for the next level of nested group expansion,
+ * unless it has been seen before. Returns NSS_NOTFOUND so that
+ * the parser is called for the remaining entries.
+ */
+static NSS_STATUS
+ng_enqueue (ldap_initgroups_args_t * lia, const char *dn)
+{
+  NSS_STATUS stat;
+  char *copy;
+
+  if (lia->next_count == lia->next_size)
     {
-      if (_nss_ldap_namelist_find (lia->known_groups, membersOf[i]))
-	continue;
+      size_t size = (lia->next_size == 0) ? 16 : 2 * lia->next_size;
+      char **next;
 
-      *memberP = membersOf[i];
-      memberP++;
+      next = (char **) _nss_ldap_arena_realloc (lia->next_level,
+						lia->next_size * sizeof (char *),
+						size * sizeof (char *));
+      if (next == NULL)
+	return NSS_TRYAGAIN;
+
+      lia->next_level = next;
+      lia->next_size = size;
     }
 
-  *memberP = NULL;
+  stat = ng_remember (lia, dn);
+  if (stat != NSS_SUCCESS)
+    return stat;
 
-  if (filteredMembersOf[0] == NULL)
-    {
-      free (filteredMembersOf);
-      debug ("<== ns_chase_backlink: returns NSS_NOTFOUND");
-      return NSS_NOTFOUND;
-    }
+  copy = _nss_ldap_arena_strdup (dn);
+  if (copy == NULL)
+    return NSS_TRYAGAIN;
 
-  gidnumber_attrs[0] = ATM (LM_GROUP, gidNumber);
-  gidnumber_attrs[1] = ATM (LM_GROUP, memberOf);
-  gidnumber_attrs[2] = NULL;
+  lia->next_level[lia->next_count++] = copy;
 
-  LA_INIT (a);
-  LA_STRING_LIST (a) = filteredMembersOf;
-  LA_TYPE (a) = LA_TYPE_STRING_LIST_OR;
+  return NSS_NOTFOUND;
+}
 
-  if (_nss_ldap_ent_context_init_internal_locked (&ctx) == NULL)
+/*
+ * Expand nested groups level by level. Each level is searched with
+ * OR filters over up to LDAP_NSS_NG_BATCH of the group DNs queued
+ * while parsing the previous level, rather than one search per
+ * group. With backlinks the queued groups are read for their own
+ * memberOf values; otherwise we look for groups that list them as
+ * members.
+ */
+static NSS_STATUS
+ng_chase (ldap_initgroups_args_t * lia)
+{
+  ldap_args_t a;
+  NSS_STATUS stat = NSS_NOTFOUND;
+  ent_context_t *ctx;
+  const char *gidnumber_attrs[3];
+  const char *batch[LDAP_NSS_NG_BATCH + 1];
+  const char *filter;
+  char **level;
+  size_t count, i, j;
+  int erange;
+
+  debug ("==> ng_chase");
+
+  gidnumber_attrs[0] = ATM (LM_GROUP, gidNumber);
+  if (lia->backlink != 0)
     {
-      free (filteredMembersOf);
-      debug ("<== ns_chase_backlink: returns NSS_UNAVAIL");
-      return NSS_UNAVAIL;
+      gidnumber_attrs[1] = ATM (LM_GROUP, memberOf);
+      gidnumber_attrs[2] = NULL;
+      filter = "(distinguishedName=%s)";
+    }
+  else
+    {
+      gidnumber_attrs[1] = NULL;
+      filter = _nss_ldap_filt_getgroupsbydn;
     }
 
-  stat = _nss_ldap_getent_ex (&a, &ctx, lia, NULL, 0,
-			      &erange, "(distinguishedName=%s)",
-			      LM_GROUP, gidnumber_attrs,
-			      do_parse_initgroups_nested);
-
-  if (stat == NSS_SUCCESS)
+  while (lia->next_count > 0)
     {
-      NSS_STATUS stat2;
+      level = lia->next_level;
+      count = lia->next_count;
+
+      lia->next_level = NULL;
+      lia->next_count = 0;
+      lia->next_size = 0;
+
+      if (++lia->depth > LDAP_NSS_MAXGR_DEPTH)
+	break;
 
-      for (memberP = filteredMembersOf; *memberP != NULL; memberP++)
+      for (i = 0; i < count; i += j)
 	{
-	  stat2 = _nss_ldap_namelist_push (&lia->known_groups, *memberP);
-	  if (stat2 != NSS_SUCCESS)
+	  for (j = 0; j < LDAP_NSS_NG_BATCH && i + j < count; j++)
+	    batch[j] = level[i + j];
+	  batch[j] = NULL;
+
+	  LA_INIT (a);
+	  LA_STRING_LIST (a) = batch;
+	  LA_TYPE (a) = LA_TYPE_STRING_LIST_OR;
+
+	  ctx = NULL;
+	  if (_nss_ldap_ent_context_init_internal_locked (&ctx) == NULL)
 	    {
-	      stat = stat2;
+	      stat = NSS_UNAVAIL;
 	      break;
 	    }
-	}
-    }
 
-  free (filteredMembersOf);
+	  stat = _nss_ldap_getent_ex (&a, &ctx, lia, NULL, 0,
+				      &erange, filter,
+				      LM_GROUP, gidnumber_attrs,
+				      do_parse_initgroups_nested);
 
-  _nss_ldap_ent_context_release (&ctx);
+	  _nss_ldap_ent_context_release (&ctx);
 
-  debug ("<== ns_chase_backlink: returns %s(%d)", __nss_ldap_status2string(stat), stat);
+	  if (stat != NSS_SUCCESS && stat != NSS_NOTFOUND)
+	    break;
+	}
+
+      if (stat != NSS_SUCCESS && stat != NSS_NOTFOUND)
+	break;
+    }
+
+  debug ("<== ng_chase: returns %s(%d)", __nss_ldap_status2string(stat), stat);
   return stat;
 }
 
@@ -1121,6 +1600,7 @@ char *_nss_ldap_getgrset (char *user)
   ent_context_t *ctx = NULL;
   const char *gidnumber_attrs[3];
   ldap_map_selector_t map = LM_GROUP;
+  int done = 0;
 
   LA_INIT (a);
 #if defined(HAVE_NSS_H) || defined(HAVE_USERSEC_H)
@@ -1152,18 +1632,28 @@ char *_nss_ldap_getgrset (char *user)
   lia.size = size;
   lia.groups = groupsp;
   lia.limit = limit;
+#endif /* HAVE_USERSEC_H */
+#ifndef HAVE_USERSEC_H
+  lia.gid_set = NULL;
+  lia.gid_set_count = 0;
+  lia.gid_set_size = 0;
+  lia.gid_set_has_empty = 0;
 #endif /* HAVE_USERSEC_H */
   lia.depth = 0;
   lia.known_groups = NULL;
+  lia.next_level = NULL;
+  lia.next_count = 0;
+  lia.next_size = 0;
+  lia.chain_hits = 0;
 
-  _nss_ldap_enter ();
+  _nss_ldap_enter_lookup ();
 
   /* initialize schema */
   stat = _nss_ldap_init ();
   if (stat != NSS_SUCCESS)
     {
       debug ("<== " NSS_LDAP_INITGROUPS_FUNCTION " (init failed)");
-      _nss_ldap_leave ();
+      _nss_ldap_leave_lookup ();
 # ifdef HAVE_USERSEC_H
       return NULL;
 # else
@@ -1174,7 +1664,7 @@ char *_nss_ldap_getgrset (char *user)
   if (_nss_ldap_test_initgroups_ignoreuser (LA_STRING (a)))
     {
       debug ("<== " NSS_LDAP_INITGROUPS_FUNCTION " (user ignored)");
-      _nss_ldap_leave ();
+      _nss_ldap_leave_lookup ();
       return NSS_NOTFOUND;
     }
 
@@ -1233,7 +1723,7 @@ char *_nss_ldap_getgrset (char *user)
   if (_nss_ldap_ent_context_init_locked (&ctx) == NULL)
     {
       debug ("<== " NSS_LDAP_INITGROUPS_FUNCTION " (ent_context_init failed)");
-      _nss_ldap_leave ();
+      _nss_ldap_leave_lookup ();
 # ifdef HAVE_USERSEC_H
       return NULL;
 # else
@@ -1241,16 +1731,48 @@ char *_nss_ldap_getgrset (char *user)
 # endif				/* HAVE_USERSEC_H */
     }
 
-  stat = _nss_ldap_getent_ex (&a, &ctx, (void *) &lia, NULL, 0,
+  if (userdn != NULL &&
+      _nss_ldap_test_config_flag (NSS_LDAP_FLAGS_INITGROUPS_TRANSITIVE))
+    {
+      stat = ng_chase_transitive (userdn, &lia,
+#ifdef HAVE_NSS_H
+				  errnop,
+#else
+				  &erange,
+#endif /* HAVE_NSS_H */
+				  &done);
+      if (done)
+	{
+	  /*
+	   * Only groups naming the user by memberUid remain; their
+	   * parents are still chased below, as the in-chain search
+	   * only follows member DNs.
+	   */
+	  LA_TYPE (a) = LA_TYPE_STRING;
+	  filter = _nss_ldap_filt_getgroupsbymember;
+	}
+    }
+
+  if (done == 0 || stat == NSS_SUCCESS || stat == NSS_NOTFOUND)
+    stat = _nss_ldap_getent_ex (&a, &ctx, (void *) &lia, NULL, 0,
 #ifdef HAVE_NSS_H
-			      errnop,
+				errnop,
 #else
-			      &erange,
+				&erange,
 #endif /* HAVE_NSS_H */
-			      filter,
-			      map,
-			      gidnumber_attrs,
-			      do_parse_initgroups_nested);
+				filter,
+				map,
+				gidnumber_attrs,
+				do_parse_initgroups_nested);
+
+  /* now expand the groups queued by the parser */
+  if (stat == NSS_SUCCESS || stat == NSS_NOTFOUND)
+    {
+      NSS_STATUS stat2 = ng_chase (&lia);
+
+      if (stat2 != NSS_SUCCESS && stat2 != NSS_NOTFOUND)
+	stat = stat2;
+    }
 
   if (userdn != NULL)
     {
@@ -1262,9 +1784,13 @@ char *_nss_ldap_getgrset (char *user)
 #endif /* HAVE_LDAP_MEMFREE */
     }
 
-  _nss_ldap_namelist_destroy (&lia.known_groups);
+  _nss_ldap_db_close (&lia.known_groups);
+#ifndef HAVE_USERSEC_H
+  if (lia.gid_set != NULL)
+    free (lia.gid_set);
+#endif /* HAVE_USERSEC_H */
   _nss_ldap_ent_context_release (&ctx);
-  _nss_ldap_leave ();
+  _nss_ldap_leave_lookup ();
 
   /*
    * We return NSS_NOTFOUND to force the parser to be called
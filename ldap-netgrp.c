@@ -814,7 +814,7 @@ _nss_ldap_innetgr (nss_backend_t * be, void *_args)
   assert (args->arg[NSS_NETGR_USER].argc <= 1);
   assert (args->arg[NSS_NETGR_DOMAIN].argc <= 1);
 
-  _nss_ldap_enter ();
+  _nss_ldap_enter_lookup ();
 
   machine = (args->arg[NSS_NETGR_MACHINE].argc != 0) ?
     args->arg[NSS_NETGR_MACHINE].argv[0] : NULL;
@@ -846,13 +846,13 @@ _nss_ldap_innetgr (nss_backend_t * be, void *_args)
 
       if (args->status == NSS_NETGR_FOUND)
 	{
-	  _nss_ldap_leave ();
+	  _nss_ldap_leave_lookup ();
 	  debug ("<== _nss_ldap_innetgr (FOUND)");
 	  return NSS_SUCCESS;
 	}
     }
 
-  _nss_ldap_leave ();
+  _nss_ldap_leave_lookup ();
   debug ("<== _nss_ldap_innetgr (not found)");
   return NSS_NOTFOUND;
 }
@@ -37,6 +37,7 @@ static char rcsId[] =
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
@@ -50,6 +51,8 @@ static char rcsId[] =
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <poll.h>
+#include <netdb.h>
 #include <errno.h>
 #ifdef HAVE_RESOLV_H
 #include <resolv.h>
@@ -90,6 +93,7 @@ static char rcsId[] =
 #include "util.h"
 #include "dnsconfig.h"
 #include "pagectrl.h"
+#include "ldap-cache.h"
 
 /* Prefer the threads library over the pthreads facility unless running on AIX */
 #if defined(HAVE_THREAD_H) && !defined(_AIX)
@@ -98,6 +102,14 @@ static char rcsId[] =
 #endif
 #endif
 
+/*
+ * Concurrent lookups on private sessions need POSIX read/write
+ * locks and thread-specific data.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_ATFORK)
+#define NSS_LDAP_CONCURRENT_SESSIONS
+#endif
+
 /* how many messages to retrieve results for */
 #ifndef LDAP_MSG_ONE
 #define LDAP_MSG_ONE            0x00
@@ -120,6 +132,112 @@ extern int ldap_ld_free (LDAP * ld, int close);
 
 NSS_LDAP_DEFINE_LOCK (__lock);
 
+/*
+ * The result of a keyed lookup whose parser ran out of buffer
+ * space, kept briefly so that the caller's retry with a larger
+ * buffer can be parsed again without searching again.
+ */
+typedef struct ldap_result_stash
+{
+  LDAPMessage *lrs_res;
+  unsigned long lrs_config_generation;
+  ldap_session_t *lrs_session;	/* session the result was read on */
+  unsigned int lrs_session_generation;
+  const char *lrs_filter;
+  ldap_map_selector_t lrs_sel;
+  ldap_args_types_t lrs_type;
+  long lrs_number;
+  char *lrs_string;		/* argument strings, NUL separated */
+  char *lrs_string2;
+  time_t lrs_expires;
+  size_t lrs_buflen;		/* buffer size the lookup needed */
+} ldap_result_stash_t;
+
+/*
+ * Per-lookup scratch memory: allocations are carved in order from
+ * a chain of blocks, which are all released when the lookup ends.
+ */
+typedef struct ldap_arena_block
+{
+  struct ldap_arena_block *lab_next;	/* previous block */
+  size_t lab_size;		/* usable bytes */
+  size_t lab_used;
+} ldap_arena_block_t;
+
+typedef struct ldap_arena
+{
+  ldap_arena_block_t *la_block;	/* block being carved from */
+  char *la_last;		/* most recent allocation */
+  size_t la_total;		/* bytes handed out this lookup */
+  size_t la_hint;		/* size of the next first block */
+} ldap_arena_t;
+
+typedef union ldap_arena_align
+{
+  long laa_long;
+  double laa_double;
+  void *laa_pointer;
+} ldap_arena_align_t;
+
+#define LDAP_ARENA_ROUND(n) \
+  (((n) + sizeof (ldap_arena_align_t) - 1) & \
+   ~(sizeof (ldap_arena_align_t) - 1))
+#define LDAP_ARENA_HEADER	LDAP_ARENA_ROUND (sizeof (ldap_arena_block_t))
+#define LDAP_ARENA_DATA(b)	((char *) (b) + LDAP_ARENA_HEADER)
+
+/* used when there is no per-thread state; protected by __lock */
+static ldap_result_stash_t __stash;
+static ldap_arena_t __arena;
+
+/*
+ * Bumped whenever the configuration is reloaded, which happens
+ * under the exclusive lock; stashed results from before are
+ * not used.
+ */
+static unsigned long __config_generation = 0;
+
+static void do_stash_clear (ldap_result_stash_t * stash);
+static ldap_result_stash_t *do_get_stash (void);
+
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+/*
+ * With nss_concurrent_sessions enabled, keyed lookups run on
+ * private sessions and only hold __config_lock shared, so they
+ * do not serialize against each other. _nss_ldap_enter() takes
+ * it exclusively, which keeps enumeration, configuration reloads
+ * and fork handling away from any lookup in progress.
+ */
+static pthread_rwlock_t __config_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* the lookup state of the calling thread */
+static pthread_key_t __session_key;
+static pthread_once_t __session_key_once = PTHREAD_ONCE_INIT;
+static int __session_key_created = 0;
+
+/* per-thread lookup state, see _nss_ldap_enter_lookup() */
+typedef struct ldap_thread_state
+{
+  int lts_active;		/* inside a concurrent lookup */
+  int lts_depth;		/* lookups entered, counting nested ones */
+  ldap_config_t *lts_config;	/* configuration for the lookup */
+  ldap_session_t *lts_session;	/* pooled session, once checked out */
+  ldap_result_stash_t lts_stash;	/* result kept for an ERANGE retry */
+  ldap_arena_t lts_arena;	/* scratch memory for the lookup */
+} ldap_thread_state_t;
+
+/*
+ * Bounded pool of sessions shared by concurrent lookups; its
+ * size is taken from nss_connection_pool_size. __sessions_lock
+ * protects the pool and __sigpipe_refs.
+ */
+static pthread_mutex_t __sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __sessions_cond = PTHREAD_COND_INITIALIZER;
+static ldap_session_t *__pool = NULL;
+static int __pool_size = 0;
+static int __pool_busy = 0;
+static int __sigpipe_refs = 0;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
 /*
  * the configuration is read by the first call to do_open().
  * Pointers to elements of the list are passed around but should not
@@ -216,6 +334,20 @@ static void do_close_no_unbind (ldap_session_t *session);
  */
 static void do_set_sockopts (ldap_session_t *session);
 
+/*
+ * Return the session in use by the calling thread: its private
+ * session for concurrent lookups, else the global session.
+ */
+static ldap_session_t *do_get_session (void);
+static ldap_config_t *do_get_config (void);
+
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+/*
+ * Close all pooled sessions, with or without an unbind.
+ */
+static void do_close_private_sessions (int unbind);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
 /*
  * TLS routines: set global SSL session options.
  */
@@ -262,13 +394,26 @@ static int do_search_s (ldap_session_t * session, const char *base, int scope,
  */
 static NSS_STATUS do_result (ldap_session_t *session, ent_context_t * ctx, int all);
 
+/*
+ * Discard a page read ahead of time.
+ */
+static void do_drop_ahead (ldap_session_t *session, ent_context_t * ctx);
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+/*
+ * Bracket a parser's use of an entry with its attribute index.
+ */
+static void do_index_begin (ldap_session_t * session, LDAPMessage * e);
+static void do_index_end (ldap_session_t * session);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+
 /*
  * Format a filter given a prototype.
  */
 static NSS_STATUS do_filter (const ldap_args_t * args, const char *filterprot,
 			     ldap_service_search_descriptor_t * sd,
 			     char *filter, size_t filterlen,
-			     char **dynamicFilter, const char **retFilter);
+			     const char **retFilter);
 
 /*
  * Parse a result, fetching new results until a successful parse
@@ -636,7 +781,7 @@ do_rebind (LDAP * ld, LDAP_CONST char *url, int request, ber_int_t msgid)
   int with_sasl = 0;
   uid_t euid;
   ldap_config_t *cfg;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
   int rc;
 
   debug ("==> do_rebind");
@@ -718,7 +863,7 @@ do_rebind (LDAP * ld, char **whop, char **credp, int *methodp, int freeit)
 {
   uid_t euid;
   ldap_config_t *cfg;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> do_rebind");
 
@@ -849,6 +994,9 @@ do_atfork_child (void)
   sigaddset(&unblock, SIGPIPE);
   sigprocmask(SIG_UNBLOCK, &unblock, &mask);
   do_close_no_unbind (session);
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  do_close_private_sessions (0);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
   sigprocmask(SIG_SETMASK, &mask, NULL);
 
   _nss_ldap_leave ();
@@ -904,12 +1052,11 @@ pthreading_active(void)
 #endif
 
 /*
- * Acquires global lock, blocks SIGPIPE.
+ * Ignore SIGPIPE, saving the previous disposition.
  */
-void
-_nss_ldap_enter (void)
+static void
+do_ignore_sigpipe (void)
 {
-
 #ifdef HAVE_SIGACTION
   struct sigaction new_handler;
 
@@ -923,10 +1070,6 @@ _nss_ldap_enter (void)
   new_handler.sa_flags = 0;
 #endif /* HAVE_SIGACTION */
 
-  debug ("==> _nss_ldap_enter");
-
-  NSS_LDAP_LOCK (__lock);
-
   /*
    * Patch for Debian Bug 130006:
    * ignore SIGPIPE for all LDAP operations.
@@ -945,20 +1088,14 @@ _nss_ldap_enter (void)
 #else
   __sigpipe_handler = signal (SIGPIPE, SIG_IGN);
 #endif /* HAVE_SIGSET */
-
-  debug ("<== _nss_ldap_enter");
-
-  return;
 }
 
 /*
- * Releases global mutex, releases SIGPIPE.
+ * Restore the SIGPIPE disposition saved by do_ignore_sigpipe().
  */
-void
-_nss_ldap_leave (void)
+static void
+do_restore_sigpipe (void)
 {
-  debug ("==> _nss_ldap_leave");
-
 #ifdef HAVE_SIGACTION
   if (__sigaction_retval == 0)
     (void) sigaction (SIGPIPE, &__stored_handler, NULL);
@@ -972,193 +1109,792 @@ _nss_ldap_leave (void)
 # endif	/* HAVE_SIGSET */
     }
 #endif /* HAVE_SIGACTION */
+}
 
-  NSS_LDAP_UNLOCK (__lock);
+static void
+do_arena_free (ldap_arena_t * arena)
+{
+  ldap_arena_block_t *block, *next;
 
-  debug ("<== _nss_ldap_leave");
+  for (block = arena->la_block; block != NULL; block = next)
+    {
+      next = block->lab_next;
+      free (block);
+    }
 
-  return;
+  arena->la_block = NULL;
+  arena->la_last = NULL;
+  arena->la_total = 0;
 }
 
-static void
-do_set_sockopts (ldap_session_t *session)
-{
 /*
- * Netscape SSL-enabled LDAP library does not
- * return the real socket.
+ * Called at the end of a lookup. A lookup that fitted in one
+ * block leaves it in place for the next; otherwise the blocks are
+ * freed and the next lookup starts with one block big enough for
+ * all of them, so that steady state lookups do not call malloc().
  */
-#ifndef HAVE_LDAPSSL_CLIENT_INIT
-  int sd = -1;
+static void
+do_arena_release (ldap_arena_t * arena)
+{
+  ldap_arena_block_t *block = arena->la_block;
 
-  debug ("==> do_set_sockopts");
+  if (block == NULL)
+    return;
 
-  if ((GET_SOCKET_DESCRIPTOR (session->ls_conn, &sd) == LDAP_OPT_SUCCESS) && (sd > 0))
+  if (block->lab_next == NULL && block->lab_size <= LDAP_NSS_ARENA_RETAIN)
     {
-      int off = 0;
-      NSS_LDAP_SOCKLEN_T socknamelen = sizeof (NSS_LDAP_SOCKADDR_STORAGE);
-      NSS_LDAP_SOCKLEN_T peernamelen = sizeof (NSS_LDAP_SOCKADDR_STORAGE);
+      block->lab_used = 0;
+      arena->la_last = NULL;
+      arena->la_total = 0;
+      return;
+    }
 
-      (void) setsockopt (sd, SOL_SOCKET, SO_KEEPALIVE, (void *) &off,
-			 sizeof (off));
-      (void) fcntl (sd, F_SETFD, FD_CLOEXEC);
-      /*
-       * NSS modules shouldn't open file descriptors that the program/utility
-       * linked against NSS doesn't know about.  The LDAP library opens a
-       * connection to the LDAP server transparently.  There's an edge case
-       * where a daemon might fork a child and, being written well, closes
-       * all its file descriptors.  This will close the socket descriptor
-       * being used by the LDAP library!  Worse, the daemon might open many
-       * files and sockets, eventually opening a descriptor with the same number
-       * as that originally used by the LDAP library.  The only way to know that
-       * this isn't "our" socket descriptor is to save the local and remote
-       * sockaddr_in structures for later comparison.
-       */
-      (void) getsockname (sd, (struct sockaddr *) &(session->ls_sockname),
-			  &socknamelen);
-      (void) getpeername (sd, (struct sockaddr *) &(session->ls_peername),
-			  &peernamelen);
+  arena->la_hint = (arena->la_total <= LDAP_NSS_ARENA_RETAIN) ?
+    arena->la_total : 0;
+  do_arena_free (arena);
+}
+
+static void *
+do_arena_alloc (ldap_arena_t * arena, size_t size)
+{
+  ldap_arena_block_t *block = arena->la_block;
+  size_t need = LDAP_ARENA_ROUND (size > 0 ? size : 1);
+  char *p;
+
+  if (need < size)
+    return NULL;
+
+  if (block == NULL || block->lab_size - block->lab_used < need)
+    {
+      size_t blocksize = LDAP_NSS_ARENA_BLOCK;
+
+      /* grow geometrically so that long lookups need few blocks */
+      if (block != NULL && blocksize < 2 * block->lab_size)
+	blocksize = 2 * block->lab_size;
+      if (blocksize < arena->la_hint)
+	blocksize = LDAP_ARENA_ROUND (arena->la_hint);
+      if (blocksize < need)
+	blocksize = need;
+      if (blocksize > (size_t) -1 - LDAP_ARENA_HEADER)
+	return NULL;
+
+      block = (ldap_arena_block_t *) malloc (LDAP_ARENA_HEADER + blocksize);
+      if (block == NULL)
+	return NULL;
+
+      block->lab_next = arena->la_block;
+      block->lab_size = blocksize;
+      block->lab_used = 0;
+      arena->la_block = block;
+      arena->la_hint = 0;
     }
-  debug ("<== do_set_sockopts");
-#endif /* HAVE_LDAPSSL_CLIENT_INIT */
 
-  return;
+  p = LDAP_ARENA_DATA (block) + block->lab_used;
+  block->lab_used += need;
+  arena->la_total += need;
+  arena->la_last = p;
+
+  return p;
 }
 
-static void
-do_close_mechs (ldap_session_t *session)
+static void *
+do_arena_realloc (ldap_arena_t * arena, void *ptr, size_t oldsize,
+		  size_t size)
 {
-  debug ("==> do_close_mechs");
+  ldap_arena_block_t *block = arena->la_block;
+  char *p;
 
-  /* Close any active sasl mechanisms */
-  if (session->ls_mechs != NULL)
+  if (ptr == NULL)
+    return do_arena_alloc (arena, size);
+
+  if ((char *) ptr == arena->la_last)
     {
-      int i;
+      /* the most recent allocation; try to extend it in place */
+      size_t offset = (char *) ptr - LDAP_ARENA_DATA (block);
+      size_t need = LDAP_ARENA_ROUND (size > 0 ? size : 1);
 
-      for (i = 0; i < session->ls_mechs->lsms_count; i++)
+      if (need >= size && block->lab_size - offset >= need)
 	{
-	  session->ls_mechs->lsms_mechs[i]->lsm_close (session);
+	  arena->la_total += need;
+	  arena->la_total -= block->lab_used - offset;
+	  block->lab_used = offset + need;
+	  return ptr;
 	}
     }
 
-  debug ("<== do_close_mechs");
+  p = do_arena_alloc (arena, size);
+  if (p == NULL)
+    return NULL;
+
+  memcpy (p, ptr, (oldsize < size) ? oldsize : size);
+
+  return p;
 }
 
 /*
- * Closes connection to the LDAP server.
- * This assumes that we have exclusive access to __session.ls_conn,
- * either by some other function having acquired a lock, or by
- * using a thread safe libldap.
+ * Acquires global lock, blocks SIGPIPE.
  */
-static void
-do_close (ldap_session_t *session)
+void
+_nss_ldap_enter (void)
 {
-  debug ("==> do_close");
+  debug ("==> _nss_ldap_enter");
 
-  do_close_mechs (session);
+  NSS_LDAP_LOCK (__lock);
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  /* wait for concurrent lookups to drain */
+  (void) pthread_rwlock_wrlock (&__config_lock);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
 
-  if (session->ls_conn != NULL)
-    {
-#if defined(DEBUG) || defined(DEBUG_SOCKETS)
-      int sd = -1;
-      GET_SOCKET_DESCRIPTOR (session->ls_conn, &sd);
-      syslog (LOG_INFO, "nss_ldap: closing connection %p fd %d",
-	      session->ls_conn, sd);
-#endif /* DEBUG */
+  do_ignore_sigpipe ();
 
-      ldap_unbind (session->ls_conn);
-      session->ls_conn = NULL;
-      session->ls_state = LS_UNINITIALIZED;
-    }
+  debug ("<== _nss_ldap_enter");
 
-  debug ("<== do_close");
+  return;
 }
 
-static int
-do_sockaddr_isequal (NSS_LDAP_SOCKADDR_STORAGE *_s1,
-		     NSS_LDAP_SOCKLEN_T _slen1,
-		     NSS_LDAP_SOCKADDR_STORAGE *_s2,
-		     NSS_LDAP_SOCKLEN_T _slen2)
+/*
+ * Releases global mutex, releases SIGPIPE.
+ */
+void
+_nss_ldap_leave (void)
 {
-  int ret;
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
 
-  if (_s1->ss_family != _s2->ss_family)
-    return 0;
+  debug ("==> _nss_ldap_leave");
 
-  if (_slen1 != _slen2)
-    return 0;
+  do_arena_release (&__arena);
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  if (__session_key_created &&
+      (lts = (ldap_thread_state_t *) pthread_getspecific (__session_key)) != NULL)
+    do_arena_release (&lts->lts_arena);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
 
-  ret = 0;
+  do_restore_sigpipe ();
 
-  switch (_s1->ss_family)
-    {
-      case AF_INET:
-	{
-	  struct sockaddr_in *s1 = (struct sockaddr_in *) _s1;
-	  struct sockaddr_in *s2 = (struct sockaddr_in *) _s2;
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  (void) pthread_rwlock_unlock (&__config_lock);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+  NSS_LDAP_UNLOCK (__lock);
 
-	  ret = (s1->sin_port == s2->sin_port &&
-		 memcmp (&s1->sin_addr, &s2->sin_addr, sizeof(struct in_addr)) == 0);
-	  break;
-	}
-      case AF_UNIX:
-	{
-	  struct sockaddr_un *s1 = (struct sockaddr_un *) _s1;
-	  struct sockaddr_un *s2 = (struct sockaddr_un *) _s2;
+  debug ("<== _nss_ldap_leave");
 
-	  ret = (memcmp (s1->sun_path, s2->sun_path,
-			 _slen1 - sizeof (_s1->ss_family)) == 0);
-	  break;
-	}
-#ifdef INET6
-      case AF_INET6:
-	{
-	  struct sockaddr_in6 *s1 = (struct sockaddr_in6 *) _s1;
-	  struct sockaddr_in6 *s2 = (struct sockaddr_in6 *) _s2;
+  return;
+}
 
-	  ret = (s1->sin6_port == s2->sin6_port &&
-		 memcmp (&s1->sin6_addr, &s2->sin6_addr, sizeof (struct in6_addr)) == 0 &&
-		 s1->sin6_scope_id == s2->sin6_scope_id);
-	  break;
-	}
-#endif
-      default:
-	ret = (memcmp (_s1, _s2, _slen1) == 0);
-	break;
-    }
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+static void
+do_thread_state_free (void *p)
+{
+  ldap_thread_state_t *lts = (ldap_thread_state_t *) p;
 
-  return ret;
+  do_stash_clear (&lts->lts_stash);
+  do_arena_free (&lts->lts_arena);
+  free (lts);
 }
 
-static int
-do_get_our_socket (ldap_session_t *session, int *sd)
+static void
+do_session_key_create (void)
 {
-  /*
-   * Before freeing the LDAP context or closing the socket descriptor,
-   * we must ensure that it is *our* socket descriptor.  See the much
-   * lengthier description of this at the end of do_open () where the
-   * values __session.ls_sockname and __session.ls_peername are saved.
-   * With HAVE_LDAPSSL_CLIENT_INIT this returns 0 if the socket has
-   * been closed or reopened, and sets *sd to the ldap socket
-   * descriptor.. Returns 1 in all other cases.
-   */
+  if (pthread_key_create (&__session_key, do_thread_state_free) == 0)
+    __session_key_created = 1;
+}
 
-  int isOurSocket = 1;
+/*
+ * Allocate the connection pool, sized from the configuration.
+ * Caller holds __sessions_lock.
+ */
+static NSS_STATUS
+do_pool_init (ldap_config_t *cfg)
+{
+  int i, size;
 
-#ifndef HAVE_LDAPSSL_CLIENT_INIT
-  if ((GET_SOCKET_DESCRIPTOR (session->ls_conn, sd) == LDAP_OPT_SUCCESS) && (*sd > 0))
+  if (__pool != NULL)
+    return NSS_SUCCESS;
+
+  size = cfg->ldc_pool_size;
+  if (size < 1)
+    size = 1;
+
+  __pool = (ldap_session_t *) calloc (size, sizeof (ldap_session_t));
+  if (__pool == NULL)
+    return NSS_UNAVAIL;
+
+  for (i = 0; i < size; i++)
     {
-      NSS_LDAP_SOCKADDR_STORAGE sockname;
-      NSS_LDAP_SOCKADDR_STORAGE peername;
-      NSS_LDAP_SOCKLEN_T socknamelen = sizeof (sockname);
-      NSS_LDAP_SOCKLEN_T peernamelen = sizeof (peername);
+      __pool[i].ls_state = LS_UNINITIALIZED;
+      __pool[i].ls_current_uri = __session.ls_current_uri;
+      __pool[i].pid = -1;
+      __pool[i].euid = -1;
+    }
 
-      if (getsockname (*sd, (struct sockaddr *) &sockname, &socknamelen) != 0 ||
-	  !do_sockaddr_isequal (&(session->ls_sockname),
-				socknamelen,
-				&sockname,
-				socknamelen))
-        {
-          isOurSocket = 0;
+  __pool_size = size;
+  __pool_busy = 0;
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Find a pooled connection that has been idle for longer than
+ * idle_timelimit, so that a burst of lookups does not leave the
+ * pool holding connections open indefinitely. The session is
+ * returned checked out, so that the caller can close it without
+ * holding __sessions_lock. Caller holds __sessions_lock.
+ */
+static ldap_session_t *
+do_pool_reap (ldap_config_t *cfg)
+{
+  time_t now;
+  int i;
+
+  if (cfg->ldc_idle_timelimit == 0)
+    return NULL;
+
+  time (&now);
+
+  for (i = 0; i < __pool_size; i++)
+    {
+      ldap_session_t *session = &__pool[i];
+
+      if (session->ls_busy == 0 &&
+	  session->ls_state == LS_CONNECTED_TO_DSA &&
+	  session->ls_timestamp + cfg->ldc_idle_timelimit < now)
+	{
+	  debug (":== do_pool_reap: idle session %d", i);
+	  session->ls_busy = 1;
+	  __pool_busy++;
+	  return session;
+	}
+    }
+
+  return NULL;
+}
+
+/*
+ * Hand out a pooled session, preferring one that is already
+ * connected. Blocks until a session is returned if the pool is
+ * exhausted. Caller holds __config_lock shared, so the
+ * configuration cannot change underneath us.
+ */
+static ldap_session_t *
+do_session_checkout (ldap_config_t *cfg)
+{
+  ldap_session_t *session;
+  int i;
+
+  debug ("==> do_session_checkout");
+
+  pthread_mutex_lock (&__sessions_lock);
+
+  while (__pool_busy == __pool_size)
+    pthread_cond_wait (&__sessions_cond, &__sessions_lock);
+
+  session = NULL;
+  for (i = 0; i < __pool_size; i++)
+    {
+      if (__pool[i].ls_busy)
+	continue;
+
+      session = &__pool[i];
+      if (session->ls_state == LS_CONNECTED_TO_DSA)
+	break;
+    }
+
+  assert (session != NULL);
+
+  session->ls_busy = 1;
+  session->ls_config = cfg;
+  __pool_busy++;
+
+  pthread_mutex_unlock (&__sessions_lock);
+
+  debug ("<== do_session_checkout: returns %p", session);
+
+  return session;
+}
+
+/*
+ * Return a session to the pool.
+ */
+static void
+do_session_checkin (ldap_session_t *session)
+{
+  ldap_session_t *idle;
+
+  debug ("==> do_session_checkin");
+
+  pthread_mutex_lock (&__sessions_lock);
+
+  session->ls_busy = 0;
+  __pool_busy--;
+  pthread_cond_signal (&__sessions_cond);
+
+  /* unbind idle sessions without holding up checkouts */
+  while ((idle = do_pool_reap (session->ls_config)) != NULL)
+    {
+      pthread_mutex_unlock (&__sessions_lock);
+
+      do_close (idle);
+
+      pthread_mutex_lock (&__sessions_lock);
+      idle->ls_busy = 0;
+      __pool_busy--;
+      pthread_cond_signal (&__sessions_cond);
+    }
+
+  pthread_mutex_unlock (&__sessions_lock);
+
+  debug ("<== do_session_checkin");
+}
+
+/*
+ * Close and free the connection pool; it is reallocated with
+ * the (possibly new) pool size by the next lookup. Caller must
+ * hold __config_lock exclusively (ie. have called
+ * _nss_ldap_enter()) so that no pooled session is in use.
+ */
+static void
+do_close_private_sessions (int unbind)
+{
+  int i;
+
+  debug ("==> do_close_private_sessions");
+
+  pthread_mutex_lock (&__sessions_lock);
+
+  for (i = 0; i < __pool_size; i++)
+    {
+      if (unbind)
+	do_close (&__pool[i]);
+      else
+	do_close_no_unbind (&__pool[i]);
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+      if (__pool[i].ls_index.lei_attrs != NULL)
+	free (__pool[i].ls_index.lei_attrs);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+    }
+
+  if (__pool != NULL)
+    {
+      free (__pool);
+      __pool = NULL;
+    }
+  __pool_size = 0;
+  __pool_busy = 0;
+  __sigpipe_refs = 0;
+
+  pthread_mutex_unlock (&__sessions_lock);
+
+  debug ("<== do_close_private_sessions");
+}
+
+static ldap_thread_state_t *
+do_get_thread_state (void)
+{
+  ldap_thread_state_t *lts;
+
+  if (pthread_once (&__session_key_once, do_session_key_create) != 0 ||
+      !__session_key_created)
+    return NULL;
+
+  lts = (ldap_thread_state_t *) pthread_getspecific (__session_key);
+  if (lts == NULL)
+    {
+      lts = (ldap_thread_state_t *) calloc (1, sizeof (*lts));
+      if (lts == NULL)
+	return NULL;
+
+      if (pthread_setspecific (__session_key, lts) != 0)
+	{
+	  free (lts);
+	  return NULL;
+	}
+    }
+
+  return lts;
+}
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+/*
+ * Starts a lookup, on a pooled session if concurrent sessions
+ * are enabled and the configuration has been loaded, otherwise
+ * on the global session under the global lock. The pooled
+ * session itself is only checked out once the lookup needs
+ * a connection (see do_get_session()). A lookup made from within
+ * another one on the same thread, as when libldap calls back into
+ * NSS, joins the outer lookup: it must not take the locks again.
+ */
+void
+_nss_ldap_enter_lookup (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts;
+  ldap_config_t *cfg;
+  NSS_STATUS stat = NSS_UNAVAIL;
+
+  debug ("==> _nss_ldap_enter_lookup");
+
+  lts = do_get_thread_state ();
+  if (lts != NULL && lts->lts_depth > 0)
+    {
+      lts->lts_depth++;
+      debug ("<== _nss_ldap_enter_lookup (nested)");
+      return;
+    }
+
+  if (lts != NULL)
+    {
+      (void) pthread_rwlock_rdlock (&__config_lock);
+
+      /*
+       * The first lookup, and any lookup after the configuration
+       * file has changed, goes through the global session so that
+       * the configuration is (re)loaded under the exclusive lock.
+       */
+      cfg = __session.ls_config;
+      if (cfg != NULL &&
+	  (cfg->ldc_flags & NSS_LDAP_FLAGS_CONCURRENT_SESSIONS) &&
+	  _nss_ldap_validateconfig (cfg) == NSS_SUCCESS)
+	{
+	  pthread_mutex_lock (&__sessions_lock);
+	  stat = do_pool_init (cfg);
+	  if (stat == NSS_SUCCESS)
+	    {
+	      /* SIGPIPE is process wide; ignore it while any lookup runs */
+	      if (__sigpipe_refs++ == 0)
+		do_ignore_sigpipe ();
+	    }
+	  pthread_mutex_unlock (&__sessions_lock);
+	}
+
+      if (stat == NSS_SUCCESS)
+	{
+	  lts->lts_active = 1;
+	  lts->lts_depth = 1;
+	  lts->lts_config = cfg;
+	  lts->lts_session = NULL;
+	  debug ("<== _nss_ldap_enter_lookup (pooled session)");
+	  return;
+	}
+
+      (void) pthread_rwlock_unlock (&__config_lock);
+    }
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  _nss_ldap_enter ();
+
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  if (lts != NULL)
+    lts->lts_depth = 1;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  debug ("<== _nss_ldap_enter_lookup");
+}
+
+/*
+ * Ends a lookup started with _nss_ldap_enter_lookup().
+ */
+void
+_nss_ldap_leave_lookup (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts;
+
+  debug ("==> _nss_ldap_leave_lookup");
+
+  lts = __session_key_created ?
+    (ldap_thread_state_t *) pthread_getspecific (__session_key) : NULL;
+
+  /* a nested lookup leaves the outer one running */
+  if (lts != NULL && lts->lts_depth > 1)
+    {
+      lts->lts_depth--;
+      debug ("<== _nss_ldap_leave_lookup (nested)");
+      return;
+    }
+
+  if (lts != NULL)
+    lts->lts_depth = 0;
+
+  if (lts != NULL && lts->lts_active)
+    {
+      if (lts->lts_session != NULL)
+	{
+	  do_session_checkin (lts->lts_session);
+	  lts->lts_session = NULL;
+	}
+      lts->lts_active = 0;
+      lts->lts_config = NULL;
+      do_arena_release (&lts->lts_arena);
+
+      pthread_mutex_lock (&__sessions_lock);
+      if (--__sigpipe_refs == 0)
+	do_restore_sigpipe ();
+      pthread_mutex_unlock (&__sessions_lock);
+
+      (void) pthread_rwlock_unlock (&__config_lock);
+      debug ("<== _nss_ldap_leave_lookup (pooled session)");
+      return;
+    }
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  _nss_ldap_leave ();
+
+  debug ("<== _nss_ldap_leave_lookup");
+}
+
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+static ldap_thread_state_t *
+do_get_active_thread_state (void)
+{
+  ldap_thread_state_t *lts;
+
+  if (!__session_key_created)
+    return NULL;
+
+  lts = (ldap_thread_state_t *) pthread_getspecific (__session_key);
+  if (lts == NULL || !lts->lts_active)
+    return NULL;
+
+  return lts;
+}
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+/*
+ * Return the session the calling thread should talk to,
+ * checking one out of the pool on first use within a
+ * concurrent lookup.
+ */
+static ldap_session_t *
+do_get_session (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts = do_get_active_thread_state ();
+
+  if (lts != NULL)
+    {
+      if (lts->lts_session == NULL)
+	lts->lts_session = do_session_checkout (lts->lts_config);
+      return lts->lts_session;
+    }
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  return &__session;
+}
+
+/*
+ * Return the configuration in effect for the calling thread,
+ * without checking out a session.
+ */
+static ldap_config_t *
+do_get_config (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts = do_get_active_thread_state ();
+
+  if (lts != NULL)
+    return lts->lts_config;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  return __session.ls_config;
+}
+
+static void
+do_set_sockopts (ldap_session_t *session)
+{
+/*
+ * Netscape SSL-enabled LDAP library does not
+ * return the real socket.
+ */
+#ifndef HAVE_LDAPSSL_CLIENT_INIT
+  int sd = -1;
+
+  debug ("==> do_set_sockopts");
+
+  if ((GET_SOCKET_DESCRIPTOR (session->ls_conn, &sd) == LDAP_OPT_SUCCESS) && (sd > 0))
+    {
+      int off = 0;
+      NSS_LDAP_SOCKLEN_T socknamelen = sizeof (NSS_LDAP_SOCKADDR_STORAGE);
+      NSS_LDAP_SOCKLEN_T peernamelen = sizeof (NSS_LDAP_SOCKADDR_STORAGE);
+
+      (void) setsockopt (sd, SOL_SOCKET, SO_KEEPALIVE, (void *) &off,
+			 sizeof (off));
+      (void) fcntl (sd, F_SETFD, FD_CLOEXEC);
+      /*
+       * NSS modules shouldn't open file descriptors that the program/utility
+       * linked against NSS doesn't know about.  The LDAP library opens a
+       * connection to the LDAP server transparently.  There's an edge case
+       * where a daemon might fork a child and, being written well, closes
+       * all its file descriptors.  This will close the socket descriptor
+       * being used by the LDAP library!  Worse, the daemon might open many
+       * files and sockets, eventually opening a descriptor with the same number
+       * as that originally used by the LDAP library.  The only way to know that
+       * this isn't "our" socket descriptor is to save the local and remote
+       * sockaddr_in structures for later comparison.
+       */
+      (void) getsockname (sd, (struct sockaddr *) &(session->ls_sockname),
+			  &socknamelen);
+      (void) getpeername (sd, (struct sockaddr *) &(session->ls_peername),
+			  &peernamelen);
+    }
+  debug ("<== do_set_sockopts");
+#endif /* HAVE_LDAPSSL_CLIENT_INIT */
+
+  return;
+}
+
+static void
+do_close_mechs (ldap_session_t *session)
+{
+  debug ("==> do_close_mechs");
+
+  /* Close any active sasl mechanisms */
+  if (session->ls_mechs != NULL)
+    {
+      int i;
+
+      for (i = 0; i < session->ls_mechs->lsms_count; i++)
+	{
+	  session->ls_mechs->lsms_mechs[i]->lsm_close (session);
+	}
+    }
+
+  debug ("<== do_close_mechs");
+}
+
+/*
+ * Closes connection to the LDAP server.
+ * This assumes that we have exclusive access to __session.ls_conn,
+ * either by some other function having acquired a lock, or by
+ * using a thread safe libldap.
+ */
+/*
+ * Close the socket left by the URI race if the session did not
+ * take it over.
+ */
+static void
+do_race_drop (ldap_session_t *session)
+{
+  if (session->ls_race_pending)
+    {
+      close (session->ls_race_sd);
+      session->ls_race_pending = 0;
+    }
+}
+
+static void
+do_close (ldap_session_t *session)
+{
+  debug ("==> do_close");
+
+  do_race_drop (session);
+  do_close_mechs (session);
+
+  if (session->ls_conn != NULL)
+    {
+#if defined(DEBUG) || defined(DEBUG_SOCKETS)
+      int sd = -1;
+      GET_SOCKET_DESCRIPTOR (session->ls_conn, &sd);
+      syslog (LOG_INFO, "nss_ldap: closing connection %p fd %d",
+	      session->ls_conn, sd);
+#endif /* DEBUG */
+
+      ldap_unbind (session->ls_conn);
+      session->ls_conn = NULL;
+      session->ls_state = LS_UNINITIALIZED;
+      session->ls_generation++;
+    }
+
+  debug ("<== do_close");
+}
+
+static int
+do_sockaddr_isequal (NSS_LDAP_SOCKADDR_STORAGE *_s1,
+		     NSS_LDAP_SOCKLEN_T _slen1,
+		     NSS_LDAP_SOCKADDR_STORAGE *_s2,
+		     NSS_LDAP_SOCKLEN_T _slen2)
+{
+  int ret;
+
+  if (_s1->ss_family != _s2->ss_family)
+    return 0;
+
+  if (_slen1 != _slen2)
+    return 0;
+
+  ret = 0;
+
+  switch (_s1->ss_family)
+    {
+      case AF_INET:
+	{
+	  struct sockaddr_in *s1 = (struct sockaddr_in *) _s1;
+	  struct sockaddr_in *s2 = (struct sockaddr_in *) _s2;
+
+	  ret = (s1->sin_port == s2->sin_port &&
+		 memcmp (&s1->sin_addr, &s2->sin_addr, sizeof(struct in_addr)) == 0);
+	  break;
+	}
+      case AF_UNIX:
+	{
+	  struct sockaddr_un *s1 = (struct sockaddr_un *) _s1;
+	  struct sockaddr_un *s2 = (struct sockaddr_un *) _s2;
+
+	  ret = (memcmp (s1->sun_path, s2->sun_path,
+			 _slen1 - sizeof (_s1->ss_family)) == 0);
+	  break;
+	}
+#ifdef INET6
+      case AF_INET6:
+	{
+	  struct sockaddr_in6 *s1 = (struct sockaddr_in6 *) _s1;
+	  struct sockaddr_in6 *s2 = (struct sockaddr_in6 *) _s2;
+
+	  ret = (s1->sin6_port == s2->sin6_port &&
+		 memcmp (&s1->sin6_addr, &s2->sin6_addr, sizeof (struct in6_addr)) == 0 &&
+		 s1->sin6_scope_id == s2->sin6_scope_id);
+	  break;
+	}
+#endif
+      default:
+	ret = (memcmp (_s1, _s2, _slen1) == 0);
+	break;
+    }
+
+  return ret;
+}
+
+static int
+do_get_our_socket (ldap_session_t *session, int *sd)
+{
+  /*
+   * Before freeing the LDAP context or closing the socket descriptor,
+   * we must ensure that it is *our* socket descriptor.  See the much
+   * lengthier description of this at the end of do_open () where the
+   * values __session.ls_sockname and __session.ls_peername are saved.
+   * With HAVE_LDAPSSL_CLIENT_INIT this returns 0 if the socket has
+   * been closed or reopened, and sets *sd to the ldap socket
+   * descriptor.. Returns 1 in all other cases.
+   */
+
+  int isOurSocket = 1;
+
+#ifndef HAVE_LDAPSSL_CLIENT_INIT
+  if ((GET_SOCKET_DESCRIPTOR (session->ls_conn, sd) == LDAP_OPT_SUCCESS) && (*sd > 0))
+    {
+      NSS_LDAP_SOCKADDR_STORAGE sockname;
+      NSS_LDAP_SOCKADDR_STORAGE peername;
+      NSS_LDAP_SOCKLEN_T socknamelen = sizeof (sockname);
+      NSS_LDAP_SOCKLEN_T peernamelen = sizeof (peername);
+
+      if (getsockname (*sd, (struct sockaddr *) &sockname, &socknamelen) != 0 ||
+	  !do_sockaddr_isequal (&(session->ls_sockname),
+				socknamelen,
+				&sockname,
+				socknamelen))
+        {
+          isOurSocket = 0;
         }
       /*
        * XXX: We don't pay any attention to return codes in places such as
@@ -1308,6 +2044,7 @@ do_drop_connection (ldap_session_t *session, int sd, int closeSd)
 #endif /* HAVE_LDAPSSL_CLIENT_INIT */
   session->ls_conn = NULL;
   session->ls_state = LS_UNINITIALIZED;
+  session->ls_generation++;
 
   return;
 }
@@ -1360,11 +2097,25 @@ do_close_no_unbind (ldap_session_t * session)
 NSS_STATUS
 _nss_ldap_init (void)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session;
   NSS_STATUS stat;
 
   debug ("==> _nss_ldap_init");
 
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  /*
+   * A concurrent lookup only starts once the configuration and
+   * schema are loaded; leave the pooled session to be checked
+   * out when a connection is actually needed.
+   */
+  if (do_get_active_thread_state () != NULL)
+    {
+      debug ("<== _nss_ldap_init: returns NSS_SUCCESS (concurrent lookup)");
+      return NSS_SUCCESS;
+    }
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  session = do_get_session ();
   stat = do_check_init (session);
   if (stat != NSS_SUCCESS)
     {
@@ -1382,7 +2133,7 @@ _nss_ldap_init (void)
 void
 _nss_ldap_close (void)
 {
-  do_close (&__session);
+  do_close (do_get_session ());
 }
 
 static void
@@ -1448,7 +2199,21 @@ do_init_session (ldap_session_t  *session, const char *uri, int defport)
 
   _nss_ldap_res_init(uri);
 
-  rc = ldap_initialize (&session->ls_conn, uri);
+  rc = LDAP_UNAVAILABLE;
+#ifdef HAVE_LDAP_INIT_FD
+  if (session->ls_race_pending)
+    {
+      /* take over the connection that won the race */
+      session->ls_race_pending = 0;
+      rc = ldap_init_fd (session->ls_race_sd, LDAP_PROTO_TCP, uri,
+			 &session->ls_conn);
+      if (rc != LDAP_SUCCESS)
+	close (session->ls_race_sd);
+    }
+#endif /* HAVE_LDAP_INIT_FD */
+
+  if (rc != LDAP_SUCCESS)
+    rc = ldap_initialize (&session->ls_conn, uri);
 #else
   if (strncasecmp (uri, "ldap://", sizeof ("ldap://") - 1) != 0)
     {
@@ -1588,12 +2353,36 @@ do_check_init (ldap_session_t *session)
 
   /* Check that the config is (still) valid */
   stat = _nss_ldap_validateconfig (session->ls_config);
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  if (stat == NSS_TRYAGAIN && session != &__session)
+    {
+      /*
+       * Private sessions share the global configuration, which
+       * is only reloaded under the exclusive lock. Carry on with
+       * the old one; the next lookup will reload it.
+       */
+      stat = NSS_SUCCESS;
+    }
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
   if (stat == NSS_TRYAGAIN)
     {
       /* Config has changed close old session */
       do_close (session);
+      if (session->ls_config->ldc_compiled_maps != NULL)
+	{
+	  free (session->ls_config->ldc_compiled_maps);
+	  session->ls_config->ldc_compiled_maps = NULL;
+	}
       session->ls_config = NULL;
       session->ls_current_uri = -1;
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+      do_close_private_sessions (1);
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+      /* results read under the old configuration must not be parsed */
+      __config_generation++;
+      do_stash_clear (&__stash);
+      do_stash_clear (do_get_stash ());
     }
 
   /* If we have no config then the connection should never have been made */
@@ -1774,11 +2563,25 @@ do_init (ldap_session_t *session)
  	  session->ls_config = NULL;
 	  return NSS_UNAVAIL;
 	}
+
+      /* if this fails, mappings are looked up on each use */
+      (void) _nss_ldap_map_compile (session->ls_config);
+
       session->ls_current_uri = 0;
     }
 
   cfg = session->ls_config;
 
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  /*
+   * The attribute tables, filters, debugging and SSL library are
+   * process wide and were set up by the global session, which
+   * private sessions may be reading from concurrently.
+   */
+  if (session != &__session)
+    goto init_session;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
   _nss_ldap_init_attributes (cfg->ldc_attrtab, (cfg->ldc_flags & NSS_LDAP_FLAGS_GETGRENT_SKIPMEMBERS) != 0);
   _nss_ldap_init_filters ();
 
@@ -1827,6 +2630,9 @@ do_init (ldap_session_t *session)
     }
 #endif /* SSL */
 
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+init_session:
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
   session->ls_conn = NULL;
 
   do_init_mechs (session);
@@ -2393,7 +3199,7 @@ ent_context_t *
 _nss_ldap_ent_context_init_locked (ent_context_t ** pctx)
 {
   ent_context_t *ctx;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_ent_context_init_locked");
 
@@ -2411,6 +3217,7 @@ _nss_ldap_ent_context_init_locked (ent_context_t ** pctx)
     }
   else
     {
+      do_drop_ahead (session, ctx);
       if (ctx->ec_res != NULL)
 	{
 	  ldap_msgfree (ctx->ec_res);
@@ -2429,6 +3236,12 @@ _nss_ldap_ent_context_init_locked (ent_context_t ** pctx)
   ctx->ec_cookie = NULL;
   ctx->ec_res = NULL;
   ctx->ec_msgid = -1;
+  ctx->ec_next_msgid = -1;
+  ctx->ec_count = 0;
+  ctx->ec_pagesize = 0;
+  ctx->ec_page_start.tv_sec = 0;
+  ctx->ec_page_latency = -1;
+  ctx->ec_entry_size = 0;
   ctx->ec_sd = NULL;
   ctx->ec_eof = 0;
 
@@ -2456,6 +3269,8 @@ _nss_ldap_ent_context_init_internal_locked (ent_context_t ** pctx)
 static void
 do_context_release (ldap_session_t * session, ent_context_t * ctx, int free_context)
 {
+  do_drop_ahead (session, ctx);
+
   /*
    * Abandon the search if there were more results to fetch.
    */
@@ -2499,7 +3314,7 @@ do_context_release (ldap_session_t * session, ent_context_t * ctx, int free_cont
 void
 _nss_ldap_ent_context_release (ent_context_t ** ctx)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_ent_context_release");
 
@@ -2620,6 +3435,221 @@ do_triple_permutations (const char *machine, const char *user,
 }
 #endif /* HAVE_NSSWITCH_H || HAVE_IRS_H */
 
+/*
+ * A filter prototype split into literal pieces, each followed by
+ * an argument slot, so that a filter can be built with a single
+ * escape-and-append pass rather than escaping into a temporary
+ * buffer and calling snprintf().
+ */
+#define LDAP_FILT_MAXSEGS	8
+#define LDAP_FILT_TEMPLATES	128	/* must be a power of two */
+
+enum ldap_filter_slot
+{
+  LFS_NONE = 0,
+  LFS_STRING,
+  LFS_NUMBER
+};
+
+typedef struct ldap_filter_segment
+{
+  const char *lfs_text;
+  size_t lfs_len;
+  enum ldap_filter_slot lfs_slot;
+} ldap_filter_segment_t;
+
+typedef struct ldap_filter_template
+{
+  /* the prototype, which holds the literal text */
+  const char *lft_prot;
+  /* 0 if the prototype could not be compiled */
+  int lft_count;
+  ldap_filter_segment_t lft_segs[LDAP_FILT_MAXSEGS];
+} ldap_filter_template_t;
+
+/*
+ * Templates are keyed by the address of the prototype. They
+ * are (re)compiled along with the global filters, under the
+ * same lock.
+ */
+static ldap_filter_template_t __filter_templates[LDAP_FILT_TEMPLATES];
+
+static ldap_filter_template_t *
+do_filter_template_slot (const char *filterprot)
+{
+  unsigned long i, h;
+
+  h = ((unsigned long) filterprot) >> 4;
+
+  for (i = 0; i < LDAP_FILT_TEMPLATES; i++)
+    {
+      ldap_filter_template_t *lft =
+	&__filter_templates[(h + i) & (LDAP_FILT_TEMPLATES - 1)];
+
+      if (lft->lft_prot == filterprot || lft->lft_prot == NULL)
+	return lft;
+    }
+
+  return NULL;
+}
+
+void
+_nss_ldap_compile_filter (const char *filterprot)
+{
+  ldap_filter_template_t *lft;
+  ldap_filter_segment_t *seg;
+  const char *p, *text;
+
+  lft = do_filter_template_slot (filterprot);
+  if (lft == NULL)
+    return;
+
+  lft->lft_prot = filterprot;
+  lft->lft_count = 0;
+
+  for (p = text = filterprot;; p++)
+    {
+      if (*p != '\0' && *p != '%')
+	continue;
+
+      if (lft->lft_count == LDAP_FILT_MAXSEGS)
+	{
+	  lft->lft_count = 0;
+	  return;
+	}
+
+      seg = &lft->lft_segs[lft->lft_count++];
+      seg->lfs_text = text;
+      seg->lfs_len = p - text;
+      seg->lfs_slot = LFS_NONE;
+
+      if (*p == '\0')
+	break;
+
+      switch (*++p)
+	{
+	case 's':
+	  seg->lfs_slot = LFS_STRING;
+	  break;
+	case 'd':
+	  seg->lfs_slot = LFS_NUMBER;
+	  break;
+	case '%':
+	  seg->lfs_len++;
+	  break;
+	default:
+	  /* leave anything else to snprintf() */
+	  lft->lft_count = 0;
+	  return;
+	}
+
+      text = p + 1;
+    }
+}
+
+/*
+ * Build a filter from a compiled prototype, ANDing in the service
+ * search descriptor's filter (if any) as do_filter() does. Returns
+ * NSS_TRYAGAIN if the filter does not fit or the arguments do not
+ * match the prototype, in which case the caller falls back to the
+ * snprintf() path.
+ */
+static NSS_STATUS
+do_filter_render (const ldap_filter_template_t * lft,
+		  const ldap_args_t * args,
+		  ldap_service_search_descriptor_t * sd,
+		  char *buf, size_t buflen)
+{
+  char *p = buf, *limit;
+  const char *s;
+  int i, arg = 0;
+
+  if (lft == NULL || lft->lft_count == 0 || buflen == 0)
+    return NSS_TRYAGAIN;
+
+  /* leave room for the terminator */
+  limit = buf + buflen - 1;
+
+  for (i = 0; i < lft->lft_count; i++)
+    {
+      const ldap_filter_segment_t *seg = &lft->lft_segs[i];
+      char num[sizeof (long) * 3 + 2], *q;
+      unsigned long n;
+
+      if ((size_t) (limit - p) < seg->lfs_len)
+	return NSS_TRYAGAIN;
+
+      memcpy (p, seg->lfs_text, seg->lfs_len);
+      p += seg->lfs_len;
+
+      switch (seg->lfs_slot)
+	{
+	case LFS_STRING:
+	  if (arg == 0 && (args->la_type == LA_TYPE_STRING ||
+			   args->la_type == LA_TYPE_STRING_AND_STRING))
+	    s = args->la_arg1.la_string;
+	  else if (arg == 1 && (args->la_type == LA_TYPE_STRING_AND_STRING ||
+				args->la_type == LA_TYPE_NUMBER_AND_STRING))
+	    s = args->la_arg2.la_string;
+	  else
+	    return NSS_TRYAGAIN;
+
+	  if (_nss_ldap_escape_append (s, &p, limit) != NSS_SUCCESS)
+	    return NSS_TRYAGAIN;
+	  arg++;
+	  break;
+	case LFS_NUMBER:
+	  if (arg != 0 || (args->la_type != LA_TYPE_NUMBER &&
+			   args->la_type != LA_TYPE_NUMBER_AND_STRING))
+	    return NSS_TRYAGAIN;
+
+	  q = num + sizeof (num);
+	  n = (args->la_arg1.la_number < 0) ?
+	    -(unsigned long) args->la_arg1.la_number :
+	    (unsigned long) args->la_arg1.la_number;
+	  do
+	    {
+	      *--q = '0' + (n % 10);
+	      n /= 10;
+	    }
+	  while (n != 0);
+	  if (args->la_arg1.la_number < 0)
+	    *--q = '-';
+
+	  if ((size_t) (limit - p) < (size_t) (num + sizeof (num) - q))
+	    return NSS_TRYAGAIN;
+	  memcpy (p, q, num + sizeof (num) - q);
+	  p += num + sizeof (num) - q;
+	  arg++;
+	  break;
+	case LFS_NONE:
+	  break;
+	}
+    }
+
+  if (sd != NULL && sd->lsd_filter != NULL)
+    {
+      size_t sdlen = strlen (sd->lsd_filter);
+
+      /* remove trailing bracket */
+      if (p > buf && p[-1] == ')')
+	p--;
+
+      if ((size_t) (limit - p) < sdlen + sizeof ("())") - 1)
+	return NSS_TRYAGAIN;
+
+      *p++ = '(';
+      memcpy (p, sd->lsd_filter, sdlen);
+      p += sdlen;
+      *p++ = ')';
+      *p++ = ')';
+    }
+
+  *p = '\0';
+
+  return NSS_SUCCESS;
+}
+
 /*
  * AND or OR a set of filters.
  */
@@ -2630,9 +3660,14 @@ do_aggregate_filter (const char **values,
 {
   NSS_STATUS stat;
   const char **valueP;
+  const ldap_filter_template_t *lft;
+  ldap_args_t a;
 
   assert (buflen > sizeof ("(|)"));
 
+  lft = do_filter_template_slot (filterprot);
+  LA_INIT (a);
+
   bufptr[0] = '(';
   bufptr[1] = (type == LA_TYPE_STRING_LIST_AND) ? '&' : '|';
 
@@ -2644,6 +3679,17 @@ do_aggregate_filter (const char **values,
       size_t len;
       char filter[LDAP_FILT_MAXSIZ], escapedBuf[LDAP_FILT_MAXSIZ];
 
+      /* leave room for the closing bracket */
+      LA_STRING (a) = *valueP;
+      if (do_filter_render (lft, &a, NULL, bufptr, buflen - 1)
+	  == NSS_SUCCESS)
+	{
+	  len = strlen (bufptr);
+	  bufptr += len;
+	  buflen -= len;
+	  continue;
+	}
+
       stat =
 	_nss_ldap_escape_string (*valueP, escapedBuf, sizeof (escapedBuf));
       if (stat != NSS_SUCCESS)
@@ -2678,16 +3724,28 @@ do_aggregate_filter (const char **values,
 static NSS_STATUS
 do_filter (const ldap_args_t * args, const char *filterprot,
 	   ldap_service_search_descriptor_t * sd, char *userBuf,
-	   size_t userBufSiz, char **dynamicUserBuf, const char **retFilter)
+	   size_t userBufSiz, const char **retFilter)
 {
   char buf1[LDAP_FILT_MAXSIZ], buf2[LDAP_FILT_MAXSIZ];
   char *filterBufP, filterBuf[LDAP_FILT_MAXSIZ];
+  char *dynamicUserBuf = NULL;	/* from the lookup arena */
   size_t filterSiz;
   NSS_STATUS stat = NSS_SUCCESS;
 
   debug ("==> do_filter");
 
-  *dynamicUserBuf = NULL;
+  if (args != NULL &&
+      (args->la_type == LA_TYPE_STRING ||
+       args->la_type == LA_TYPE_NUMBER ||
+       args->la_type == LA_TYPE_STRING_AND_STRING ||
+       args->la_type == LA_TYPE_NUMBER_AND_STRING) &&
+      do_filter_render (do_filter_template_slot (filterprot), args, sd,
+			userBuf, userBufSiz) == NSS_SUCCESS)
+    {
+      *retFilter = userBuf;
+      debug ("<== do_filter: %s", *retFilter);
+      return NSS_SUCCESS;
+    }
 
   if (args != NULL && args->la_type != LA_TYPE_NONE)
     {
@@ -2750,8 +3808,9 @@ do_filter (const ldap_args_t * args, const char *filterprot,
 					     filterBufP, filterSiz);
 	      if (stat == NSS_TRYAGAIN)
 		{
-		  filterBufP = *dynamicUserBuf = realloc (*dynamicUserBuf,
-							  2 * filterSiz);
+		  filterBufP = dynamicUserBuf =
+		    _nss_ldap_arena_realloc (dynamicUserBuf, filterSiz,
+					     2 * filterSiz);
 		  if (filterBufP == NULL)
 		    return NSS_UNAVAIL;
 		  filterSiz *= 2;
@@ -2769,8 +3828,9 @@ do_filter (const ldap_args_t * args, const char *filterprot,
 					  filterprot, filterBufP, filterSiz);
 	      if (stat == NSS_TRYAGAIN)
 		{
-		  filterBufP = *dynamicUserBuf = realloc (*dynamicUserBuf,
-							  2 * filterSiz);
+		  filterBufP = dynamicUserBuf =
+		    _nss_ldap_arena_realloc (dynamicUserBuf, filterSiz,
+					     2 * filterSiz);
 		  if (filterBufP == NULL)
 		    return NSS_UNAVAIL;
 		  filterSiz *= 2;
@@ -2797,22 +3857,17 @@ do_filter (const ldap_args_t * args, const char *filterprot,
 	  if (filterBufP[filterBufPLen - 1] == ')')
 	    filterBufP[filterBufPLen - 1] = '\0';
 
-	  if (*dynamicUserBuf != NULL)
+	  if (dynamicUserBuf != NULL)
 	    {
-	      char *oldDynamicUserBuf = *dynamicUserBuf;
 	      size_t dynamicUserBufSiz;
 
 	      dynamicUserBufSiz = filterBufPLen + strlen (sd->lsd_filter) + sizeof ("())");
-	      *dynamicUserBuf = malloc (dynamicUserBufSiz);
-	      if (*dynamicUserBuf == NULL)
-		{
-		  free (oldDynamicUserBuf);
-		  return NSS_UNAVAIL;
-		}
+	      dynamicUserBuf = _nss_ldap_arena_alloc (dynamicUserBufSiz);
+	      if (dynamicUserBuf == NULL)
+		return NSS_UNAVAIL;
 
-	      snprintf (*dynamicUserBuf, dynamicUserBufSiz, "%s(%s))",
+	      snprintf (dynamicUserBuf, dynamicUserBufSiz, "%s(%s))",
 			filterBufP, sd->lsd_filter);
-	      free (oldDynamicUserBuf);
 	    }
 	  else
 	    {
@@ -2821,35 +3876,206 @@ do_filter (const ldap_args_t * args, const char *filterprot,
 	    }
 	}
 
-      if (*dynamicUserBuf != NULL)
-	*retFilter = *dynamicUserBuf;
-      else
-	*retFilter = userBuf;
-    }
-  else
+      if (dynamicUserBuf != NULL)
+	*retFilter = dynamicUserBuf;
+      else
+	*retFilter = userBuf;
+    }
+  else
+    {
+      /* no arguments, probably an enumeration filter */
+      if (sd != NULL && sd->lsd_filter != NULL)
+	{
+	  snprintf (userBuf, userBufSiz, "(&%s(%s))",
+		    filterprot, sd->lsd_filter);
+	  *retFilter = userBuf;
+	}
+      else
+	{
+	  *retFilter = filterprot;
+	}
+    }
+
+  debug ("<== do_filter: %s", *retFilter);
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Start timing a page when it is requested, or when the caller
+ * begins to wait for a page that was requested ahead of time.
+ */
+static void
+do_page_clock_start (ent_context_t * ctx)
+{
+  gettimeofday (&ctx->ec_page_start, NULL);
+  ctx->ec_page_latency = -1;
+}
+
+/*
+ * Stop timing the page once its first message comes off the
+ * connection, so that a caller slow to consume the page does not
+ * count against the server.
+ */
+static void
+do_page_clock_stop (ent_context_t * ctx)
+{
+  struct timeval now;
+
+  if (ctx->ec_page_start.tv_sec == 0 || ctx->ec_page_latency >= 0)
+    return;
+
+  gettimeofday (&now, NULL);
+  ctx->ec_page_latency = (now.tv_sec - ctx->ec_page_start.tv_sec) * 1000L +
+    (now.tv_usec - ctx->ec_page_start.tv_usec) / 1000L;
+  if (ctx->ec_page_latency < 0)
+    ctx->ec_page_latency = 0;
+}
+
+/*
+ * Wrapper around ldap_result() to skip over search references
+ * and deal transparently with the last entry.
+ */
+static void
+do_drop_ahead (ldap_session_t *session, ent_context_t * ctx)
+{
+  if (ctx->ec_ahead == NULL)
+    return;
+
+  if (ctx->ec_borrowed)
+    {
+      ctx->ec_res = NULL;
+      ctx->ec_borrowed = 0;
+    }
+
+  ldap_msgfree (ctx->ec_ahead);
+  ctx->ec_ahead = NULL;
+  ctx->ec_ahead_next = NULL;
+
+  /* the page read ahead, if any, is now the outstanding search */
+  ctx->ec_msgid = ctx->ec_next_msgid;
+  ctx->ec_next_msgid = -1;
+  ctx->ec_count = 0;
+}
+
+/*
+ * Return the next entry of a page read ahead (see do_read_ahead()).
+ * Once it is exhausted, switch to the search for the next page;
+ * NSS_NOTFOUND means there is none.
+ */
+static NSS_STATUS
+do_result_ahead (ldap_session_t *session, ent_context_t * ctx)
+{
+  if (ctx->ec_borrowed)
+    {
+      /* freed along with ec_ahead */
+      ctx->ec_res = NULL;
+      ctx->ec_borrowed = 0;
+    }
+
+  if (ctx->ec_ahead_next != NULL)
+    {
+      ctx->ec_res = ctx->ec_ahead_next;
+      ctx->ec_borrowed = 1;
+      ctx->ec_ahead_next = ldap_next_entry (session->ls_conn, ctx->ec_res);
+      return NSS_SUCCESS;
+    }
+
+  do_drop_ahead (session, ctx);
+
+  /* time the next page only from when the caller needs it */
+  if (ctx->ec_msgid >= 0)
+    do_page_clock_start (ctx);
+
+  return (ctx->ec_msgid < 0) ? NSS_NOTFOUND : NSS_SUCCESS;
+}
+
+/*
+ * Approximate the memory taken by an entry: the sum of its
+ * attribute names and values.
+ */
+static size_t
+do_entry_size (ldap_session_t *session, LDAPMessage * e)
+{
+  BerElement *ber = NULL;
+  struct berval **vals;
+  char *attribute;
+  size_t size = 0;
+  int i;
+
+  for (attribute = ldap_first_attribute (session->ls_conn, e, &ber);
+       attribute != NULL;
+       attribute = ldap_next_attribute (session->ls_conn, e, ber))
     {
-      /* no arguments, probably an enumeration filter */
-      if (sd != NULL && sd->lsd_filter != NULL)
-	{
-	  snprintf (userBuf, userBufSiz, "(&%s(%s))",
-		    filterprot, sd->lsd_filter);
-	  *retFilter = userBuf;
-	}
-      else
+      size += strlen (attribute);
+
+      vals = ldap_get_values_len (session->ls_conn, e, attribute);
+      if (vals != NULL)
 	{
-	  *retFilter = filterprot;
+	  for (i = 0; vals[i] != NULL; i++)
+	    size += vals[i]->bv_len;
+	  ldap_value_free_len (vals);
 	}
+
+#ifdef HAVE_LDAP_MEMFREE
+      ldap_memfree (attribute);
+#endif
     }
 
-  debug ("<== do_filter: %s", *retFilter);
+  if (ber != NULL)
+    ber_free (ber, 0);
 
-  return NSS_SUCCESS;
+  return size;
 }
 
 /*
- * Wrapper around ldap_result() to skip over search references
- * and deal transparently with the last entry.
+ * Size of the next page of an enumeration. With nss_pagesize_max
+ * set, it follows how long the last page took to start arriving,
+ * within the configured bounds and the memory budget of a page.
  */
+static int
+do_adapt_pagesize (ldap_session_t *session, ent_context_t * ctx)
+{
+  ldap_config_t *cfg = session->ls_config;
+  long elapsed;
+  int pagesize, lo, hi;
+
+  pagesize = (ctx->ec_pagesize != 0) ? ctx->ec_pagesize : cfg->ldc_pagesize;
+
+  if (cfg->ldc_pagesize_max <= 0 || ctx->ec_page_latency < 0)
+    return pagesize;
+
+  /* each page is only counted once */
+  elapsed = ctx->ec_page_latency;
+  ctx->ec_page_latency = -1;
+
+  if (elapsed < LDAP_NSS_PAGE_FAST)
+    pagesize *= 2;
+  else if (elapsed > LDAP_NSS_PAGE_SLOW)
+    pagesize /= 2;
+
+  hi = cfg->ldc_pagesize_max;
+  if (ctx->ec_entry_size != 0 &&
+      (size_t) hi > LDAP_NSS_PAGE_MAXBYTES / ctx->ec_entry_size)
+    hi = LDAP_NSS_PAGE_MAXBYTES / ctx->ec_entry_size;
+
+  lo = (cfg->ldc_pagesize_min > 0) ? cfg->ldc_pagesize_min : 1;
+  if (hi < lo)
+    hi = lo;
+
+  if (pagesize > hi)
+    pagesize = hi;
+  else if (pagesize < lo)
+    pagesize = lo;
+
+  debug (":== do_adapt_pagesize: page took %ldms, next page %d entries",
+	 elapsed, pagesize);
+
+  ctx->ec_pagesize = pagesize;
+
+  return pagesize;
+}
+
 static NSS_STATUS
 do_result (ldap_session_t *session, ent_context_t * ctx, int all)
 {
@@ -2865,6 +4091,18 @@ do_result (ldap_session_t *session, ent_context_t * ctx, int all)
       return NSS_UNAVAIL;
     }
 
+  if (ctx->ec_ahead != NULL)
+    {
+      stat = do_result_ahead (session, ctx);
+      if (ctx->ec_res != NULL || stat != NSS_SUCCESS)
+	{
+	  debug ("<== do_result: returns %s(%d) from page read ahead",
+		 __nss_ldap_status2string(stat), stat);
+	  return stat;
+	}
+      /* carry on with the next page */
+    }
+
   do
     {
       if (ctx->ec_res != NULL)
@@ -2911,112 +4149,536 @@ do_result (ldap_session_t *session, ent_context_t * ctx, int all)
 	  stat = NSS_UNAVAIL;
 	  break;
 	case LDAP_RES_SEARCH_ENTRY:
+	  do_page_clock_stop (ctx);
+	  /* sample the first entry of each page for its size */
+	  if (ctx->ec_count++ == 0 &&
+	      session->ls_config->ldc_pagesize_max > 0)
+	    {
+	      size_t size = do_entry_size (session, ctx->ec_res);
+
+	      ctx->ec_entry_size = (ctx->ec_entry_size != 0) ?
+		(ctx->ec_entry_size * 3 + size) / 4 : size;
+	    }
 	  stat = NSS_SUCCESS;
 	  break;
 	case LDAP_RES_SEARCH_RESULT:
+	  do_page_clock_stop (ctx);
+	  ctx->ec_count = 0;
+	  if (all != LDAP_MSG_ALL)
+	    do_adapt_pagesize (session, ctx);
 	  if (all == LDAP_MSG_ALL)
 	    {
-	      /* we asked for the result chain, we got it. */
-	      stat = NSS_SUCCESS;
+	      /* we asked for the result chain, we got it. */
+	      stat = NSS_SUCCESS;
+	    }
+	  else
+	    {
+#ifdef LDAP_MORE_RESULTS_TO_RETURN
+	      int parserc;
+	      /* NB: this frees ctx->ec_res */
+	      LDAPControl **resultControls = NULL;
+
+	      if (ctx->ec_cookie != NULL)
+		{
+		  ber_bvfree(ctx->ec_cookie);
+		  ctx->ec_cookie = NULL;
+		}
+
+	      debug (":== do_result: call ldap_parse_result");
+	      parserc =
+		ldap_parse_result (session->ls_conn, ctx->ec_res, &rc, NULL,
+				   NULL, NULL, &resultControls, 1);
+	      if (parserc != LDAP_SUCCESS
+		  && parserc != LDAP_MORE_RESULTS_TO_RETURN)
+		{
+		  ldap_abandon (session->ls_conn, ctx->ec_msgid);
+		  syslog (LOG_ERR,
+			  "nss_ldap: could not get LDAP result - %s",
+			  ldap_err2string (parserc));
+		  stat = NSS_UNAVAIL;
+		}
+	      else if (resultControls != NULL)
+		{
+		  /* See if there are any more pages to come */
+		  debug (":== do_result: call ldap_parse_page_control");
+		  /* Bug in LDAP library do not reset errno */
+		  {
+		    int erc;
+		    GET_ERROR_NUMBER (session->ls_conn, &erc);
+		    debug(":== do_result: error prior to call to ldap_parse_page_control %s(%d)", ldap_err2string (erc), erc);
+		    erc = LDAP_SUCCESS;
+		    SET_ERROR_NUMBER (session->ls_conn, &erc);
+		  }
+		  parserc = ldap_parse_page_control (session->ls_conn,
+						     resultControls, NULL,
+						     &(ctx->ec_cookie));
+		  ldap_controls_free (resultControls);
+		  stat = NSS_NOTFOUND;
+		}
+	      else
+		{
+		  stat = NSS_NOTFOUND;
+		}
+#else
+	      stat = NSS_NOTFOUND;
+#endif /* LDAP_MORE_RESULTS_TO_RETURN */
+	      ctx->ec_res = NULL;
+	      ctx->ec_msgid = -1;
+	    }
+	  break;
+	default:
+	  stat = NSS_UNAVAIL;
+	  break;
+	}
+    }
+#ifdef LDAP_RES_SEARCH_REFERENCE
+  while (rc == LDAP_RES_SEARCH_REFERENCE);
+#else
+  while (0);
+#endif /* LDAP_RES_SEARCH_REFERENCE */
+
+  if (stat == NSS_SUCCESS)
+    time (&session->ls_timestamp);
+
+  debug ("<== do_result: returns %s(%d), ldap result %s",
+	 __nss_ldap_status2string(stat), stat, ldap_err2string(rc));
+
+  return stat;
+}
+
+static void
+do_sleep (long usecs)
+{
+  /*
+   * Historically nss_ldap did not attempt to resume sleep in the
+   * event of a signal. This is probably useful behaviour (so that
+   * a user can interrupt) so it is preserved here.
+   */
+#if defined(HAVE_NANOSLEEP)
+  struct timespec ts;
+
+  ts.tv_sec = usecs / USECSPERSEC;
+  ts.tv_nsec = (usecs % USECSPERSEC) * 1000;
+#elif defined(HAVE_USLEEP)
+  usleep(usecs);
+#else
+  struct timeval tv;
+
+  tv.tv_sec = usecs / USECSPERSEC;
+  tv.tv_usec = usecs % USECSPERSEC;
+
+  select(0, NULL, NULL, NULL, &tv);
+#endif
+}
+
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+/*
+ * The health table lives in the shared configuration and is
+ * updated by concurrent lookups, which hold __config_lock shared
+ * only.
+ */
+static pthread_mutex_t __uri_health_lock = PTHREAD_MUTEX_INITIALIZER;
+# define URI_HEALTH_LOCK()	pthread_mutex_lock (&__uri_health_lock)
+# define URI_HEALTH_UNLOCK()	pthread_mutex_unlock (&__uri_health_lock)
+#else
+# define URI_HEALTH_LOCK()
+# define URI_HEALTH_UNLOCK()
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+/*
+ * Record the outcome of connecting to a server. Failed servers
+ * are avoided for a period that doubles with each consecutive
+ * failure; successful probes update the smoothed connect time.
+ */
+static void
+do_uri_health_update (ldap_config_t *cfg, int uri, int ok,
+		      unsigned long rtt)
+{
+  ldap_uri_health_t *h = &cfg->ldc_uri_health[uri];
+  time_t backoff;
+  int i;
+
+  URI_HEALTH_LOCK ();
+
+  if (ok)
+    {
+      h->luh_failures = 0;
+      h->luh_retry = 0;
+      if (rtt != 0)
+	h->luh_rtt = (h->luh_rtt != 0) ? (h->luh_rtt * 7 + rtt) / 8 : rtt;
+      URI_HEALTH_UNLOCK ();
+      return;
+    }
+
+  backoff = LDAP_NSS_URI_BACKOFF;
+  for (i = 0; i < h->luh_failures && backoff < LDAP_NSS_URI_MAXBACKOFF; i++)
+    backoff *= 2;
+  if (backoff > LDAP_NSS_URI_MAXBACKOFF)
+    backoff = LDAP_NSS_URI_MAXBACKOFF;
+
+  h->luh_failures++;
+  h->luh_retry = time (NULL) + backoff;
+
+  URI_HEALTH_UNLOCK ();
+
+  debug (":== do_uri_health_update: avoiding %s for %ld seconds",
+	 cfg->ldc_uris[uri], (long) backoff);
+}
+
+/*
+ * Servers which are not backing off come first, fastest first;
+ * servers never measured follow in configuration order. Servers
+ * backing off come last, soonest to be retried first.
+ */
+static int
+do_uri_cmp (const ldap_uri_health_t *health, time_t now, int a, int b)
+{
+  const ldap_uri_health_t *ha = &health[a];
+  const ldap_uri_health_t *hb = &health[b];
+  int da = (ha->luh_retry > now), db = (hb->luh_retry > now);
+
+  if (da != db)
+    return da - db;
+
+  if (da)
+    return (ha->luh_retry > hb->luh_retry) - (ha->luh_retry < hb->luh_retry);
+
+  if (ha->luh_rtt == 0 || hb->luh_rtt == 0)
+    return (ha->luh_rtt == 0) - (hb->luh_rtt == 0);
+
+  return (ha->luh_rtt > hb->luh_rtt) - (ha->luh_rtt < hb->luh_rtt);
+}
+
+/*
+ * Order the configured URIs by preference; returns the number
+ * of URIs and, in *healthy, how many are not backing off. The
+ * ranking is made from a snapshot of the health table, which
+ * is left in health.
+ */
+static int
+do_rank_uris (ldap_config_t *cfg, int *order, int *healthy,
+	      ldap_uri_health_t *health)
+{
+  time_t now = time (NULL);
+  int count, i;
+
+  *healthy = 0;
+
+  URI_HEALTH_LOCK ();
+  memcpy (health, cfg->ldc_uri_health, sizeof (cfg->ldc_uri_health));
+  URI_HEALTH_UNLOCK ();
+
+  for (count = 0; cfg->ldc_uris[count] != NULL; count++)
+    {
+      /* insertion sort, stable with respect to configuration order */
+      for (i = count;
+	   i > 0 && do_uri_cmp (health, now, order[i - 1], count) > 0; i--)
+	order[i] = order[i - 1];
+      order[i] = count;
+
+      if (health[count].luh_retry <= now)
+	(*healthy)++;
+    }
+
+  return count;
+}
+
+/*
+ * Extract the host and port to which an ldap:// or ldaps:// URI
+ * connects. Other schemes (such as ldapi://) are not raced.
+ */
+static int
+do_uri_endpoint (const char *uri, int defport, char *host, size_t hostlen,
+		 char *port, size_t portlen)
+{
+  const char *p, *q, *end;
+  int ldaps;
+
+  if (strncasecmp (uri, "ldap://", sizeof ("ldap://") - 1) == 0)
+    {
+      ldaps = 0;
+      p = uri + sizeof ("ldap://") - 1;
+    }
+  else if (strncasecmp (uri, "ldaps://", sizeof ("ldaps://") - 1) == 0)
+    {
+      ldaps = 1;
+      p = uri + sizeof ("ldaps://") - 1;
+    }
+  else
+    return -1;
+
+  end = p + strcspn (p, "/");
+
+  if (*p == '[')
+    {
+      /* IPv6 literal */
+      p++;
+      q = memchr (p, ']', end - p);
+      if (q == NULL)
+	return -1;
+    }
+  else
+    {
+      q = memchr (p, ':', end - p);
+      if (q == NULL)
+	q = end;
+    }
+
+  if (q == p || (size_t) (q - p) >= hostlen)
+    return -1;
+
+  memcpy (host, p, q - p);
+  host[q - p] = '\0';
+
+  if (*q == ']')
+    q++;
+
+  if (q < end && *q == ':' && end - q > 1)
+    {
+      if ((size_t) (end - q - 1) >= portlen)
+	return -1;
+      memcpy (port, q + 1, end - q - 1);
+      port[end - q - 1] = '\0';
+    }
+  else
+    {
+      /* as do_init_session() */
+      if (defport == 0)
+	defport = ldaps ? LDAPS_PORT : LDAP_PORT;
+      snprintf (port, portlen, "%d", defport);
+    }
+
+  return 0;
+}
+
+/*
+ * Start non-blocking TCP connections to the first count URIs in
+ * order and return the URI whose connection completes first, or
+ * -1 if none did within the bind time limit. Every completed or
+ * failed probe is recorded in the health table. If sdp is not
+ * NULL, the winning connection is left open there.
+ *
+ * Only the first address of each host is probed, and ldapi://
+ * URIs, which have no TCP endpoint, never take part.
+ */
+static int
+do_race_connect (ldap_config_t *cfg, const int *order, int count, int *sdp)
+{
+  struct pollfd fds[NSS_LDAP_CONFIG_URI_MAX + 1];
+  int which[NSS_LDAP_CONFIG_URI_MAX + 1];
+  struct timeval start, now;
+  int i, n = 0, live, winner = -1;
+  long timeout, elapsed;
+
+  debug ("==> do_race_connect");
+
+  gettimeofday (&start, NULL);
+
+  for (i = 0; i < count; i++)
+    {
+      char host[NSS_BUFSIZ], port[16];
+      struct addrinfo hints, *ai;
+      int sd;
+
+      if (do_uri_endpoint (cfg->ldc_uris[order[i]], cfg->ldc_port,
+			   host, sizeof (host), port, sizeof (port)) != 0)
+	continue;
+
+      memset (&hints, 0, sizeof (hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+
+      if (getaddrinfo (host, port, &hints, &ai) != 0)
+	{
+	  do_uri_health_update (cfg, order[i], 0, 0);
+	  continue;
+	}
+
+      sd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (sd < 0)
+	{
+	  freeaddrinfo (ai);
+	  continue;
+	}
+
+      fcntl (sd, F_SETFD, FD_CLOEXEC);
+      fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) | O_NONBLOCK);
+
+      if (connect (sd, ai->ai_addr, ai->ai_addrlen) < 0
+	  && errno != EINPROGRESS)
+	{
+	  close (sd);
+	  freeaddrinfo (ai);
+	  do_uri_health_update (cfg, order[i], 0, 0);
+	  continue;
+	}
+
+      freeaddrinfo (ai);
+
+      fds[n].fd = sd;
+      fds[n].events = POLLOUT;
+      fds[n].revents = 0;
+      which[n] = order[i];
+      n++;
+    }
+
+  timeout = (cfg->ldc_bind_timelimit > 0) ?
+    cfg->ldc_bind_timelimit * 1000L : -1;
+
+  live = n;
+  while (live > 0 && winner < 0)
+    {
+      int rc, wait = -1;
+
+      gettimeofday (&now, NULL);
+      elapsed = (now.tv_sec - start.tv_sec) * 1000L +
+	(now.tv_usec - start.tv_usec) / 1000L;
+
+      if (timeout >= 0)
+	{
+	  if (elapsed >= timeout)
+	    break;
+	  wait = (int) (timeout - elapsed);
+	}
+
+      rc = poll (fds, n, wait);
+      if (rc < 0 && errno == EINTR)
+	continue;
+      else if (rc <= 0)
+	break;
+
+      gettimeofday (&now, NULL);
+
+      for (i = 0; i < n; i++)
+	{
+	  int err = 0;
+	  NSS_LDAP_SOCKLEN_T len = sizeof (err);
+
+	  if (fds[i].fd < 0 || fds[i].revents == 0)
+	    continue;
+
+	  if (getsockopt (fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+	      || err != 0)
+	    {
+	      do_uri_health_update (cfg, which[i], 0, 0);
 	    }
 	  else
 	    {
-#ifdef LDAP_MORE_RESULTS_TO_RETURN
-	      int parserc;
-	      /* NB: this frees ctx->ec_res */
-	      LDAPControl **resultControls = NULL;
+	      unsigned long rtt;
 
-	      if (ctx->ec_cookie != NULL)
-		{
-		  ber_bvfree(ctx->ec_cookie);
-		  ctx->ec_cookie = NULL;
-		}
+	      rtt = (now.tv_sec - start.tv_sec) * USECSPERSEC +
+		(now.tv_usec - start.tv_usec);
+	      do_uri_health_update (cfg, which[i], 1, rtt ? rtt : 1);
 
-	      debug (":== do_result: call ldap_parse_result");
-	      parserc =
-		ldap_parse_result (session->ls_conn, ctx->ec_res, &rc, NULL,
-				   NULL, NULL, &resultControls, 1);
-	      if (parserc != LDAP_SUCCESS
-		  && parserc != LDAP_MORE_RESULTS_TO_RETURN)
-		{
-		  ldap_abandon (session->ls_conn, ctx->ec_msgid);
-		  syslog (LOG_ERR,
-			  "nss_ldap: could not get LDAP result - %s",
-			  ldap_err2string (parserc));
-		  stat = NSS_UNAVAIL;
-		}
-	      else if (resultControls != NULL)
-		{
-		  /* See if there are any more pages to come */
-		  debug (":== do_result: call ldap_parse_page_control");
-		  /* Bug in LDAP library do not reset errno */
-		  {
-		    int erc;
-		    GET_ERROR_NUMBER (session->ls_conn, &erc);
-		    debug(":== do_result: error prior to call to ldap_parse_page_control %s(%d)", ldap_err2string (erc), erc);
-		    erc = LDAP_SUCCESS;
-		    SET_ERROR_NUMBER (session->ls_conn, &erc);
-		  }
-		  parserc = ldap_parse_page_control (session->ls_conn,
-						     resultControls, NULL,
-						     &(ctx->ec_cookie));
-		  ldap_controls_free (resultControls);
-		  stat = NSS_NOTFOUND;
-		}
-	      else
+	      /* fds are in preference order, so the first one wins ties */
+	      if (winner < 0)
 		{
-		  stat = NSS_NOTFOUND;
+		  winner = which[i];
+		  if (sdp != NULL)
+		    {
+		      *sdp = fds[i].fd;
+		      fds[i].fd = -1;
+		      live--;
+		      continue;
+		    }
 		}
-#else
-	      stat = NSS_NOTFOUND;
-#endif /* LDAP_MORE_RESULTS_TO_RETURN */
-	      ctx->ec_res = NULL;
-	      ctx->ec_msgid = -1;
 	    }
-	  break;
-	default:
-	  stat = NSS_UNAVAIL;
-	  break;
+
+	  close (fds[i].fd);
+	  fds[i].fd = -1;
+	  live--;
 	}
     }
-#ifdef LDAP_RES_SEARCH_REFERENCE
-  while (rc == LDAP_RES_SEARCH_REFERENCE);
-#else
-  while (0);
-#endif /* LDAP_RES_SEARCH_REFERENCE */
 
-  if (stat == NSS_SUCCESS)
-    time (&session->ls_timestamp);
+  for (i = 0; i < n; i++)
+    {
+      if (fds[i].fd < 0)
+	continue;
 
-  debug ("<== do_result: returns %s(%d), ldap result %s",
-	 __nss_ldap_status2string(stat), stat, ldap_err2string(rc));
+      /* nobody answered in time, so the stragglers count as down */
+      if (winner < 0)
+	do_uri_health_update (cfg, which[i], 0, 0);
 
-  return stat;
+      close (fds[i].fd);
+    }
+
+  debug ("<== do_race_connect (%s)",
+	 winner < 0 ? "no winner" : cfg->ldc_uris[winner]);
+
+  return winner;
 }
 
+/*
+ * Choose the URI to open next: the fastest server not backing
+ * off. If its speed is not yet known, the top nss_connect_race
+ * candidates are raced and the first to accept a connection is
+ * used instead.
+ */
 static void
-do_sleep (long usecs)
+do_select_uri (ldap_session_t *session)
 {
+  ldap_config_t *cfg = session->ls_config;
+  int order[NSS_LDAP_CONFIG_URI_MAX + 1];
+  ldap_uri_health_t health[NSS_LDAP_CONFIG_URI_MAX + 1];
+  int count, healthy, uri, sd = -1;
+
+  debug ("==> do_select_uri");
+
+  count = do_rank_uris (cfg, order, &healthy, health);
+  if (count < 2)
+    {
+      debug ("<== do_select_uri (single URI)");
+      return;
+    }
+
+  uri = order[0];
+
+  if (healthy > 1 && cfg->ldc_connect_race > 1 &&
+      health[uri].luh_rtt == 0)
+    {
+      uri = do_race_connect (cfg, order,
+			     healthy < cfg->ldc_connect_race ?
+			     healthy : cfg->ldc_connect_race, &sd);
+      if (uri < 0)
+	{
+	  /* the losers are now backing off; take the next best */
+	  do_rank_uris (cfg, order, &healthy, health);
+	  uri = order[0];
+	}
+    }
+
+  if (uri != session->ls_current_uri)
+    {
+      /* the LDAP handle is tied to the URI it was initialized with */
+      do_close (session);
+      session->ls_current_uri = uri;
+    }
+
   /*
-   * Historically nss_ldap did not attempt to resume sleep in the
-   * event of a signal. This is probably useful behaviour (so that
-   * a user can interrupt) so it is preserved here.
+   * Hand the winning connection to the next do_init_session(),
+   * rather than have libldap connect again. It can only take over
+   * a plain TCP connection, so ldaps:// servers are connected anew,
+   * as are all servers with a libldap lacking ldap_init_fd().
    */
-#if defined(HAVE_NANOSLEEP)
-  struct timespec ts;
-
-  ts.tv_sec = usecs / USECSPERSEC;
-  ts.tv_nsec = (usecs % USECSPERSEC) * 1000;
-#elif defined(HAVE_USLEEP)
-  usleep(usecs);
-#else
-  struct timeval tv;
+  if (sd >= 0)
+    {
+      do_race_drop (session);
 
-  tv.tv_sec = usecs / USECSPERSEC;
-  tv.tv_usec = usecs % USECSPERSEC;
+#ifdef HAVE_LDAP_INIT_FD
+      if (session->ls_conn == NULL &&
+	  strncasecmp (cfg->ldc_uris[uri], "ldap://",
+		       sizeof ("ldap://") - 1) == 0)
+	{
+	  fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) & ~O_NONBLOCK);
+	  session->ls_race_sd = sd;
+	  session->ls_race_pending = 1;
+	}
+      else
+#endif /* HAVE_LDAP_INIT_FD */
+	close (sd);
+    }
 
-  select(0, NULL, NULL, NULL, &tv);
-#endif
+  debug ("<== do_select_uri (%s)", cfg->ldc_uris[uri]);
 }
 
 /*
@@ -3098,8 +4760,11 @@ do_with_reconnect (ldap_session_t *session, const char *base, int scope,
 		}
 	      else
 		{
-		  /* First time round try to reconnect to the current uri */
+		  /* First time round try the best server we know of */
 		  firstTime = 0; /* Note we have done the first one */
+
+		  do_select_uri (session);
+		  start_uri = session->ls_current_uri;
 		}
 
 	      if (session->ls_state != LS_INITIALIZED)
@@ -3108,6 +4773,9 @@ do_with_reconnect (ldap_session_t *session, const char *base, int scope,
 
 		  stat = do_init (session);
 
+		  /* a raced connection that do_init() did not use */
+		  do_race_drop (session);
+
 		  debug (":== do_with_reconnect: do_init returns %s(%d)", __nss_ldap_status2string(stat), stat);
  
 		  if (stat != NSS_SUCCESS)
@@ -3121,6 +4789,16 @@ do_with_reconnect (ldap_session_t *session, const char *base, int scope,
 
 	      stat = do_open (session);
 
+	      /*
+	       * Only connection and transport errors (which map to
+	       * NSS_TRYAGAIN) count against the server; a failed bind
+	       * would fail on any server.
+	       */
+	      if (stat == NSS_SUCCESS || stat == NSS_TRYAGAIN)
+		do_uri_health_update (session->ls_config,
+				      session->ls_current_uri,
+				      (stat == NSS_SUCCESS), 0);
+
 	      debug (":== do_with_reconnect: open of %s returned %s(%d)",
 		     session->ls_config->ldc_uris[session->ls_current_uri],
 		     __nss_ldap_status2string(stat), stat);
@@ -3409,8 +5087,14 @@ do_parse (ldap_session_t *session, ent_context_t * ctx, void *result, char
        * find one which is parseable, or exhaust available
        * entries, whichever is first.
        */
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+      do_index_begin (session, ctx->ec_res);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
       parseStat = parser (ctx->ec_res, &ctx->ec_state, result,
 			  buffer, buflen);
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+      do_index_end (session);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
 
       /* hold onto the state if we're out of memory XXX */
       ctx->ec_state.ls_retry = (parseStat == NSS_TRYAGAIN && buffer != NULL ? 1 : 0);
@@ -3421,8 +5105,10 @@ do_parse (ldap_session_t *session, ent_context_t * ctx, void *result, char
 	   || ctx->ec_state.ls_info.ls_index == -1))
 	{
 	  /* we don't need the result anymore, ditch it. */
-	  ldap_msgfree (ctx->ec_res);
+	  if (!ctx->ec_borrowed)
+	    ldap_msgfree (ctx->ec_res);
 	  ctx->ec_res = NULL;
+	  ctx->ec_borrowed = 0;
 	}
     }
   while (parseStat == NSS_NOTFOUND);
@@ -3460,55 +5146,362 @@ do_parse_s (ldap_session_t * session, ent_context_t * ctx,
 	  (ctx->ec_state.ls_type == LS_TYPE_KEY
 	   || ctx->ec_state.ls_info.ls_index == -1))
 	{
-	  if (e == NULL)
-	    e = ldap_first_entry (session->ls_conn, ctx->ec_res);
-	  else
-	    e = ldap_next_entry (session->ls_conn, e);
+	  if (e == NULL)
+	    e = ldap_first_entry (session->ls_conn, ctx->ec_res);
+	  else
+	    e = ldap_next_entry (session->ls_conn, e);
+	}
+
+      if (e == NULL)
+	{
+	  /* Could not get a result; bail */
+	  parseStat = NSS_NOTFOUND;
+	  break;
+	}
+
+      /*
+       * We have an entry; now, try to parse it. 
+       *
+       * If we do not parse the entry because of a schema
+       * violation, the parser should return NSS_NOTFOUND.
+       * We'll keep on trying subsequent entries until we
+       * find one which is parseable, or exhaust available
+       * entries, whichever is first.
+       */
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+      do_index_begin (session, e);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+      parseStat = parser (e, &ctx->ec_state, result, buffer, buflen);
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+      do_index_end (session);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+
+      /* hold onto the state if we're out of memory XXX */
+      ctx->ec_state.ls_retry = (parseStat == NSS_TRYAGAIN && buffer != NULL ? 1 : 0);
+    }
+  while (parseStat == NSS_NOTFOUND);
+
+  do_map_errno (parseStat, errnop);
+
+  debug ("<== do_parse_s");
+
+  return parseStat;
+}
+
+/*
+ * Read an entry from the directory, a la X.500. This is used
+ * for functions that need to retrieve attributes from a DN,
+ * such as the RFC2307bis group expansion function.
+ */
+NSS_STATUS
+_nss_ldap_read (const char *dn, const char **attributes, LDAPMessage ** res)
+{
+  ldap_session_t *session = do_get_session ();
+
+  return do_with_reconnect (session, dn, LDAP_SCOPE_BASE, "(objectclass=*)",
+			    attributes, 1, /* sizelimit */ res,
+			    (search_func_t) do_search_s);
+}
+
+NSS_STATUS
+_nss_ldap_read_async (const char *dn, const char **attributes,
+		      ldap_async_read_t * pRead)
+{
+  ldap_session_t *session = do_get_session ();
+  NSS_STATUS stat;
+  int msgid = -1;
+
+  debug ("==> _nss_ldap_read_async");
+
+  stat = do_with_reconnect (session, dn, LDAP_SCOPE_BASE, "(objectclass=*)",
+			    attributes, 1, /* sizelimit */ &msgid,
+			    (search_func_t) do_search);
+
+  pRead->lar_msgid = (stat == NSS_SUCCESS) ? msgid : -1;
+  pRead->lar_generation = session->ls_generation;
+
+  debug ("<== _nss_ldap_read_async: msgid %d", pRead->lar_msgid);
+
+  return stat;
+}
+
+NSS_STATUS
+_nss_ldap_read_result (ldap_async_read_t * pRead, LDAPMessage ** pRes)
+{
+  ldap_session_t *session = do_get_session ();
+  struct timeval tv, *tvp;
+  int rc, msgid = pRead->lar_msgid;
+
+  debug ("==> _nss_ldap_read_result");
+
+  *pRes = NULL;
+  pRead->lar_msgid = -1;
+
+  if (msgid < 0 || session->ls_state != LS_CONNECTED_TO_DSA ||
+      session->ls_generation != pRead->lar_generation)
+    {
+      debug ("<== _nss_ldap_read_result: request was lost");
+      return NSS_TRYAGAIN;
+    }
+
+  if (session->ls_config->ldc_timelimit == LDAP_NO_LIMIT)
+    {
+      tvp = NULL;
+    }
+  else
+    {
+      tv.tv_sec = session->ls_config->ldc_timelimit;
+      tv.tv_usec = 0;
+      tvp = &tv;
+    }
+
+  rc = ldap_result (session->ls_conn, msgid, LDAP_MSG_ALL, tvp, pRes);
+  if (rc <= 0 || *pRes == NULL)
+    {
+      if (rc == 0)
+	ldap_abandon (session->ls_conn, msgid);
+      debug ("<== _nss_ldap_read_result: ldap_result returns %d", rc);
+      return NSS_TRYAGAIN;
+    }
+
+  rc = ldap_result2error (session->ls_conn, *pRes, 0);
+  if (rc != LDAP_SUCCESS)
+    {
+      ldap_msgfree (*pRes);
+      *pRes = NULL;
+      debug ("<== _nss_ldap_read_result: %s", ldap_err2string (rc));
+      return (rc == LDAP_NO_SUCH_OBJECT) ? NSS_NOTFOUND : NSS_TRYAGAIN;
+    }
+
+  time (&session->ls_timestamp);
+
+  debug ("<== _nss_ldap_read_result");
+
+  return NSS_SUCCESS;
+}
+
+void
+_nss_ldap_read_abandon (ldap_async_read_t * pRead)
+{
+  ldap_session_t *session = do_get_session ();
+
+  if (pRead->lar_msgid >= 0 && session->ls_state == LS_CONNECTED_TO_DSA &&
+      session->ls_generation == pRead->lar_generation)
+    {
+      debug (":== _nss_ldap_read_abandon: msgid %d", pRead->lar_msgid);
+      ldap_abandon (session->ls_conn, pRead->lar_msgid);
+    }
+
+  pRead->lar_msgid = -1;
+}
+
+/*
+ * State of a pipelined read. Entries whose status is still
+ * NSS_TRYAGAIN have not been answered yet, so a read that is
+ * restarted after reconnecting only reissues those.
+ */
+typedef struct ldap_read_multi
+{
+  const char **lrm_dns;
+  size_t lrm_count;
+  LDAPMessage **lrm_res;
+  NSS_STATUS *lrm_stats;
+} ldap_read_multi_t;
+
+/*
+ * Pipelined base search function. Keeps up to nss_read_window
+ * searches outstanding and collects them oldest first, waiting
+ * on each msgid so that responses to other requests on the
+ * session, such as an enumeration in progress, are left alone.
+ * Don't call this directly; use _nss_ldap_read_multi().
+ */
+static int
+do_read_multi (ldap_session_t *session, const char *base, int scope,
+	       const char *filter, const char **attrs, int sizelimit,
+	       ldap_read_multi_t *rm)
+{
+  int rc = LDAP_SUCCESS, err;
+  int window, head = 0, outstanding = 0;
+  int *msgids;
+  size_t *indexes;
+  size_t next = 0, i;
+  struct timeval tv, *tvp;
+  LDAPMessage *res;
+
+  debug ("==> do_read_multi");
+
+  window = session->ls_config->ldc_read_window;
+  if (window < 1)
+    window = 1;
+  if ((size_t) window > rm->lrm_count)
+    window = rm->lrm_count;
+
+  msgids = (int *) malloc (window * sizeof (int));
+  indexes = (size_t *) malloc (window * sizeof (size_t));
+  if (msgids == NULL || indexes == NULL)
+    {
+      if (msgids != NULL)
+	free (msgids);
+      if (indexes != NULL)
+	free (indexes);
+      debug ("<== do_read_multi: out of memory");
+      return LDAP_NO_MEMORY;
+    }
+
+  if (session->ls_config->ldc_timelimit == LDAP_NO_LIMIT)
+    {
+      tvp = NULL;
+    }
+  else
+    {
+      tv.tv_sec = session->ls_config->ldc_timelimit;
+      tv.tv_usec = 0;
+      tvp = &tv;
+    }
+
+  while (1)
+    {
+      /* fill the window */
+      while (outstanding < window && next < rm->lrm_count)
+	{
+	  int msgid, slot;
+
+	  i = next++;
+	  if (rm->lrm_stats[i] != NSS_TRYAGAIN)
+	    continue;
+
+	  rc = do_search (session, rm->lrm_dns[i], LDAP_SCOPE_BASE, filter,
+			  attrs, sizelimit, &msgid);
+	  if (rc != LDAP_SUCCESS)
+	    {
+	      if (do_map_error (rc) == NSS_TRYAGAIN)
+		{
+		  next = i;
+		  goto out;
+		}
+	      rm->lrm_stats[i] = do_map_error (rc);
+	      continue;
+	    }
+
+	  slot = (head + outstanding) % window;
+	  msgids[slot] = msgid;
+	  indexes[slot] = i;
+	  outstanding++;
 	}
 
-      if (e == NULL)
+      if (outstanding == 0)
 	{
-	  /* Could not get a result; bail */
-	  parseStat = NSS_NOTFOUND;
+	  rc = LDAP_SUCCESS;
 	  break;
 	}
 
-      /*
-       * We have an entry; now, try to parse it. 
-       *
-       * If we do not parse the entry because of a schema
-       * violation, the parser should return NSS_NOTFOUND.
-       * We'll keep on trying subsequent entries until we
-       * find one which is parseable, or exhaust available
-       * entries, whichever is first.
-       */
-      parseStat = parser (e, &ctx->ec_state, result, buffer, buflen);
+      /* collect the oldest */
+      res = NULL;
+      rc = ldap_result (session->ls_conn, msgids[head], LDAP_MSG_ALL, tvp,
+			&res);
+      switch (rc)
+	{
+	case -1:
+	  if (GET_ERROR_NUMBER (session->ls_conn, &rc) != LDAP_OPT_SUCCESS)
+	    rc = LDAP_UNAVAILABLE;
+	  goto out;
+	case 0:
+	  rc = LDAP_TIMEOUT;
+	  goto out;
+	default:
+	  break;
+	}
 
-      /* hold onto the state if we're out of memory XXX */
-      ctx->ec_state.ls_retry = (parseStat == NSS_TRYAGAIN && buffer != NULL ? 1 : 0);
+      i = indexes[head];
+      head = (head + 1) % window;
+      outstanding--;
+
+      err = ldap_result2error (session->ls_conn, res, 0);
+      if (err == LDAP_SUCCESS &&
+	  ldap_count_entries (session->ls_conn, res) == 0)
+	err = LDAP_NO_SUCH_OBJECT;
+
+      if (do_map_error (err) == NSS_TRYAGAIN)
+	{
+	  ldap_msgfree (res);
+	  rc = err;
+	  goto out;
+	}
+
+      rm->lrm_stats[i] = do_map_error (err);
+      if (rm->lrm_stats[i] == NSS_SUCCESS)
+	rm->lrm_res[i] = res;
+      else
+	ldap_msgfree (res);
     }
-  while (parseStat == NSS_NOTFOUND);
 
-  do_map_errno (parseStat, errnop);
+out:
+  /* give up on any reads still in flight; they are reissued on retry */
+  while (outstanding > 0)
+    {
+      ldap_abandon (session->ls_conn, msgids[head]);
+      head = (head + 1) % window;
+      outstanding--;
+    }
 
-  debug ("<== do_parse_s");
+  free (msgids);
+  free (indexes);
 
-  return parseStat;
+  debug ("<== do_read_multi: returns %s(%d)", ldap_err2string (rc), rc);
+
+  return rc;
 }
 
 /*
- * Read an entry from the directory, a la X.500. This is used
- * for functions that need to retrieve attributes from a DN,
- * such as the RFC2307bis group expansion function.
+ * Read several entries at once. Unlike calling _nss_ldap_read()
+ * for each, this does not wait for one response before sending
+ * the next request. pRes[i] and pStats[i] receive the entry and
+ * status for dns[i]; entries are only returned for NSS_SUCCESS,
+ * and the caller must free them. The return value reflects the
+ * connection, not the individual reads.
  */
 NSS_STATUS
-_nss_ldap_read (const char *dn, const char **attributes, LDAPMessage ** res)
+_nss_ldap_read_multi (const char **dns, size_t count,
+		      const char **attributes, LDAPMessage ** pRes,
+		      NSS_STATUS * pStats)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
+  ldap_read_multi_t rm;
+  NSS_STATUS stat = NSS_SUCCESS;
+  size_t i;
 
-  return do_with_reconnect (session, dn, LDAP_SCOPE_BASE, "(objectclass=*)",
-			    attributes, 1, /* sizelimit */ res,
-			    (search_func_t) do_search_s);
+  debug ("==> _nss_ldap_read_multi");
+
+  for (i = 0; i < count; i++)
+    {
+      pRes[i] = NULL;
+      pStats[i] = NSS_TRYAGAIN;
+    }
+
+  if (count > 0)
+    {
+      rm.lrm_dns = dns;
+      rm.lrm_count = count;
+      rm.lrm_res = pRes;
+      rm.lrm_stats = pStats;
+
+      stat = do_with_reconnect (session, NULL, LDAP_SCOPE_BASE,
+				"(objectclass=*)", attributes,
+				1, /* sizelimit */ &rm,
+				(search_func_t) do_read_multi);
+    }
+
+  /* anything left unanswered failed with the connection */
+  for (i = 0; i < count; i++)
+    {
+      if (pStats[i] == NSS_TRYAGAIN)
+	pStats[i] = (stat == NSS_SUCCESS) ? NSS_UNAVAIL : stat;
+    }
+
+  debug ("<== _nss_ldap_read_multi: returns %s(%d)",
+	 __nss_ldap_status2string (stat), stat);
+
+  return stat;
 }
 
 /*
@@ -3518,7 +5511,7 @@ _nss_ldap_read (const char *dn, const char **attributes, LDAPMessage ** res)
 char **
 _nss_ldap_get_values (LDAPMessage * e, const char *attr)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3536,7 +5529,7 @@ _nss_ldap_get_values (LDAPMessage * e, const char *attr)
 char *
 _nss_ldap_get_dn (LDAPMessage * e)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3554,7 +5547,7 @@ _nss_ldap_get_dn (LDAPMessage * e)
 LDAPMessage *
 _nss_ldap_first_entry (LDAPMessage * res)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3572,7 +5565,7 @@ _nss_ldap_first_entry (LDAPMessage * res)
 LDAPMessage *
 _nss_ldap_next_entry (LDAPMessage * res)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3586,7 +5579,7 @@ _nss_ldap_next_entry (LDAPMessage * res)
 char *
 _nss_ldap_first_attribute (LDAPMessage * entry, BerElement ** berptr)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3600,7 +5593,7 @@ _nss_ldap_first_attribute (LDAPMessage * entry, BerElement ** berptr)
 char *
 _nss_ldap_next_attribute (LDAPMessage * entry, BerElement * ber)
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_state != LS_CONNECTED_TO_DSA)
     {
@@ -3654,7 +5647,6 @@ do_filter_with_reconnect(ldap_session_t *session,
 			 const char **attrs, int sizelimit,
 			 void *res, search_func_t searcher)
 {
-  char *dynamicFilterBuf = NULL;
   char filterBuf[LDAP_FILT_MAXSIZ];
   const char *filter;
   NSS_STATUS stat;
@@ -3663,16 +5655,11 @@ do_filter_with_reconnect(ldap_session_t *session,
 	 filterprot, base, scope, sizelimit);
 
   stat = do_filter (args, filterprot, sd, filterBuf, sizeof (filterBuf),
-		    &dynamicFilterBuf, &filter);
+		    &filter);
   if (stat == NSS_SUCCESS)
     {
 
       stat = do_with_reconnect (session, base, scope, filter, attrs, sizelimit, res, searcher);
-
-      if (dynamicFilterBuf != NULL)
-	{
-	  free (dynamicFilterBuf);
-	}
     }
 
   debug ("<== do_filter_with_reconnect stat=%d", stat);
@@ -3695,7 +5682,7 @@ _nss_ldap_search_s (const ldap_args_t * args,
   int scope;
   NSS_STATUS stat;
   ldap_service_search_descriptor_t *sd = NULL;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_search_s");
 
@@ -3763,6 +5750,219 @@ _nss_ldap_search_s (const ldap_args_t * args,
   return stat;
 }
 
+typedef struct ldap_search_stream
+{
+  search_callback_t lss_callback;
+  void *lss_arg;
+  size_t lss_count;		/* entries handed to the callback */
+  NSS_STATUS lss_stat;		/* what the callback last returned */
+} ldap_search_stream_t;
+
+/*
+ * Streaming search function: fetches entries one at a time with
+ * LDAP_MSG_ONE and frees each once the callback has seen it.
+ * Don't call this directly; use _nss_ldap_search_stream().
+ */
+static int
+do_search_stream (ldap_session_t *session, const char *base, int scope,
+		  const char *filter, const char **attrs, int sizelimit,
+		  ldap_search_stream_t *ss)
+{
+  LDAPMessage *res;
+  struct timeval tv, *tvp;
+  int rc, msgid;
+
+  debug ("==> do_search_stream");
+
+  if (ss->lss_count != 0)
+    {
+      /* retried after losing the connection part way through */
+      (void) (*ss->lss_callback) (NULL, ss->lss_arg);
+      ss->lss_count = 0;
+    }
+
+#ifdef HAVE_LDAP_SEARCH_EXT
+  rc = ldap_search_ext (session->ls_conn, base, scope, filter,
+			(char **) attrs, 0, NULL, NULL, LDAP_NO_LIMIT,
+			sizelimit, &msgid);
+  if (rc != LDAP_SUCCESS)
+    {
+      debug ("<== do_search_stream: ldap_search_ext returns %s(%d)",
+	     ldap_err2string (rc), rc);
+      return rc;
+    }
+#else
+  SET_SIZELIMIT (session->ls_conn, &sizelimit);
+
+  msgid = ldap_search (session->ls_conn, base, scope, filter,
+		       (char **) attrs, 0);
+  if (msgid < 0)
+    {
+      if (GET_ERROR_NUMBER (session->ls_conn, &rc) != LDAP_OPT_SUCCESS)
+	rc = LDAP_UNAVAILABLE;
+      debug ("<== do_search_stream: ldap_search returns %s(%d)",
+	     ldap_err2string (rc), rc);
+      return rc;
+    }
+#endif /* HAVE_LDAP_SEARCH_EXT */
+
+  if (session->ls_config->ldc_timelimit == LDAP_NO_LIMIT)
+    {
+      tvp = NULL;
+    }
+  else
+    {
+      tv.tv_sec = session->ls_config->ldc_timelimit;
+      tv.tv_usec = 0;
+      tvp = &tv;
+    }
+
+  while (1)
+    {
+      res = NULL;
+      rc = ldap_result (session->ls_conn, msgid, LDAP_MSG_ONE, tvp, &res);
+
+      if (rc == -1)
+	{
+	  if (GET_ERROR_NUMBER (session->ls_conn, &rc) != LDAP_OPT_SUCCESS)
+	    rc = LDAP_UNAVAILABLE;
+	  break;
+	}
+      else if (rc == 0)
+	{
+	  ldap_abandon (session->ls_conn, msgid);
+	  rc = LDAP_TIMEOUT;
+	  break;
+	}
+      else if (rc == LDAP_RES_SEARCH_ENTRY)
+	{
+	  ss->lss_count++;
+	  ss->lss_stat = (*ss->lss_callback) (ldap_first_entry (session->ls_conn, res),
+					      ss->lss_arg);
+	  ldap_msgfree (res);
+
+	  if (ss->lss_stat != NSS_SUCCESS)
+	    {
+	      /* the caller has seen enough */
+	      ldap_abandon (session->ls_conn, msgid);
+	      rc = LDAP_SUCCESS;
+	      break;
+	    }
+	}
+      else if (rc == LDAP_RES_SEARCH_RESULT)
+	{
+	  rc = ldap_result2error (session->ls_conn, res, 1);
+	  break;
+	}
+      else
+	{
+	  /* search references are not chased */
+	  ldap_msgfree (res);
+	}
+    }
+
+  debug ("<== do_search_stream: returns %s(%d), %d entries",
+	 ldap_err2string (rc), rc, (int) ss->lss_count);
+
+  return rc;
+}
+
+/*
+ * Like _nss_ldap_search_s(), but rather than collecting the
+ * whole result, each entry is passed to callback as soon as it
+ * arrives and freed on return, so only one entry is held at a
+ * time. The callback returns NSS_SUCCESS to see more entries;
+ * any other status ends the search and is returned. It must not
+ * issue LDAP operations of its own. If the connection is lost
+ * part way through and the search restarted, the callback is
+ * first called with a NULL entry so it can discard what it has
+ * gathered. Returns NSS_NOTFOUND if nothing matched.
+ */
+NSS_STATUS
+_nss_ldap_search_stream (const ldap_args_t * args,
+			 const char *filterprot, ldap_map_selector_t sel,
+			 const char **user_attrs, int sizelimit,
+			 search_callback_t callback, void *arg)
+{
+  char sdBase[LDAP_FILT_MAXSIZ];
+  const char *base = NULL;
+  const char **attrs;
+  int scope;
+  NSS_STATUS stat;
+  ldap_service_search_descriptor_t *sd = NULL;
+  ldap_session_t *session = do_get_session ();
+  ldap_search_stream_t ss;
+
+  debug ("==> _nss_ldap_search_stream");
+
+  stat = do_check_init (session);
+
+  if (stat != NSS_SUCCESS)
+    {
+      stat = do_init (session);
+      if (stat != NSS_SUCCESS)
+	{
+	  debug ("<== _nss_ldap_search_stream: session initialization failed");
+	  return stat;
+	}
+    }
+
+  ss.lss_callback = callback;
+  ss.lss_arg = arg;
+
+  /* Set some reasonable defaults. */
+  base = session->ls_config->ldc_base;
+  scope = session->ls_config->ldc_scope;
+  attrs = NULL;
+
+  if (args != NULL && args->la_base != NULL)
+    {
+      sel = LM_NONE;
+      base = args->la_base;
+    }
+
+  if (sel < LM_NONE)
+    {
+      sd = session->ls_config->ldc_sds[sel];
+    next:
+      do_search_params (session, sd, sdBase, sizeof(sdBase), &base, &scope);
+      attrs = session->ls_config->ldc_attrtab[sel];
+    }
+
+  ss.lss_count = 0;
+  ss.lss_stat = NSS_SUCCESS;
+
+  stat = do_filter_with_reconnect (session, args, filterprot,
+				   sd,
+				   base, scope,
+				   (user_attrs != NULL) ? user_attrs : attrs,
+				   sizelimit,
+				   (void *) &ss,
+				   (search_func_t) do_search_stream);
+
+  if (stat != NSS_SUCCESS)
+    return stat;
+
+  if (ss.lss_stat != NSS_SUCCESS)
+    stat = ss.lss_stat;
+  else if (ss.lss_count == 0)	/* No results */
+    stat = NSS_NOTFOUND;
+
+  /* If no entry was returned, try the next search descriptor. */
+  if (sd != NULL && sd->lsd_next != NULL)
+    {
+      if (stat == NSS_NOTFOUND && ss.lss_count == 0)
+	{
+	  sd = sd->lsd_next;
+	  goto next;
+	}
+    }
+
+  debug ("<== _nss_ldap_search_stream");
+
+  return stat;
+}
+
 /*
  * The generic lookup cover function (asynchronous).
  * Assumes caller holds lock.
@@ -3778,7 +5978,7 @@ _nss_ldap_search (const ldap_args_t * args,
   int scope;
   NSS_STATUS stat;
   ldap_service_search_descriptor_t *sd = NULL;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
   char sdBase[LDAP_FILT_MAXSIZ];
 
   debug ("==> _nss_ldap_search");
@@ -3847,16 +6047,16 @@ _nss_ldap_search (const ldap_args_t * args,
 static NSS_STATUS
 do_next_page (const ldap_args_t * args,
 	      const char *filterprot, ldap_map_selector_t sel, int
-	      sizelimit, int *msgid, struct berval *pCookie)
+	      sizelimit, int pagesize, int *msgid, struct berval *pCookie)
 {
   char sdBase[LDAP_FILT_MAXSIZ];
   const char *base = NULL;
-  char filterBuf[LDAP_FILT_MAXSIZ], *dynamicFilterBuf = NULL;
+  char filterBuf[LDAP_FILT_MAXSIZ];
   const char **attrs, *filter;
   int scope;
   NSS_STATUS stat;
   ldap_service_search_descriptor_t *sd = NULL;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
   LDAPControl *serverctrls[2] = {
     NULL, NULL
   };
@@ -3884,7 +6084,7 @@ do_next_page (const ldap_args_t * args,
 
   stat =
     do_filter (args, filterprot, sd, filterBuf, sizeof (filterBuf),
-	       &dynamicFilterBuf, &filter);
+	       &filter);
   if (stat != NSS_SUCCESS)
     {
       return stat;
@@ -3903,15 +6103,12 @@ do_next_page (const ldap_args_t * args,
   }
 
   stat =
-    ldap_create_page_control (session->ls_conn,
-			      session->ls_config->ldc_pagesize,
+    ldap_create_page_control (session->ls_conn, pagesize,
 			      pCookie, 0, &serverctrls[0]);
   debug (":== do_next_page: ldap_create_page_control returns %s(%d)",
 	 ldap_err2string(stat), stat);
   if (stat != LDAP_SUCCESS)
     {
-      if (dynamicFilterBuf != NULL)
-	free (dynamicFilterBuf);
       return NSS_UNAVAIL;
     }
 
@@ -3926,15 +6123,96 @@ do_next_page (const ldap_args_t * args,
 	 ldap_err2string(stat), stat);
 
   ldap_control_free (serverctrls[0]);
-  if (dynamicFilterBuf != NULL)
-    free (dynamicFilterBuf);
 
   stat = (*msgid < 0) ? NSS_UNAVAIL : NSS_SUCCESS;
   debug ("<== do_next_page: returns %s(%d)",
 	 __nss_ldap_status2string(stat), stat);
 
-  return stat;
+  return stat;
+}
+
+#ifdef LDAP_MORE_RESULTS_TO_RETURN
+/*
+ * Once nss_paged_readahead percent of a page has been returned,
+ * check without blocking whether the rest of the page has arrived.
+ * If so, take it off the connection and request the next page at
+ * once, so that the server prepares it while the caller works
+ * through the rest of this one.
+ */
+static void
+do_read_ahead (ldap_session_t *session, ent_context_t * ctx,
+	       const char *filterprot, ldap_map_selector_t sel)
+{
+  ldap_config_t *cfg = session->ls_config;
+  LDAPMessage *res = NULL, *msg;
+  LDAPControl **resultControls = NULL;
+  struct timeval tv;
+  int rc, msgid, pagesize;
+
+  pagesize = (ctx->ec_pagesize != 0) ? ctx->ec_pagesize : cfg->ldc_pagesize;
+
+  if (ctx->ec_ahead != NULL || ctx->ec_msgid < 0 ||
+      cfg->ldc_paged_readahead == 0 || pagesize <= 0 ||
+      (cfg->ldc_flags & NSS_LDAP_FLAGS_PAGED_RESULTS) == 0 ||
+      ctx->ec_count * 100 < pagesize * cfg->ldc_paged_readahead)
+    return;
+
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+
+  rc = ldap_result (session->ls_conn, ctx->ec_msgid, LDAP_MSG_ALL, &tv, &res);
+  if (rc <= 0 || res == NULL)
+    {
+      /* not complete yet; errors are left to do_result() */
+      return;
+    }
+
+  debug ("==> do_read_ahead");
+
+  for (msg = ldap_first_message (session->ls_conn, res);
+       msg != NULL && ldap_msgtype (msg) != LDAP_RES_SEARCH_RESULT;
+       msg = ldap_next_message (session->ls_conn, msg))
+    ;
+
+  if (ctx->ec_cookie != NULL)
+    {
+      ber_bvfree (ctx->ec_cookie);
+      ctx->ec_cookie = NULL;
+    }
+
+  if (msg != NULL &&
+      ldap_parse_result (session->ls_conn, msg, &rc, NULL, NULL, NULL,
+			 &resultControls, 0) == LDAP_SUCCESS &&
+      resultControls != NULL)
+    {
+      ldap_parse_page_control (session->ls_conn, resultControls, NULL,
+			       &ctx->ec_cookie);
+      ldap_controls_free (resultControls);
+    }
+
+  ctx->ec_ahead = res;
+  ctx->ec_ahead_next = ldap_first_entry (session->ls_conn, res);
+  ctx->ec_next_msgid = -1;
+
+  /*
+   * If the next page cannot be requested now, the cookie is left
+   * for _nss_ldap_getent_ex() to try again at the end of the page.
+   */
+  pagesize = do_adapt_pagesize (session, ctx);
+
+  if (ctx->ec_cookie != NULL && ctx->ec_cookie->bv_len != 0 &&
+      do_next_page (NULL, filterprot, sel, LDAP_NO_LIMIT, pagesize, &msgid,
+		    ctx->ec_cookie) == NSS_SUCCESS)
+    {
+      do_page_clock_start (ctx);
+      ctx->ec_next_msgid = msgid;
+      ber_bvfree (ctx->ec_cookie);
+      ctx->ec_cookie = NULL;
+    }
+
+  debug ("<== do_read_ahead: next page %d", ctx->ec_next_msgid);
 }
+#endif /* LDAP_MORE_RESULTS_TO_RETURN */
 #endif /* HAVE_LDAP_SEARCH_EXT */
 
 /*
@@ -3984,7 +6262,7 @@ _nss_ldap_getent_ex (ldap_args_t * args,
 		     const char **user_attrs, parser_t parser)
 {
   NSS_STATUS stat = NSS_SUCCESS;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_getent_ex");
 
@@ -4023,11 +6301,19 @@ next:
 	}
 
       (*ctx)->ec_msgid = msgid;
+      /* the first page is always of the configured size */
+      (*ctx)->ec_pagesize = 0;
+      do_page_clock_start (*ctx);
     }
 
   stat = do_parse (session, *ctx, result, buffer, buflen, errnop, parser);
 
 #ifdef HAVE_LDAP_SEARCH_EXT
+#ifdef LDAP_MORE_RESULTS_TO_RETURN
+  if (stat == NSS_SUCCESS)
+    do_read_ahead (session, *ctx, filterprot, sel);
+#endif /* LDAP_MORE_RESULTS_TO_RETURN */
+
   if (stat == NSS_NOTFOUND)
     {
       /* Is there another page of results? */
@@ -4036,14 +6322,17 @@ next:
 	  int msgid;
 
 	  stat =
-	    do_next_page (NULL, filterprot, sel, LDAP_NO_LIMIT, &msgid,
-			  (*ctx)->ec_cookie);
+	    do_next_page (NULL, filterprot, sel, LDAP_NO_LIMIT,
+			  (*ctx)->ec_pagesize != 0 ? (*ctx)->ec_pagesize :
+			  session->ls_config->ldc_pagesize,
+			  &msgid, (*ctx)->ec_cookie);
 	  if (stat != NSS_SUCCESS)
 	    {
 	      debug ("<== _nss_ldap_getent_ex");
 	      return stat;
 	    }
 	  (*ctx)->ec_msgid = msgid;
+	  do_page_clock_start (*ctx);
 	  stat = do_parse (session, *ctx, result, buffer, buflen, errnop, parser);
 	}
     }
@@ -4058,71 +6347,663 @@ next:
 	}
       else
 	{
-	  /* Mark notional end of file */
-	  (*ctx)->ec_eof = 1;
+	  /* Mark notional end of file */
+	  (*ctx)->ec_eof = 1;
+	}
+    }
+
+  debug ("<== _nss_ldap_getent_ex");
+
+  return stat;
+}
+
+/*
+ * General match function.
+ * Locks mutex. 
+ */
+static void
+do_stash_clear (ldap_result_stash_t * stash)
+{
+  if (stash->lrs_res != NULL)
+    ldap_msgfree (stash->lrs_res);
+  if (stash->lrs_string != NULL)
+    free (stash->lrs_string);
+
+  memset (stash, 0, sizeof (*stash));
+}
+
+static ldap_result_stash_t *
+do_get_stash (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts = do_get_thread_state ();
+
+  if (lts != NULL)
+    return &lts->lts_stash;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  return &__stash;
+}
+
+static ldap_arena_t *
+do_get_arena (void)
+{
+#ifdef NSS_LDAP_CONCURRENT_SESSIONS
+  ldap_thread_state_t *lts = do_get_thread_state ();
+
+  if (lts != NULL)
+    return &lts->lts_arena;
+#endif /* NSS_LDAP_CONCURRENT_SESSIONS */
+
+  return &__arena;
+}
+
+void *
+_nss_ldap_arena_alloc (size_t size)
+{
+  return do_arena_alloc (do_get_arena (), size);
+}
+
+void *
+_nss_ldap_arena_realloc (void *ptr, size_t oldsize, size_t size)
+{
+  return do_arena_realloc (do_get_arena (), ptr, oldsize, size);
+}
+
+char *
+_nss_ldap_arena_strdup (const char *s)
+{
+  size_t len = strlen (s) + 1;
+  char *p;
+
+  p = (char *) _nss_ldap_arena_alloc (len);
+  if (p != NULL)
+    memcpy (p, s, len);
+
+  return p;
+}
+
+/*
+ * Only lookups by name or number (and, for services, protocol)
+ * against the default search base are stashed.
+ */
+static int
+do_stash_key_ok (const ldap_args_t * args)
+{
+  if (args->la_base != NULL)
+    return 0;
+
+  switch (args->la_type)
+    {
+    case LA_TYPE_STRING:
+      return (args->la_arg1.la_string != NULL);
+    case LA_TYPE_STRING_AND_STRING:
+      return (args->la_arg1.la_string != NULL &&
+	      args->la_arg2.la_string != NULL);
+    case LA_TYPE_NUMBER:
+      return 1;
+    case LA_TYPE_NUMBER_AND_STRING:
+      return (args->la_arg2.la_string != NULL);
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+/*
+ * Keep res for a retry of the same lookup; takes ownership of
+ * res.
+ */
+static void
+do_stash_put (ldap_session_t * session, const ldap_args_t * args,
+	      const char *filterprot, ldap_map_selector_t sel,
+	      LDAPMessage * res)
+{
+  ldap_result_stash_t *stash = do_get_stash ();
+  const char *s1 = NULL, *s2 = NULL;
+  size_t len1 = 0, len2 = 0;
+
+  do_stash_clear (stash);
+
+  if (!do_stash_key_ok (args))
+    {
+      ldap_msgfree (res);
+      return;
+    }
+
+  if (args->la_type == LA_TYPE_STRING ||
+      args->la_type == LA_TYPE_STRING_AND_STRING)
+    s1 = args->la_arg1.la_string;
+  if (args->la_type == LA_TYPE_STRING_AND_STRING ||
+      args->la_type == LA_TYPE_NUMBER_AND_STRING)
+    s2 = args->la_arg2.la_string;
+
+  if (s1 != NULL)
+    len1 = strlen (s1) + 1;
+  if (s2 != NULL)
+    len2 = strlen (s2) + 1;
+
+  if (len1 + len2 != 0)
+    {
+      stash->lrs_string = (char *) malloc (len1 + len2);
+      if (stash->lrs_string == NULL)
+	{
+	  ldap_msgfree (res);
+	  return;
+	}
+      if (s1 != NULL)
+	memcpy (stash->lrs_string, s1, len1);
+      if (s2 != NULL)
+	{
+	  stash->lrs_string2 = stash->lrs_string + len1;
+	  memcpy (stash->lrs_string2, s2, len2);
+	}
+    }
+
+  stash->lrs_res = res;
+  stash->lrs_config_generation = __config_generation;
+  stash->lrs_session = session;
+  stash->lrs_session_generation = session->ls_generation;
+  stash->lrs_filter = filterprot;
+  stash->lrs_sel = sel;
+  stash->lrs_type = args->la_type;
+  if (args->la_type == LA_TYPE_NUMBER ||
+      args->la_type == LA_TYPE_NUMBER_AND_STRING)
+    stash->lrs_number = args->la_arg1.la_number;
+  stash->lrs_expires = time (NULL) + LDAP_NSS_RETRY_STASH_TTL;
+}
+
+/*
+ * Take back a result stashed by the same lookup, if it is still
+ * fresh and was read on the same connection of session under the
+ * current configuration; the caller owns it.
+ */
+static LDAPMessage *
+do_stash_get (ldap_session_t * session, const ldap_args_t * args,
+	      const char *filterprot, ldap_map_selector_t sel)
+{
+  ldap_result_stash_t *stash = do_get_stash ();
+  LDAPMessage *res;
+  int match;
+
+  if (stash->lrs_res == NULL)
+    return NULL;
+
+  match = (do_stash_key_ok (args) &&
+	   stash->lrs_config_generation == __config_generation &&
+	   stash->lrs_session == session &&
+	   stash->lrs_session_generation == session->ls_generation &&
+	   stash->lrs_filter == filterprot &&
+	   stash->lrs_sel == sel &&
+	   stash->lrs_type == args->la_type &&
+	   stash->lrs_expires >= time (NULL));
+
+  if (match)
+    {
+      switch (args->la_type)
+	{
+	case LA_TYPE_STRING:
+	  match = (strcmp (stash->lrs_string, args->la_arg1.la_string) == 0);
+	  break;
+	case LA_TYPE_STRING_AND_STRING:
+	  match = (strcmp (stash->lrs_string, args->la_arg1.la_string) == 0 &&
+		   strcmp (stash->lrs_string2, args->la_arg2.la_string) == 0);
+	  break;
+	case LA_TYPE_NUMBER:
+	  match = (stash->lrs_number == args->la_arg1.la_number);
+	  break;
+	case LA_TYPE_NUMBER_AND_STRING:
+	  match = (stash->lrs_number == args->la_arg1.la_number &&
+		   strcmp (stash->lrs_string2, args->la_arg2.la_string) == 0);
+	  break;
+	default:
+	  match = 0;
+	  break;
+	}
+    }
+
+  if (!match)
+    {
+      /* a different lookup; the retry is not coming */
+      do_stash_clear (stash);
+      return NULL;
+    }
+
+  res = stash->lrs_res;
+  stash->lrs_res = NULL;
+  do_stash_clear (stash);
+
+  return res;
+}
+
+size_t
+_nss_ldap_get_buflen_hint (void)
+{
+  return do_get_stash ()->lrs_buflen;
+}
+
+/*
+ * Maps whose parsers have a sizer, for the buffer size hint.
+ */
+static struct
+{
+  ldap_map_selector_t sel;
+  sizer_t sizer;
+}
+__sizers[] =
+{
+  { LM_PASSWD, _nss_ldap_size_pw },
+  { LM_GROUP, _nss_ldap_size_gr },
+  { LM_NONE, NULL }
+};
+
+/*
+ * Work out how much buffer space the parser needs for the entry in
+ * res that did not fit in buflen bytes: the first one the sizer for
+ * the map does not skip, as the parser would. Returns 0 if the map
+ * has no sizer or the size is not known.
+ */
+static size_t
+do_measure_result (ldap_session_t * session, ent_context_t * ctx,
+		   ldap_map_selector_t sel, size_t buflen)
+{
+  LDAPMessage *e;
+  NSS_STATUS stat = NSS_NOTFOUND;
+  size_t size = 0;
+  int i;
+
+  debug ("==> do_measure_result");
+
+  for (i = 0; __sizers[i].sel != LM_NONE; i++)
+    {
+      if (__sizers[i].sel == sel)
+	break;
+    }
+
+  if (__sizers[i].sizer != NULL)
+    {
+      for (e = ldap_first_entry (session->ls_conn, ctx->ec_res);
+	   e != NULL && stat == NSS_NOTFOUND;
+	   e = ldap_next_entry (session->ls_conn, e))
+	{
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+	  do_index_begin (session, e);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+	  stat = (*__sizers[i].sizer) (e, &ctx->ec_state, &size);
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+	  do_index_end (session);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+	}
+    }
+
+  if (stat != NSS_SUCCESS || size <= buflen ||
+      size > LDAP_NSS_BUFLEN_HINT_MAX)
+    {
+      debug ("<== do_measure_result: unknown");
+      return 0;
+    }
+
+  debug ("<== do_measure_result: %lu bytes", (unsigned long) size);
+
+  return size;
+}
+
+NSS_STATUS
+_nss_ldap_getbyname (ldap_args_t * args,
+		     void *result, char *buffer, size_t buflen, int
+		     *errnop, const char *filterprot,
+		     ldap_map_selector_t sel, parser_t parser)
+{
+  NSS_STATUS stat = NSS_NOTFOUND;
+  ent_context_t ctx;
+  ldap_session_t *session;
+
+  _nss_ldap_enter_lookup ();
+
+  debug ("==> _nss_ldap_getbyname");
+
+  /*
+   * A fresh process has no configuration yet; load it (without
+   * connecting) so that the shared cache can answer the lookup.
+   */
+  if (do_get_config () == NULL)
+    (void) _nss_ldap_init ();
+
+  if (_nss_ldap_cache_get (do_get_config (), args, filterprot, sel,
+			   result, buffer, buflen, errnop, &stat))
+    {
+      _nss_ldap_leave_lookup ();
+      debug ("<== _nss_ldap_getbyname (cached)");
+      return stat;
+    }
+
+  memset (&ctx, 0, sizeof(ctx));
+  ctx.ec_msgid = -1;
+
+  /*
+   * If the last lookup on this thread was this one and ran out of
+   * buffer space, parse its result again rather than searching
+   * again. This needs a connection to parse with.
+   */
+  session = do_get_session ();
+  if (session->ls_state == LS_CONNECTED_TO_DSA)
+    ctx.ec_res = do_stash_get (session, args, filterprot, sel);
+
+  if (ctx.ec_res != NULL)
+    {
+      debug (":== _nss_ldap_getbyname: reusing result for retry");
+      stat = NSS_SUCCESS;
+    }
+  else
+    stat = _nss_ldap_search_s (args, filterprot, sel, NULL, 1, &ctx.ec_res);
+  if (stat != NSS_SUCCESS)
+    {
+      if (stat == NSS_NOTFOUND)
+	_nss_ldap_cache_put (do_get_config (), args, filterprot, sel,
+			     stat, NULL);
+      _nss_ldap_leave_lookup ();
+      debug ("<== _nss_ldap_getbyname");
+      return stat;
+    }
+
+  /*
+   * we pass this along for the benefit of the services parser,
+   * which uses it to figure out which protocol we really wanted.
+   * we only pass the second argument along, as that's what we need
+   * in services.
+   */
+  LS_INIT (ctx.ec_state);
+  ctx.ec_state.ls_type = LS_TYPE_KEY;
+  ctx.ec_state.ls_info.ls_key = args->la_arg2.la_string;
+
+  /* the search has checked out the session the result lives on */
+  session = do_get_session ();
+
+  stat = do_parse_s (session, &ctx, result, buffer, buflen, errnop, parser);
+  if (stat == NSS_SUCCESS || stat == NSS_NOTFOUND)
+    _nss_ldap_cache_put (do_get_config (), args, filterprot, sel,
+			 stat, result);
+  else if (stat == NSS_TRYAGAIN && buffer != NULL)
+    {
+      /* the caller will retry with a larger buffer; say how large */
+      size_t needed = do_measure_result (session, &ctx, sel, buflen);
+
+      do_stash_put (session, args, filterprot, sel, ctx.ec_res);
+      ctx.ec_res = NULL;
+      do_get_stash ()->lrs_buflen = needed;
+
+      do_map_errno (stat, errnop);
+    }
+
+  do_context_release (session, &ctx, 0);
+
+  /* moved unlock here to avoid race condition bug #49 */
+  _nss_ldap_leave_lookup ();
+
+  debug ("<== _nss_ldap_getbyname");
+
+  return stat;
+}
+
+/*
+ * These functions are called from within the parser, where it is assumed
+ * to be safe to use the connection and the respective message.
+ */
+
+/*
+ * Values of an attribute, as counted strings. Where the library
+ * provides ldap_get_attribute_ber(), they point into the entry's
+ * own BER encoding; otherwise ldap_get_values_len() copies them,
+ * but still spares a strlen() of each.
+ */
+typedef struct ldap_values
+{
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+  BerElement *lv_ber;
+  struct berval *lv_vals;
+#else
+  struct berval **lv_vals;
+#endif				/* HAVE_LDAP_GET_ATTRIBUTE_BER */
+  int lv_count;
+  /* values belong to the session's entry index */
+  int lv_borrowed;
+} ldap_values_t;
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+#define LDAP_VALUE(lv, i)	(&(lv)->lv_vals[(i)])
+#else
+#define LDAP_VALUE(lv, i)	((lv)->lv_vals[(i)])
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+
+static void
+do_values_free (ldap_values_t * lv)
+{
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+  if (lv->lv_borrowed)
+    lv->lv_vals = NULL;
+  if (lv->lv_vals != NULL)
+    ber_memfree (lv->lv_vals);
+  if (lv->lv_ber != NULL)
+    ber_free (lv->lv_ber, 0);
+  lv->lv_ber = NULL;
+#else
+  if (lv->lv_vals != NULL)
+    ldap_value_free_len (lv->lv_vals);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+  lv->lv_vals = NULL;
+  lv->lv_count = 0;
+}
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+static unsigned int
+do_index_hash (const char *type, size_t len)
+{
+  unsigned int h = 0;
+
+  while (len-- > 0)
+    h = h * 31 + (unsigned char) tolower ((unsigned char) *type++);
+
+  return h % LDAP_NSS_INDEX_BUCKETS;
+}
+
+/*
+ * Release the index of the entry being parsed. Its values
+ * point into the entry, so this must be called before the
+ * entry is freed.
+ */
+static void
+do_index_end (ldap_session_t * session)
+{
+  struct ldap_entry_index *lei = &session->ls_index;
+  int i;
+
+  for (i = 0; i < lei->lei_count; i++)
+    {
+      if (lei->lei_attrs[i].lea_vals != NULL)
+	ber_memfree (lei->lei_attrs[i].lea_vals);
+    }
+
+  if (lei->lei_ber != NULL)
+    ber_free (lei->lei_ber, 0);
+
+  lei->lei_ber = NULL;
+  lei->lei_count = 0;
+  lei->lei_built = 0;
+  lei->lei_entry = NULL;
+}
+
+/*
+ * Note that the parser is about to be handed e; its attributes
+ * are decoded on the first lookup.
+ */
+static void
+do_index_begin (ldap_session_t * session, LDAPMessage * e)
+{
+  do_index_end (session);
+  session->ls_index.lei_entry = e;
+}
+
+/*
+ * Walk the entry being parsed once, recording each attribute's
+ * type and values.
+ */
+static void
+do_index_build (ldap_session_t * session)
+{
+  struct ldap_entry_index *lei = &session->ls_index;
+  struct ldap_entry_attr *lea;
+  struct berval type, dn, *vals;
+  unsigned int h;
+  int i;
+
+  lei->lei_built = -1;
+
+  if (ldap_get_dn_ber (session->ls_conn, lei->lei_entry, &lei->lei_ber,
+		       &dn) != LDAP_SUCCESS)
+    return;
+
+  for (i = 0; i < LDAP_NSS_INDEX_BUCKETS; i++)
+    lei->lei_buckets[i] = -1;
+
+  for (;;)
+    {
+      vals = NULL;
+      if (ldap_get_attribute_ber (session->ls_conn, lei->lei_entry,
+				  lei->lei_ber, &type, &vals) != LDAP_SUCCESS
+	  || type.bv_val == NULL)
+	break;
+
+      if (lei->lei_count == lei->lei_size)
+	{
+	  int size = (lei->lei_size == 0) ? 16 : lei->lei_size * 2;
+
+	  lea = (struct ldap_entry_attr *) realloc (lei->lei_attrs,
+						    size * sizeof (*lea));
+	  if (lea == NULL)
+	    {
+	      if (vals != NULL)
+		ber_memfree (vals);
+	      do_index_end (session);
+	      lei->lei_built = -1;
+	      return;
+	    }
+	  lei->lei_attrs = lea;
+	  lei->lei_size = size;
 	}
-    }
 
-  debug ("<== _nss_ldap_getent_ex");
+      lea = &lei->lei_attrs[lei->lei_count];
+      lea->lea_type = type;
+      lea->lea_vals = vals;
+      lea->lea_count = 0;
+      if (vals != NULL)
+	while (vals[lea->lea_count].bv_val != NULL)
+	  lea->lea_count++;
 
-  return stat;
+      h = do_index_hash (type.bv_val, type.bv_len);
+      lea->lea_next = lei->lei_buckets[h];
+      lei->lei_buckets[h] = lei->lei_count++;
+    }
+
+  lei->lei_built = 1;
 }
 
 /*
- * General match function.
- * Locks mutex. 
+ * Look attr up in the index of e, if e is the entry being
+ * parsed. Returns 0 if there is no usable index.
  */
-NSS_STATUS
-_nss_ldap_getbyname (ldap_args_t * args,
-		     void *result, char *buffer, size_t buflen, int
-		     *errnop, const char *filterprot,
-		     ldap_map_selector_t sel, parser_t parser)
+static int
+do_index_get (ldap_session_t * session, LDAPMessage * e, const char *attr,
+	      ldap_values_t * lv)
 {
-  NSS_STATUS stat = NSS_NOTFOUND;
-  ent_context_t ctx;
-  ldap_session_t *session = &__session;
+  struct ldap_entry_index *lei = &session->ls_index;
+  struct ldap_entry_attr *lea;
+  size_t attrlen;
+  int i;
 
-  _nss_ldap_enter ();
+  if (lei->lei_entry != e || e == NULL)
+    return 0;
 
-  debug ("==> _nss_ldap_getbyname");
+  if (lei->lei_built == 0)
+    do_index_build (session);
 
-  memset (&ctx, 0, sizeof(ctx));
-  ctx.ec_msgid = -1;
+  if (lei->lei_built < 0)
+    return 0;
 
-  stat = _nss_ldap_search_s (args, filterprot, sel, NULL, 1, &ctx.ec_res);
-  if (stat != NSS_SUCCESS)
+  attrlen = strlen (attr);
+
+  for (i = lei->lei_buckets[do_index_hash (attr, attrlen)]; i >= 0;
+       i = lea->lea_next)
     {
-      _nss_ldap_leave ();
-      debug ("<== _nss_ldap_getbyname");
-      return stat;
+      lea = &lei->lei_attrs[i];
+      if (lea->lea_type.bv_len == attrlen &&
+	  strncasecmp (lea->lea_type.bv_val, attr, attrlen) == 0)
+	{
+	  lv->lv_vals = lea->lea_vals;
+	  lv->lv_count = lea->lea_count;
+	  break;
+	}
     }
 
-  /*
-   * we pass this along for the benefit of the services parser,
-   * which uses it to figure out which protocol we really wanted.
-   * we only pass the second argument along, as that's what we need
-   * in services.
-   */
-  LS_INIT (ctx.ec_state);
-  ctx.ec_state.ls_type = LS_TYPE_KEY;
-  ctx.ec_state.ls_info.ls_key = args->la_arg2.la_string;
+  return 1;
+}
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
 
-  stat = do_parse_s (session, &ctx, result, buffer, buflen, errnop, parser);
+/*
+ * Find the values of attr in e; returns the number of values,
+ * 0 if the attribute is absent.
+ */
+static int
+do_values_get (ldap_session_t * session, LDAPMessage * e, const char *attr,
+	       ldap_values_t * lv)
+{
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+  struct berval type, dn;
+  size_t attrlen = strlen (attr);
 
-  do_context_release (session, &ctx, 0);
+  lv->lv_ber = NULL;
+  lv->lv_vals = NULL;
+  lv->lv_count = 0;
+  lv->lv_borrowed = 1;
 
-  /* moved unlock here to avoid race condition bug #49 */
-  _nss_ldap_leave ();
+  if (do_index_get (session, e, attr, lv))
+    return lv->lv_count;
 
-  debug ("<== _nss_ldap_getbyname");
+  lv->lv_borrowed = 0;
 
-  return stat;
-}
+  if (ldap_get_dn_ber (session->ls_conn, e, &lv->lv_ber, &dn) != LDAP_SUCCESS)
+    return 0;
 
-/*
- * These functions are called from within the parser, where it is assumed
- * to be safe to use the connection and the respective message.
- */
+  while (ldap_get_attribute_ber (session->ls_conn, e, lv->lv_ber, &type,
+				 &lv->lv_vals) == LDAP_SUCCESS &&
+	 type.bv_val != NULL)
+    {
+      if (type.bv_len == attrlen &&
+	  strncasecmp (type.bv_val, attr, attrlen) == 0)
+	{
+	  if (lv->lv_vals != NULL)
+	    while (lv->lv_vals[lv->lv_count].bv_val != NULL)
+	      lv->lv_count++;
+	  return lv->lv_count;
+	}
+
+      if (lv->lv_vals != NULL)
+	{
+	  ber_memfree (lv->lv_vals);
+	  lv->lv_vals = NULL;
+	}
+    }
+
+  do_values_free (lv);
+#else
+  lv->lv_borrowed = 0;
+  lv->lv_vals = ldap_get_values_len (session->ls_conn, e, (char *) attr);
+  lv->lv_count = (lv->lv_vals == NULL) ? 0 :
+    ldap_count_values_len (lv->lv_vals);
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+
+  return lv->lv_count;
+}
 
 /*
  * Assign all values, bar omitvalue (if not NULL), to *valptr.
@@ -4133,13 +7014,14 @@ _nss_ldap_assign_attrvals (LDAPMessage * e,
 			   char ***valptr, char **pbuffer, size_t *
 			   pbuflen, size_t * pvalcount)
 {
-  char **vals;
-  char **valiter;
-  int valcount;
+  ldap_values_t lv;
+  struct berval *bv;
+  int valcount, i;
+  size_t omitlen = 0;
   char **p = NULL;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
-  register int buflen = *pbuflen;
+  register size_t buflen = *pbuflen;
   register char *buffer = *pbuffer;
 
   if (pvalcount != NULL)
@@ -4152,12 +7034,10 @@ _nss_ldap_assign_attrvals (LDAPMessage * e,
       return NSS_UNAVAIL;
     }
 
-  vals = ldap_get_values (session->ls_conn, e, (char *) attr);
-
-  valcount = (vals == NULL) ? 0 : ldap_count_values (vals);
+  valcount = do_values_get (session, e, attr, &lv);
   if (bytesleft (buffer, buflen, char *) < (valcount + 1) * sizeof (char *))
     {
-      ldap_value_free (vals);
+      do_values_free (&lv);
       return NSS_TRYAGAIN;
     }
 
@@ -4172,40 +7052,37 @@ _nss_ldap_assign_attrvals (LDAPMessage * e,
       *p = NULL;
       *pbuffer = buffer;
       *pbuflen = buflen;
+      do_values_free (&lv);
       return NSS_SUCCESS;
     }
 
-  valiter = vals;
+  if (omitvalue != NULL)
+    omitlen = strlen (omitvalue);
 
-  while (*valiter != NULL)
+  for (i = 0; i < lv.lv_count; i++)
     {
-      int vallen;
-      char *elt = NULL;
+      bv = LDAP_VALUE (&lv, i);
 
-      if (omitvalue != NULL && strcmp (*valiter, omitvalue) == 0)
+      if (omitvalue != NULL && bv->bv_len == omitlen &&
+	  memcmp (bv->bv_val, omitvalue, omitlen) == 0)
 	{
 	  valcount--;
+	  continue;
 	}
-      else
+
+      if (buflen < bv->bv_len + 1)
 	{
-	  vallen = strlen (*valiter);
-	  if (buflen < (size_t) (vallen + 1))
-	    {
-	      ldap_value_free (vals);
-	      return NSS_TRYAGAIN;
-	    }
+	  do_values_free (&lv);
+	  return NSS_TRYAGAIN;
+	}
 
-	  /* copy this value into the next block of buffer space */
-	  elt = buffer;
-	  buffer += vallen + 1;
-	  buflen -= vallen + 1;
+      /* copy this value into the next block of buffer space */
+      memcpy (buffer, bv->bv_val, bv->bv_len);
+      buffer[bv->bv_len] = '\0';
+      *p++ = buffer;
 
-	  strncpy (elt, *valiter, vallen);
-	  elt[vallen] = '\0';
-	  *p = elt;
-	  p++;
-	}
-      valiter++;
+      buffer += bv->bv_len + 1;
+      buflen -= bv->bv_len + 1;
     }
 
   *p = NULL;
@@ -4217,7 +7094,7 @@ _nss_ldap_assign_attrvals (LDAPMessage * e,
       *pvalcount = valcount;
     }
 
-  ldap_value_free (vals);
+  do_values_free (&lv);
   return NSS_SUCCESS;
 }
 
@@ -4227,10 +7104,11 @@ _nss_ldap_assign_attrval (LDAPMessage * e,
 			  const char *attr, char **valptr, char **buffer,
 			  size_t * buflen)
 {
-  char **vals;
+  ldap_values_t lv;
+  struct berval *bv;
   int vallen;
   const char *ovr, *def;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   ovr = OV (attr);
   if (ovr != NULL)
@@ -4257,9 +7135,10 @@ _nss_ldap_assign_attrval (LDAPMessage * e,
       return NSS_UNAVAIL;
     }
 
-  vals = ldap_get_values (session->ls_conn, e, (char *) attr);
-  if (vals == NULL)
+  if (do_values_get (session, e, attr, &lv) == 0)
     {
+      do_values_free (&lv);
+
       def = DF (attr);
       if (def != NULL)
 	{
@@ -4285,23 +7164,22 @@ _nss_ldap_assign_attrval (LDAPMessage * e,
 	}
     }
 
-  vallen = strlen (*vals);
-  if (*buflen < (size_t) (vallen + 1))
+  bv = LDAP_VALUE (&lv, 0);
+  if (*buflen < bv->bv_len + 1)
     {
-      ldap_value_free (vals);
+      do_values_free (&lv);
       return NSS_TRYAGAIN;
     }
 
   *valptr = *buffer;
 
-  strncpy (*valptr, *vals, vallen);
-  (*valptr)[vallen] = '\0';
-
-  *buffer += vallen + 1;
-  *buflen -= vallen + 1;
+  memcpy (*valptr, bv->bv_val, bv->bv_len);
+  (*valptr)[bv->bv_len] = '\0';
 
-  ldap_value_free (vals);
+  *buffer += bv->bv_len + 1;
+  *buflen -= bv->bv_len + 1;
 
+  do_values_free (&lv);
   return NSS_SUCCESS;
 }
 
@@ -4312,7 +7190,7 @@ _nss_ldap_locate_userpassword (LDAPMessage *e, char **vals)
   size_t token_length = 0;
   char **valiter;
   const char *pwd = NULL;
-  ldap_session_t * session = &__session;
+  ldap_session_t * session = do_get_session ();
 
   if (session->ls_config != NULL)
     {
@@ -4369,7 +7247,7 @@ _nss_ldap_assign_userpassword (LDAPMessage * e,
   char **vals;
   const char *pwd;
   int vallen;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
 
   debug ("==> _nss_ldap_assign_userpassword");
@@ -4412,12 +7290,120 @@ _nss_ldap_assign_userpassword (LDAPMessage * e,
   return NSS_SUCCESS;
 }
 
+/*
+ * Add the buffer space _nss_ldap_assign_attrvals() takes to *size,
+ * allowing for the worst alignment of the array.
+ */
+NSS_STATUS
+_nss_ldap_size_attrvals (LDAPMessage * e,
+			 const char *attr, const char *omitvalue,
+			 size_t * size)
+{
+  ldap_values_t lv;
+  struct berval *bv;
+  int valcount, i;
+  size_t omitlen = 0;
+  ldap_session_t *session = do_get_session ();
+
+  if (session->ls_conn == NULL)
+    {
+      return NSS_UNAVAIL;
+    }
+
+  valcount = do_values_get (session, e, attr, &lv);
+  *size += alignof (char *) - 1 + (valcount + 1) * sizeof (char *);
+
+  if (omitvalue != NULL)
+    omitlen = strlen (omitvalue);
+
+  for (i = 0; i < valcount; i++)
+    {
+      bv = LDAP_VALUE (&lv, i);
+
+      if (omitvalue != NULL && bv->bv_len == omitlen &&
+	  memcmp (bv->bv_val, omitvalue, omitlen) == 0)
+	continue;
+
+      *size += bv->bv_len + 1;
+    }
+
+  do_values_free (&lv);
+  return NSS_SUCCESS;
+}
+
+/*
+ * Add the buffer space _nss_ldap_assign_attrval() takes to *size,
+ * returning NSS_NOTFOUND where it would.
+ */
+NSS_STATUS
+_nss_ldap_size_attrval (LDAPMessage * e, const char *attr, size_t * size)
+{
+  ldap_values_t lv;
+  const char *ovr, *def;
+  ldap_session_t *session = do_get_session ();
+
+  ovr = OV (attr);
+  if (ovr != NULL)
+    {
+      *size += strlen (ovr) + 1;
+      return NSS_SUCCESS;
+    }
+
+  if (session->ls_conn == NULL)
+    {
+      return NSS_UNAVAIL;
+    }
+
+  if (do_values_get (session, e, attr, &lv) == 0)
+    {
+      do_values_free (&lv);
+
+      def = DF (attr);
+      if (def == NULL)
+	return NSS_NOTFOUND;
+
+      *size += strlen (def) + 1;
+      return NSS_SUCCESS;
+    }
+
+  *size += LDAP_VALUE (&lv, 0)->bv_len + 1;
+
+  do_values_free (&lv);
+  return NSS_SUCCESS;
+}
+
+/*
+ * Add the buffer space _nss_ldap_assign_userpassword() takes to *size.
+ */
+NSS_STATUS
+_nss_ldap_size_userpassword (LDAPMessage * e, const char *attr,
+			     size_t * size)
+{
+  char **vals;
+  ldap_session_t *session = do_get_session ();
+
+  if (session->ls_conn == NULL)
+    {
+      return NSS_UNAVAIL;
+    }
+
+  vals = ldap_get_values (session->ls_conn, e, (char *) attr);
+  *size += strlen (_nss_ldap_locate_userpassword (e, vals)) + 1;
+
+  if (vals != NULL)
+    {
+      ldap_value_free (vals);
+    }
+
+  return NSS_SUCCESS;
+}
+
 NSS_STATUS
 _nss_ldap_oc_check (LDAPMessage * e, const char *oc)
 {
   char **vals, **valiter;
   NSS_STATUS ret = NSS_NOTFOUND;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_conn == NULL)
     {
@@ -4452,7 +7438,7 @@ _nss_ldap_shadow_date (const char *val, long default_date, long *value)
   int date;
   char *p;
   long long ll;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
   if (val == NULL || strlen(val) == 0)
     {
@@ -4465,7 +7451,7 @@ _nss_ldap_shadow_date (const char *val, long default_date, long *value)
       *value = default_date;
       return NSS_NOTFOUND;
     }
-  if (session->ls_config->ldc_shadow_type == LS_AD_SHADOW)
+  if (cfg->ldc_shadow_type == LS_AD_SHADOW)
     {
       date = ll / 864000000000LL - 134774LL;
       date = (date > 99999) ? 99999 : date;
@@ -4482,9 +7468,9 @@ _nss_ldap_shadow_date (const char *val, long default_date, long *value)
 void
 _nss_ldap_shadow_handle_flag (struct spwd *sp)
 {
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  if (session->ls_config->ldc_shadow_type == LS_AD_SHADOW)
+  if (cfg->ldc_shadow_type == LS_AD_SHADOW)
     {
       if (sp->sp_flag & UF_DONT_EXPIRE_PASSWD)
 	sp->sp_max = 99999;
@@ -4498,9 +7484,9 @@ _nss_ldap_map_at (ldap_map_selector_t sel, const char *attribute)
 {
   const char *mapped = NULL;
   NSS_STATUS stat;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  stat = _nss_ldap_map_get (session->ls_config, sel, MAP_ATTRIBUTE, attribute, &mapped);
+  stat = _nss_ldap_map_get (cfg, sel, MAP_ATTRIBUTE, attribute, &mapped);
 
   return (stat == NSS_SUCCESS) ? mapped : attribute;
 }
@@ -4510,9 +7496,9 @@ _nss_ldap_unmap_at (ldap_map_selector_t sel, const char *attribute)
 {
   const char *mapped = NULL;
   NSS_STATUS stat;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  stat = _nss_ldap_map_get (session->ls_config, sel, MAP_ATTRIBUTE_REVERSE, attribute, &mapped);
+  stat = _nss_ldap_map_get (cfg, sel, MAP_ATTRIBUTE_REVERSE, attribute, &mapped);
 
   return (stat == NSS_SUCCESS) ? mapped : attribute;
 }
@@ -4522,9 +7508,9 @@ _nss_ldap_map_oc (ldap_map_selector_t sel, const char *objectclass)
 {
   const char *mapped = NULL;
   NSS_STATUS stat;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  stat = _nss_ldap_map_get (session->ls_config, sel, MAP_OBJECTCLASS, objectclass, &mapped);
+  stat = _nss_ldap_map_get (cfg, sel, MAP_OBJECTCLASS, objectclass, &mapped);
 
   return (stat == NSS_SUCCESS) ? mapped : objectclass;
 }
@@ -4534,9 +7520,9 @@ _nss_ldap_unmap_oc (ldap_map_selector_t sel, const char *objectclass)
 {
   const char *mapped = NULL;
   NSS_STATUS stat;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  stat = _nss_ldap_map_get (session->ls_config, sel, MAP_OBJECTCLASS_REVERSE, objectclass, &mapped);
+  stat = _nss_ldap_map_get (cfg, sel, MAP_OBJECTCLASS_REVERSE, objectclass, &mapped);
 
   return (stat == NSS_SUCCESS) ? mapped : objectclass;
 }
@@ -4545,9 +7531,12 @@ const char *
 _nss_ldap_map_ov (const char *attribute)
 {
   const char *value = NULL;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
+
+  if (cfg != NULL && !cfg->ldc_have_overrides)
+    return NULL;
 
-  _nss_ldap_map_get (session->ls_config, LM_NONE, MAP_OVERRIDE, attribute, &value);
+  _nss_ldap_map_get (cfg, LM_NONE, MAP_OVERRIDE, attribute, &value);
 
   return value;
 }
@@ -4556,9 +7545,12 @@ const char *
 _nss_ldap_map_df (const char *attribute)
 {
   const char *value = NULL;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
+
+  if (cfg != NULL && !cfg->ldc_have_defaults)
+    return NULL;
 
-  _nss_ldap_map_get (session->ls_config, LM_NONE, MAP_DEFAULT, attribute, &value);
+  _nss_ldap_map_get (cfg, LM_NONE, MAP_DEFAULT, attribute, &value);
 
   return value;
 }
@@ -4568,9 +7560,9 @@ _nss_ldap_map_mr (ldap_map_selector_t sel, const char *attribute)
 {
   const char *mapped = NULL;
   NSS_STATUS stat;
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  stat = _nss_ldap_map_get (session->ls_config, sel, MAP_MATCHING_RULE, attribute, &mapped);
+  stat = _nss_ldap_map_get (cfg, sel, MAP_MATCHING_RULE, attribute, &mapped);
 
   return (stat == NSS_SUCCESS) ? mapped : NULL;
 }
@@ -4609,9 +7601,13 @@ _nss_ldap_map_put (ldap_config_t * config,
 	    config->ldc_shadow_type = LS_OTHER_SHADOW;
 	}
       break;
-    case MAP_OBJECTCLASS:
     case MAP_OVERRIDE:
+      config->ldc_have_overrides = 1;
+      break;
     case MAP_DEFAULT:
+      config->ldc_have_defaults = 1;
+      break;
+    case MAP_OBJECTCLASS:
     case MAP_MATCHING_RULE:
       break;
     default:
@@ -4684,6 +7680,91 @@ _nss_ldap_map_get (ldap_config_t * config,
   return stat;
 }
 
+NSS_STATUS
+_nss_ldap_map_compile (ldap_config_t * config)
+{
+  struct ldap_compiled_maps *lcm;
+  const char *mapped;
+  int sel, i;
+
+  debug ("==> _nss_ldap_map_compile");
+
+  lcm = (struct ldap_compiled_maps *) malloc (sizeof (*lcm));
+  if (lcm == NULL)
+    {
+      debug ("<== _nss_ldap_map_compile (no memory)");
+      return NSS_TRYAGAIN;
+    }
+
+  for (sel = 0; sel <= LM_NONE; sel++)
+    {
+      for (i = 0; i < ATI_MAX; i++)
+	{
+	  if (_nss_ldap_map_get (config, sel, MAP_ATTRIBUTE,
+				 _nss_ldap_attribute_names[i],
+				 &mapped) != NSS_SUCCESS)
+	    mapped = _nss_ldap_attribute_names[i];
+	  lcm->lcm_at[sel][i] = mapped;
+
+	  if (_nss_ldap_map_get (config, sel, MAP_MATCHING_RULE,
+				 _nss_ldap_attribute_names[i],
+				 &mapped) != NSS_SUCCESS)
+	    mapped = NULL;
+	  lcm->lcm_mr[sel][i] = mapped;
+	}
+
+      for (i = 0; i < OCI_MAX; i++)
+	{
+	  if (_nss_ldap_map_get (config, sel, MAP_OBJECTCLASS,
+				 _nss_ldap_objectclass_names[i],
+				 &mapped) != NSS_SUCCESS)
+	    mapped = _nss_ldap_objectclass_names[i];
+	  lcm->lcm_oc[sel][i] = mapped;
+	}
+    }
+
+  if (config->ldc_compiled_maps != NULL)
+    free (config->ldc_compiled_maps);
+  config->ldc_compiled_maps = lcm;
+
+  debug ("<== _nss_ldap_map_compile");
+
+  return NSS_SUCCESS;
+}
+
+const char *
+_nss_ldap_map_at_index (ldap_map_selector_t sel, ldap_attribute_t at)
+{
+  ldap_config_t *cfg = do_get_config ();
+
+  if (cfg != NULL && cfg->ldc_compiled_maps != NULL && sel <= LM_NONE)
+    return cfg->ldc_compiled_maps->lcm_at[sel][at];
+
+  return _nss_ldap_map_at (sel, _nss_ldap_attribute_names[at]);
+}
+
+const char *
+_nss_ldap_map_oc_index (ldap_map_selector_t sel, ldap_objectclass_t oc)
+{
+  ldap_config_t *cfg = do_get_config ();
+
+  if (cfg != NULL && cfg->ldc_compiled_maps != NULL && sel <= LM_NONE)
+    return cfg->ldc_compiled_maps->lcm_oc[sel][oc];
+
+  return _nss_ldap_map_oc (sel, _nss_ldap_objectclass_names[oc]);
+}
+
+const char *
+_nss_ldap_map_mr_index (ldap_map_selector_t sel, ldap_attribute_t at)
+{
+  ldap_config_t *cfg = do_get_config ();
+
+  if (cfg != NULL && cfg->ldc_compiled_maps != NULL && sel <= LM_NONE)
+    return cfg->ldc_compiled_maps->lcm_mr[sel][at];
+
+  return _nss_ldap_map_mr (sel, _nss_ldap_attribute_names[at]);
+}
+
 /*
  * Proxy bind support for AIX. Very simple, but should do
  * the job. 
@@ -4705,7 +7786,7 @@ do_proxy_rebind (LDAP * ld, LDAP_CONST char *url, int request,
 #endif
 {
   int timelimit;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 #if LDAP_SET_REBIND_PROC_ARGS == 3
   ldap_proxy_bind_args_t *who = (ldap_proxy_bind_args_t *) arg;
 #else
@@ -4727,7 +7808,7 @@ do_proxy_rebind (LDAP * ld, char **whop, char **credp, int *methodp,
 		 int freeit)
 #endif
 {
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 #if LDAP_SET_REBIND_PROC_ARGS == 3
   ldap_proxy_bind_args_t *who = (ldap_proxy_bind_args_t *) arg;
 #else
@@ -4763,7 +7844,7 @@ _nss_ldap_proxy_bind (const char *user, const char *password)
 #else
   ldap_proxy_bind_args_t *proxy_args = &__proxy_args;
 #endif
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_proxy_bind");
 
@@ -4908,7 +7989,7 @@ const char **
 _nss_ldap_get_attributes (ldap_map_selector_t sel)
 {
   const char **attrs = NULL;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   debug ("==> _nss_ldap_get_attributes");
 
@@ -4934,12 +8015,22 @@ _nss_ldap_get_attributes (ldap_map_selector_t sel)
   return attrs;
 }
 
+/*
+ * Return the configuration in effect for the calling thread, if
+ * it has been loaded.
+ */
+ldap_config_t *
+_nss_ldap_get_config (void)
+{
+  return do_get_config ();
+}
+
 int
 _nss_ldap_test_config_flag (unsigned int flag)
 {
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
 
-  if (session->ls_config != NULL && (session->ls_config->ldc_flags & flag) != 0)
+  if (cfg != NULL && (cfg->ldc_flags & flag) != 0)
     return 1;
 
   return 0;
@@ -4948,16 +8039,16 @@ _nss_ldap_test_config_flag (unsigned int flag)
 int
 _nss_ldap_test_initgroups_ignoreuser (const char *user)
 {
-  ldap_session_t *session = &__session;
+  ldap_config_t *cfg = do_get_config ();
   char **p;
 
-  if (session->ls_config == NULL)
+  if (cfg == NULL)
     return 0;
 
-  if (session->ls_config->ldc_initgroups_ignoreusers == NULL)
+  if (cfg->ldc_initgroups_ignoreusers == NULL)
     return 0;
 
-  for (p = session->ls_config->ldc_initgroups_ignoreusers; *p != NULL; p++)
+  for (p = cfg->ldc_initgroups_ignoreusers; *p != NULL; p++)
     {
       if (strcmp (*p, user) == 0)
 	return 1;
@@ -4966,12 +8057,34 @@ _nss_ldap_test_initgroups_ignoreuser (const char *user)
   return 0;
 }
 
+int
+_nss_ldap_get_transitive_state (void)
+{
+  ldap_session_t *session = do_get_session ();
+
+  if (session->ls_config == NULL || session->ls_current_uri < 0)
+    return NSS_LDAP_TRANSITIVE_UNKNOWN;
+
+  return session->ls_config->ldc_uri_transitive[session->ls_current_uri];
+}
+
+void
+_nss_ldap_set_transitive_state (int state)
+{
+  ldap_session_t *session = do_get_session ();
+
+  if (session->ls_config == NULL || session->ls_current_uri < 0)
+    return;
+
+  session->ls_config->ldc_uri_transitive[session->ls_current_uri] = state;
+}
+
 int
 _nss_ldap_get_ld_errno (char **m, char **s)
 {
   int rc;
   int lderrno;
-  ldap_session_t *session = &__session;
+  ldap_session_t *session = do_get_session ();
 
   if (session->ls_conn == NULL)
     {
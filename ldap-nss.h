@@ -120,6 +120,27 @@
 #endif /* HAVE_USERSEC_H */
 
 #define LDAP_PAGESIZE 1000
+#define LDAP_NSS_PAGED_READAHEAD 50	/* default percentage of a page read before the next */
+#define LDAP_NSS_PAGE_FAST 100	/* pages starting to arrive within this many ms grow */
+#define LDAP_NSS_PAGE_SLOW 1000	/* pages taking longer than this many ms to start shrink */
+#define LDAP_NSS_PAGE_MAXBYTES (4 * 1024 * 1024)	/* memory budget of one page */
+#define LDAP_NSS_POOLSIZE 8	/* default number of pooled sessions */
+#define LDAP_NSS_CACHE_MAX_ENTRIES 1024	/* default size of the entry cache */
+#define LDAP_NSS_DN2UID_CACHE_TTL 600	/* default lifetime of dn2uid cache entries */
+#define LDAP_NSS_DN2UID_CACHE_SIZE 16384	/* default dn2uid cache size, in entries */
+#define LDAP_NSS_DN2UID_CACHE_BYTES (4 * 1024 * 1024)	/* default dn2uid cache memory limit */
+#define LDAP_NSS_DN2UID_BATCH 64	/* member DNs resolved per search */
+#define LDAP_NSS_NG_BATCH 64	/* group DNs per nested initgroups search */
+#define LDAP_NSS_READ_WINDOW 16	/* default outstanding reads per session */
+#define LDAP_NSS_CONNECT_RACE 3	/* default number of servers probed at once */
+#define LDAP_NSS_RETRY_STASH_TTL 2	/* seconds a result is kept for an ERANGE retry */
+#define LDAP_NSS_BUFLEN_HINT_MAX (64 * 1024 * 1024)	/* largest buffer size hint computed */
+#define LDAP_NSS_ARENA_BLOCK 8192	/* smallest block of per-lookup scratch memory */
+#define LDAP_NSS_ARENA_RETAIN (256 * 1024)	/* scratch memory kept between lookups */
+#define LDAP_NSS_URI_BACKOFF 10	/* seconds a failed server is avoided */
+#define LDAP_NSS_URI_MAXBACKOFF 300	/* upper bound of the above */
+#define LDAP_NSS_CONFIG_CHECK_INTERVAL 1	/* seconds between checks of ldap.conf */
+#define LDAP_NSS_CONFIG_STALE (-1L)	/* ldc_check_state once ldap.conf has changed */
 
 #ifndef LDAP_FILT_MAXSIZ
 #define LDAP_FILT_MAXSIZ 1024
@@ -280,6 +301,22 @@ typedef struct ldap_service_search_descriptor
 /* maximum number of URIs */
 #define NSS_LDAP_CONFIG_URI_MAX		31
 
+/*
+ * health of each configured server, used to decide which one
+ * to open next
+ */
+struct ldap_uri_health
+{
+  /* smoothed TCP connect time in microseconds, 0 if unknown */
+  unsigned long luh_rtt;
+  /* number of consecutive failures */
+  int luh_failures;
+  /* server is avoided until this time */
+  time_t luh_retry;
+};
+
+typedef struct ldap_uri_health ldap_uri_health_t;
+
 /*
  * linked list of configurations pointing to LDAP servers. The first
  * which has a successful ldap_open() is used. Conceivably the rest
@@ -291,6 +328,10 @@ struct ldap_config
   char *ldc_config_filename;
   /* NULL terminated list of URIs */
   char *ldc_uris[NSS_LDAP_CONFIG_URI_MAX + 1];
+  /* whether each URI supports transitive initgroups */
+  int ldc_uri_transitive[NSS_LDAP_CONFIG_URI_MAX + 1];
+  /* connection health of each URI */
+  ldap_uri_health_t ldc_uri_health[NSS_LDAP_CONFIG_URI_MAX + 1];
   /* default port, if not specified in URI */
   int ldc_port;
   /* base DN, eg. dc=gnu,dc=org */
@@ -362,11 +403,35 @@ struct ldap_config
   char *ldc_srv_domain;
   /* DNS SRV RR site */
   char *ldc_srv_site;
+  /* file in which DNS SRV RRs are cached */
+  char *ldc_srv_cache;
   /* directory for debug files */
   char *ldc_logdir;
   /* LDAP debug level */
   int ldc_debug;
   int ldc_pagesize;
+  /* percentage of a page consumed before the next is requested */
+  int ldc_paged_readahead;
+  /* bounds of the page size, if it is to be adapted */
+  int ldc_pagesize_min;
+  int ldc_pagesize_max;
+  /* number of pooled sessions for concurrent lookups */
+  int ldc_pool_size;
+  /* lifetime of cached entries and of cached negative results */
+  time_t ldc_cache_ttl;
+  time_t ldc_cache_negative_ttl;
+  /* maximum number of cached entries */
+  int ldc_cache_max_entries;
+  /* path of the entry cache shared between processes */
+  char *ldc_shm_cache;
+  /* lifetime, maximum number and total size of dn2uid cache entries */
+  time_t ldc_dn2uid_cache_ttl;
+  size_t ldc_dn2uid_cache_size;
+  size_t ldc_dn2uid_cache_bytes;
+  /* maximum number of outstanding pipelined reads */
+  int ldc_read_window;
+  /* number of servers to race connections to */
+  int ldc_connect_race;
 #if defined(CONFIGURE_KRB5_CCNAME) || defined(CONFIGURE_KRB5_KEYTAB)
   /* krb5 ccache name */
   char *ldc_krb5_ccname;
@@ -385,6 +450,11 @@ struct ldap_config
    * attribute/objectclass maps relative to this config
    */
   void *ldc_maps[LM_NONE + 1][7]; /* must match MAP_MAX */
+  /* the above, resolved for every selector at load time */
+  struct ldap_compiled_maps *ldc_compiled_maps;
+  /* are there any override or default values? */
+  int ldc_have_overrides;
+  int ldc_have_defaults;
 
   /*
    * is userPassword "userPassword" or not? 
@@ -405,6 +475,12 @@ struct ldap_config
 
   /* last modification time */
   time_t ldc_mtime;
+  /*
+   * when the file was last checked for changes, or
+   * LDAP_NSS_CONFIG_STALE once it has changed; only
+   * accessed atomically, see _nss_ldap_validateconfig()
+   */
+  long ldc_check_state;
 
   char **ldc_initgroups_ignoreusers;
 };
@@ -456,6 +532,37 @@ struct ldap_session_mechs
 };
 
 typedef struct ldap_session_mechs *ldap_session_mechs_t;
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+/*
+ * Attributes of the entry being parsed, decoded in one pass
+ * over its BER encoding and hashed by (case-folded) type, so
+ * that each attribute a parser asks for is found without
+ * rescanning the entry.
+ */
+#define LDAP_NSS_INDEX_BUCKETS	32
+
+struct ldap_entry_attr
+{
+  struct berval lea_type;
+  struct berval *lea_vals;
+  int lea_count;
+  int lea_next;
+};
+
+struct ldap_entry_index
+{
+  /* entry being parsed, or NULL */
+  LDAPMessage *lei_entry;
+  /* 0 until decoded, 1 once decoded, -1 if decoding failed */
+  int lei_built;
+  BerElement *lei_ber;
+  int lei_buckets[LDAP_NSS_INDEX_BUCKETS];
+  struct ldap_entry_attr *lei_attrs;
+  int lei_count;
+  int lei_size;
+};
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
 /*
  * Session state management
  */
@@ -468,6 +575,19 @@ enum ldap_session_state
 
 typedef enum ldap_session_state ldap_session_state_t;
 
+/*
+ * Mapped attribute, objectclass and matching rule names for each
+ * selector, indexed by ldap_attribute_t and ldap_objectclass_t.
+ * Built from ldc_maps once the configuration has been read, so
+ * that AT(), OC() and friends need not search the maps.
+ */
+struct ldap_compiled_maps
+{
+  const char *lcm_at[LM_NONE + 1][ATI_MAX];
+  const char *lcm_oc[LM_NONE + 1][OCI_MAX];
+  const char *lcm_mr[LM_NONE + 1][ATI_MAX];
+};
+
 /*
  * convenient wrapper around pointer into global config list, and a
  * connection to an LDAP server.
@@ -496,6 +616,17 @@ struct ldap_session
   /* keep track of the LDAP sockets */
   NSS_LDAP_SOCKADDR_STORAGE ls_sockname;
   NSS_LDAP_SOCKADDR_STORAGE ls_peername;
+  /* is the pooled session in use by a lookup? */
+  int ls_busy;
+  /* bumped each time the connection is dropped */
+  unsigned int ls_generation;
+  /* connected socket to ls_current_uri left by the URI race */
+  int ls_race_pending;
+  int ls_race_sd;
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+  /* attributes of the entry being parsed */
+  struct ldap_entry_index ls_index;
+#endif				/* HAVE_LDAP_GET_ATTRIBUTE_BER */
 };
 
 typedef struct ldap_session ldap_session_t;
@@ -654,9 +785,18 @@ struct ent_context
   LDAPMessage *ec_res;		/* result chain */
   ldap_service_search_descriptor_t *ec_sd;	/* current sd */
   struct berval *ec_cookie;     /* cookie for paged searches */
+  LDAPMessage *ec_ahead;	/* rest of the page, taken off the wire early */
+  LDAPMessage *ec_ahead_next;	/* next entry in ec_ahead */
+  int ec_next_msgid;		/* message ID of the page read ahead */
+  int ec_count;			/* entries returned from the current page */
+  int ec_pagesize;		/* size of the current page, 0 for pagesize */
+  struct timeval ec_page_start;	/* when the current page was requested */
+  long ec_page_latency;		/* ms until it started arriving, or -1 */
+  size_t ec_entry_size;		/* smoothed size of an entry, in bytes */
   int ec_eof : 1;		/* reached notional end of file */
   int ec_internal : 1;		/* this context is just a part of a larger
 				 * query for information */
+  int ec_borrowed : 1;		/* ec_res is part of ec_ahead */
 };
 
 typedef struct ent_context ent_context_t;
@@ -737,6 +877,18 @@ typedef enum nss_status NSS_STATUS;
 typedef NSS_STATUS (*parser_t) (LDAPMessage *, ldap_state_t *, void *,
 				char *, size_t);
 
+/*
+ * Works out the buffer space a parser needs for an entry, whatever
+ * the alignment of the buffer; kept next to the parser it sizes.
+ */
+typedef NSS_STATUS (*sizer_t) (LDAPMessage *, ldap_state_t *, size_t *);
+
+/*
+ * Called by _nss_ldap_search_stream() for each entry; a NULL
+ * entry means the search is being restarted.
+ */
+typedef NSS_STATUS (*search_callback_t) (LDAPMessage *, void *);
+
 #ifdef HPUX
 extern int __thread_mutex_lock(pthread_mutex_t *);
 extern int __thread_mutex_unlock(pthread_mutex_t *);
@@ -805,6 +957,31 @@ void _nss_ldap_enter (void);
  */
 void _nss_ldap_leave (void);
 
+/*
+ * Begin a keyed lookup that shares no state with other calls,
+ * such as getXXbyYY(), initgroups() or innetgr(). If concurrent
+ * sessions are enabled, the lookup runs on a private session
+ * without holding the global lock; otherwise this is the same
+ * as _nss_ldap_enter().
+ */
+void _nss_ldap_enter_lookup (void);
+
+/*
+ * End a lookup begun with _nss_ldap_enter_lookup().
+ */
+void _nss_ldap_leave_lookup (void);
+
+/*
+ * Scratch memory for the current lookup, taken from a per-thread
+ * arena that is released all at once by _nss_ldap_leave() and
+ * _nss_ldap_leave_lookup(). Must not be passed to free(), or used
+ * once the lookup is over. _nss_ldap_arena_realloc() grows the
+ * most recent allocation in place where it can.
+ */
+void *_nss_ldap_arena_alloc (size_t size);
+void *_nss_ldap_arena_realloc (void *ptr, size_t oldsize, size_t size);
+char *_nss_ldap_arena_strdup (const char *s);
+
 #ifdef LDAP_OPT_THREAD_FN_PTRS
 /*
  * Netscape's libldap is threadsafe, but we use a
@@ -883,6 +1060,18 @@ NSS_STATUS _nss_ldap_search_s (const ldap_args_t * args,	/* IN */
 			       int sizelimit,	/* IN */
 			       LDAPMessage ** pRes /* OUT */ );
 
+/*
+ * Search, handing each entry to a callback as it arrives
+ * (caller acquires lock).
+ */
+NSS_STATUS _nss_ldap_search_stream (const ldap_args_t * args,	/* IN */
+				    const char *filterprot,	/* IN */
+				    ldap_map_selector_t sel,	/* IN */
+				    const char **user_attrs,	/* IN */
+				    int sizelimit,	/* IN */
+				    search_callback_t callback,	/* IN */
+				    void *arg /* IN */ );
+
 /*
  * Asynchronous search cover (caller acquires lock).
  */
@@ -897,10 +1086,53 @@ NSS_STATUS _nss_ldap_search (const ldap_args_t * args,	/* IN */
 /*
  * Emulate X.500 read operation.
  */
+/*
+ * Estimate of the buffer size the last lookup on the calling
+ * thread needed, if it failed with ERANGE, so that the caller can
+ * retry with a large enough size at once; 0 if it is not known.
+ */
+size_t _nss_ldap_get_buflen_hint (void);
+
 NSS_STATUS _nss_ldap_read (const char *dn,	/* IN */
 			   const char **attributes,	/* IN */
 			   LDAPMessage ** pRes /* OUT */ );
 
+/*
+ * A read left in flight by _nss_ldap_read_async().
+ */
+typedef struct ldap_async_read
+{
+  int lar_msgid;
+  /* connection the request was sent on */
+  unsigned int lar_generation;
+} ldap_async_read_t;
+
+/*
+ * Send a read without waiting for the result, which is collected
+ * with _nss_ldap_read_result(). If the connection has been
+ * reopened in the meantime, _nss_ldap_read_result() returns
+ * NSS_TRYAGAIN and the caller should use _nss_ldap_read().
+ */
+NSS_STATUS _nss_ldap_read_async (const char *dn,	/* IN */
+				 const char **attributes,	/* IN */
+				 ldap_async_read_t * pRead /* OUT */ );
+
+NSS_STATUS _nss_ldap_read_result (ldap_async_read_t * pRead,	/* IN */
+				  LDAPMessage ** pRes /* OUT */ );
+
+void _nss_ldap_read_abandon (ldap_async_read_t * pRead);
+
+/*
+ * Read several entries, keeping up to nss_read_window
+ * requests outstanding. Results and per-entry status are
+ * returned in the order of dns.
+ */
+NSS_STATUS _nss_ldap_read_multi (const char **dns,	/* IN */
+				 size_t count,	/* IN */
+				 const char **attributes,	/* IN */
+				 LDAPMessage ** pRes,	/* OUT */
+				 NSS_STATUS * pStats /* OUT */ );
+
 /*
  * extended enumeration routine; uses asynchronous API.
  * Caller must have acquired the global mutex
@@ -965,6 +1197,26 @@ NSS_STATUS _nss_ldap_assign_userpassword (LDAPMessage * e,	/* IN */
 					  char **buffer,	/* IN/OUT */
 					  size_t * buflen);	/* IN/OUT */
 
+/* sizing counterparts of the above; they add to *size */
+NSS_STATUS _nss_ldap_size_attrvals (LDAPMessage * e,	/* IN */
+				    const char *attr,	/* IN */
+				    const char *omitvalue,	/* IN */
+				    size_t * size /* IN/OUT */ );
+
+NSS_STATUS _nss_ldap_size_attrval (LDAPMessage * e,	/* IN */
+				   const char *attr,	/* IN */
+				   size_t * size /* IN/OUT */ );
+
+NSS_STATUS _nss_ldap_size_userpassword (LDAPMessage * e,	/* IN */
+					const char *attr,	/* IN */
+					size_t * size /* IN/OUT */ );
+
+/* sizers for the maps that have one */
+NSS_STATUS _nss_ldap_size_pw (LDAPMessage * e, ldap_state_t * pvt,
+			      size_t * size);
+NSS_STATUS _nss_ldap_size_gr (LDAPMessage * e, ldap_state_t * pvt,
+			      size_t * size);
+
 NSS_STATUS _nss_ldap_oc_check (LDAPMessage * e, const char *oc);
 
 NSS_STATUS _nss_ldap_shadow_date(const char *val, long default_date,
@@ -996,6 +1248,19 @@ const char *_nss_ldap_map_df (const char *pChar);
 
 const char *_nss_ldap_map_mr (ldap_map_selector_t sel, const char *attribute);
 
+/*
+ * Resolve all attribute/objectclass mappings of a configuration
+ * into ldc_compiled_maps.
+ */
+NSS_STATUS _nss_ldap_map_compile (ldap_config_t * config);
+
+const char *_nss_ldap_map_at_index (ldap_map_selector_t sel,
+				    ldap_attribute_t at);
+const char *_nss_ldap_map_oc_index (ldap_map_selector_t sel,
+				    ldap_objectclass_t oc);
+const char *_nss_ldap_map_mr_index (ldap_map_selector_t sel,
+				    ldap_attribute_t at);
+
 /*
  * Proxy bind support for AIX.
  */
@@ -1012,8 +1277,20 @@ NSS_STATUS _nss_ldap_proxy_bind (const char *user, const char *password);
 NSS_STATUS _nss_ldap_init (void);
 void _nss_ldap_close (void);
 
+ldap_config_t *_nss_ldap_get_config (void);
 int _nss_ldap_test_config_flag (unsigned int flag);
 int _nss_ldap_test_initgroups_ignoreuser (const char *user);
+
+/*
+ * Whether the current server evaluates the in-chain matching
+ * rule for transitive initgroups, as last observed.
+ */
+#define NSS_LDAP_TRANSITIVE_UNKNOWN	0
+#define NSS_LDAP_TRANSITIVE_SUPPORTED	1
+#define NSS_LDAP_TRANSITIVE_REJECTED	2
+
+int _nss_ldap_get_transitive_state (void);
+void _nss_ldap_set_transitive_state (int state);
 int _nss_ldap_get_ld_errno (char **m, char **s);
 
 const char *__nss_ldap_status2string (NSS_STATUS stat);
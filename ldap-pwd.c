@@ -48,6 +48,7 @@ static char rcsId[] =
 
 #include "ldap-nss.h"
 #include "ldap-pwd.h"
+#include "ldap-cache.h"
 #include "util.h"
 
 #ifdef HAVE_PORT_AFTER_H
@@ -65,7 +66,7 @@ static INLINE NSS_STATUS _nss_ldap_assign_emptystring (char **valptr,
 static INLINE NSS_STATUS
 _nss_ldap_assign_emptystring (char **valptr, char **buffer, size_t * buflen)
 {
-  if (*buflen < 2)
+  if (*buflen < 1)
     return NSS_TRYAGAIN;
 
   *valptr = *buffer;
@@ -93,7 +94,7 @@ _nss_ldap_parse_pw (LDAPMessage * e,
   if (_nss_ldap_oc_check (e, "shadowAccount") == NSS_SUCCESS)
     {
       /* don't include password for shadowAccount */
-      if (buflen < 3)
+      if (buflen < 2)
 	return NSS_TRYAGAIN;
 
       pw->pw_passwd = buffer;
@@ -263,6 +264,178 @@ _nss_ldap_parse_pw (LDAPMessage * e,
   return NSS_SUCCESS;
 }
 
+/*
+ * The buffer space _nss_ldap_parse_pw() needs for e. The numbers it
+ * parses from a buffer of its own are checked as the parser does, so
+ * that entries it would skip are skipped here too.
+ */
+NSS_STATUS
+_nss_ldap_size_pw (LDAPMessage * e, ldap_state_t * pvt, size_t * size)
+{
+  NSS_STATUS stat;
+  char tmpbuf[sizeof "-9223372036854775808"];
+  size_t tmplen;
+  char *tmp, *val;
+  uid_t uid;
+  gid_t gid;
+#ifdef HAVE_PASSWD_PW_CHANGE
+  long change;
+#endif
+
+  *size = 0;
+
+  if (_nss_ldap_oc_check (e, "shadowAccount") == NSS_SUCCESS)
+    *size += sizeof ("x");
+  else
+    {
+      stat =
+	_nss_ldap_size_userpassword (e, ATM (LM_PASSWD, userPassword), size);
+      if (stat != NSS_SUCCESS)
+	return stat;
+    }
+
+  stat = _nss_ldap_size_attrval (e, ATM (LM_PASSWD, uid), size);
+  if (stat != NSS_SUCCESS)
+    return stat;
+
+  tmp = tmpbuf;
+  tmplen = sizeof "-4294967295";
+  stat = _nss_ldap_assign_attrval (e, AT (uidNumber), &val, &tmp, &tmplen);
+  if (stat != NSS_SUCCESS)
+    return (stat == NSS_TRYAGAIN) ? NSS_NOTFOUND : stat;
+  if (*val != '\0')
+    {
+      stat = _nss_ldap_parse_uid_t (val, UID_NOBODY, &uid);
+      if (stat != NSS_SUCCESS)
+	return stat;
+    }
+
+  tmp = tmpbuf;
+  tmplen = sizeof "-4294967295";
+  stat = _nss_ldap_assign_attrval (e, ATM (LM_PASSWD, gidNumber), &val, &tmp,
+				   &tmplen);
+  if (stat != NSS_SUCCESS)
+    return (stat == NSS_TRYAGAIN) ? NSS_NOTFOUND : stat;
+  if (*val != '\0')
+    {
+      stat = _nss_ldap_parse_gid_t (val, GID_NOBODY, &gid);
+      if (stat != NSS_SUCCESS)
+	return stat;
+    }
+
+  stat = _nss_ldap_size_attrval (e, AT (gecos), size);
+  if (stat != NSS_SUCCESS)
+    {
+      stat = _nss_ldap_size_attrval (e, ATM (LM_PASSWD, cn), size);
+      if (stat != NSS_SUCCESS)
+	return stat;
+    }
+
+  /* absent values are assigned the empty string */
+#ifdef HAVE_LOGIN_CLASSES
+  if (_nss_ldap_size_attrval (e, AT (loginClass), size) != NSS_SUCCESS)
+    (*size)++;
+#endif
+  if (_nss_ldap_size_attrval (e, AT (homeDirectory), size) != NSS_SUCCESS)
+    (*size)++;
+  if (_nss_ldap_size_attrval (e, AT (loginShell), size) != NSS_SUCCESS)
+    (*size)++;
+
+#ifdef HAVE_NSSWITCH_H
+  (void) _nss_ldap_size_attrval (e, ATM (LM_PASSWD, description), size);
+  (*size)++;			/* pw_age */
+#endif /* HAVE_NSSWITCH_H */
+
+#ifdef HAVE_PASSWD_PW_CHANGE
+  /* shadowLastChange is only copied if shadowMax is positive */
+  tmp = tmpbuf;
+  tmplen = sizeof (tmpbuf);
+  stat = _nss_ldap_assign_attrval (e, AT (shadowMax), &val, &tmp, &tmplen);
+  if (stat == NSS_SUCCESS)
+    {
+      *size += sizeof (tmpbuf) - tmplen;
+      _nss_ldap_parse_long (val, 0, &change);
+    }
+  else if (stat == NSS_TRYAGAIN)
+    {
+      /* too long for any long; the parser sees a saturated value */
+      (void) _nss_ldap_size_attrval (e, AT (shadowMax), size);
+      change = 1;
+    }
+  else
+    change = 0;
+
+  if (change > 0)
+    (void) _nss_ldap_size_attrval (e, AT (shadowLastChange), size);
+#endif /* HAVE_PASSWD_PW_CHANGE */
+
+#ifdef HAVE_PASSWD_PW_EXPIRE
+  (void) _nss_ldap_size_attrval (e, AT (shadowExpire), size);
+#endif /* HAVE_PASSWD_PW_EXPIRE */
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Copy a parsed passwd entry, for the entry cache.
+ */
+size_t
+_nss_ldap_copy_pw (const void *src, void *dst, char *buffer, size_t buflen)
+{
+  const struct passwd *from = (const struct passwd *) src;
+  struct passwd tmp;
+  struct passwd *pw = (dst != NULL) ? (struct passwd *) dst : &tmp;
+  size_t needed = 0;
+
+  *pw = *from;
+
+  pw->pw_name =
+    _nss_ldap_cache_copy_string (from->pw_name, &buffer, &buflen, &needed);
+  pw->pw_passwd =
+    _nss_ldap_cache_copy_string (from->pw_passwd, &buffer, &buflen, &needed);
+  pw->pw_gecos =
+    _nss_ldap_cache_copy_string (from->pw_gecos, &buffer, &buflen, &needed);
+#ifdef HAVE_LOGIN_CLASSES
+  pw->pw_class =
+    _nss_ldap_cache_copy_string (from->pw_class, &buffer, &buflen, &needed);
+#endif
+  pw->pw_dir =
+    _nss_ldap_cache_copy_string (from->pw_dir, &buffer, &buflen, &needed);
+  pw->pw_shell =
+    _nss_ldap_cache_copy_string (from->pw_shell, &buffer, &buflen, &needed);
+#ifdef HAVE_NSSWITCH_H
+  if (from->pw_comment == from->pw_gecos)
+    pw->pw_comment = pw->pw_gecos;
+  else
+    pw->pw_comment =
+      _nss_ldap_cache_copy_string (from->pw_comment, &buffer, &buflen,
+				   &needed);
+  pw->pw_age =
+    _nss_ldap_cache_copy_string (from->pw_age, &buffer, &buflen, &needed);
+#endif /* HAVE_NSSWITCH_H */
+
+  return needed;
+}
+
+void
+_nss_ldap_reloc_pw (void *ent, const char *from, const char *to)
+{
+  struct passwd *pw = (struct passwd *) ent;
+
+  NSS_LDAP_RELOC (pw->pw_name, from, to);
+  NSS_LDAP_RELOC (pw->pw_passwd, from, to);
+  NSS_LDAP_RELOC (pw->pw_gecos, from, to);
+#ifdef HAVE_LOGIN_CLASSES
+  NSS_LDAP_RELOC (pw->pw_class, from, to);
+#endif
+  NSS_LDAP_RELOC (pw->pw_dir, from, to);
+  NSS_LDAP_RELOC (pw->pw_shell, from, to);
+#ifdef HAVE_NSSWITCH_H
+  NSS_LDAP_RELOC (pw->pw_comment, from, to);
+  NSS_LDAP_RELOC (pw->pw_age, from, to);
+#endif /* HAVE_NSSWITCH_H */
+}
+
 #ifdef HAVE_NSS_H
 NSS_STATUS
 _nss_ldap_getpwnam_r (const char *name,
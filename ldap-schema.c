@@ -62,6 +62,75 @@ static char rcsId[] =
 #endif
 
 
+/**
+ * names of the attributes and object classes, by index
+ */
+const char *_nss_ldap_attribute_names[ATI_MAX] = {
+  AT_objectClass,
+  AT_cn,
+  AT_description,
+  AT_l,
+  AT_manager,
+  AT_entryDN,
+  AT_rfc822MailMember,
+  AT_uid,
+  AT_userPassword,
+  AT_uidNumber,
+  AT_gidNumber,
+  AT_loginShell,
+  AT_gecos,
+  AT_homeDirectory,
+#ifdef HAVE_LOGIN_CLASSES
+  AT_loginClass,
+#endif
+  AT_shadowLastChange,
+  AT_shadowMin,
+  AT_shadowMax,
+  AT_shadowWarning,
+  AT_shadowInactive,
+  AT_shadowExpire,
+  AT_shadowFlag,
+  AT_memberUid,
+  AT_uniqueMember,
+  AT_memberOf,
+  AT_ipServicePort,
+  AT_ipServiceProtocol,
+  AT_ipProtocolNumber,
+  AT_oncRpcNumber,
+  AT_ipHostNumber,
+  AT_ipNetworkNumber,
+  AT_ipNetmaskNumber,
+  AT_nisNetgroupTriple,
+  AT_memberNisNetgroup,
+  AT_nisMapName,
+  AT_nisMapEntry,
+  AT_macAddress,
+  AT_bootFile,
+  AT_bootParameter,
+  AT_automountMapName,
+  AT_automountKey,
+  AT_automountInformation,
+};
+
+const char *_nss_ldap_objectclass_names[OCI_MAX] = {
+  OC_nisMailAlias,
+  OC_posixAccount,
+  OC_shadowAccount,
+  OC_posixGroup,
+  OC_ipService,
+  OC_ipProtocol,
+  OC_oncRpc,
+  OC_ipHost,
+  OC_ipNetwork,
+  OC_nisNetgroup,
+  OC_nisMap,
+  OC_nisObject,
+  OC_ieee802Device,
+  OC_bootableDevice,
+  OC_automountMap,
+  OC_automount,
+};
+
 /**
  * declare filters formerly declared in ldap-*.h
  */
@@ -84,6 +153,7 @@ char _nss_ldap_filt_getgrgid[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getgrent[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getgroupsbymemberanddn[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getgroupsbydn[LDAP_FILT_MAXSIZ];
+char _nss_ldap_filt_getgroupsbydn_chain[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getpwnam_groupsbymember[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getgroupsbymember[LDAP_FILT_MAXSIZ];
 
@@ -106,6 +176,7 @@ char _nss_ldap_filt_getprotoent[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getpwnam[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getpwuid[LDAP_FILT_MAXSIZ];
 char _nss_ldap_filt_getpwent[LDAP_FILT_MAXSIZ];
+char _nss_ldap_filt_getpwbydn[LDAP_FILT_MAXSIZ];
 
 /* RPCs */
 char _nss_ldap_filt_getrpcbyname[LDAP_FILT_MAXSIZ];
@@ -151,12 +222,14 @@ char _nss_ldap_filt_getautomntbyname[LDAP_FILT_MAXSIZ];
 
 #define FILL(filter_buffer) \
   do { \
-    char *buffer = filter_buffer; \
+    char *const buffer_start = filter_buffer; \
+    char *buffer = buffer_start; \
     char *const buffer_end = buffer + LDAP_FILT_MAXSIZ
 
 #define FILL_END \
     assert (buffer < buffer_end); \
     *(buffer < buffer_end ? buffer : buffer_end - 1) = '\0'; \
+    _nss_ldap_compile_filter (buffer_start); \
   } while (0)
 
 #define FILTER \
@@ -282,6 +355,18 @@ _nss_ldap_init_filters (void)
       QUERY_ITEM_FILTER (uniqueMember, "%s");
     FILTER_END;
   FILL_END;
+  /* nested membership, unless another rule is mapped for uniqueMember */
+  FILL (_nss_ldap_filt_getgroupsbydn_chain);
+    AND_FILTER;
+      FIXED_ITEM_FILTER (objectClass, posixGroup);
+      FILTER;
+        ITEM (ATM (LM_GROUP, uniqueMember),
+	      MRM (LM_GROUP, uniqueMember) != NULL ?
+	        MRM (LM_GROUP, uniqueMember) : MR_IN_CHAIN,
+	      =, "%s");
+      FILTER_END;
+    FILTER_END;
+  FILL_END;
   FILL (_nss_ldap_filt_getpwnam_groupsbymember);
     OR_FILTER;
       AND_FILTER;
@@ -368,6 +453,10 @@ _nss_ldap_init_filters (void)
   FILL (_nss_ldap_filt_getpwent);
     FIXED_ITEM_FILTER (objectClass, posixAccount);
   FILL_END;
+  /* one term of an OR filter over member DNs */
+  FILL (_nss_ldap_filt_getpwbydn);
+    QUERY_ITEM_FILTERM (LM_PASSWD, entryDN, "%s");
+  FILL_END;
 
   /* RPCs */
   FILL (_nss_ldap_filt_getrpcbyname);
@@ -30,6 +30,12 @@
  * function to initialize global lookup filters.
  */
 void _nss_ldap_init_filters (void);
+
+/**
+ * function to precompile a filter prototype; called for each
+ * global lookup filter by _nss_ldap_init_filters().
+ */
+void _nss_ldap_compile_filter (const char *filterprot);
 void _nss_ldap_init_attributes (const char ***attrtab, int skipmembers);
 
 /**
@@ -54,6 +60,7 @@ extern char _nss_ldap_filt_getgrgid[];
 extern char _nss_ldap_filt_getgrent[];
 extern char _nss_ldap_filt_getgroupsbymemberanddn[];
 extern char _nss_ldap_filt_getgroupsbydn[];
+extern char _nss_ldap_filt_getgroupsbydn_chain[];
 extern char _nss_ldap_filt_getpwnam_groupsbymember[];
 extern char _nss_ldap_filt_getgroupsbymember[];
 
@@ -76,6 +83,7 @@ extern char _nss_ldap_filt_getprotoent[];
 extern char _nss_ldap_filt_getpwnam[];
 extern char _nss_ldap_filt_getpwuid[];
 extern char _nss_ldap_filt_getpwent[];
+extern char _nss_ldap_filt_getpwbydn[];
 
 /* RPCs */
 extern char _nss_ldap_filt_getrpcbyname[];
@@ -111,14 +119,14 @@ extern char _nss_ldap_filt_getautomntbyname[];
  * Lookup (potentially mapped)
  * objectclass/attribute.
  */
-#define OC(oc)                   _nss_ldap_map_oc(LM_NONE, OC##_##oc)
-#define OCM(map, at)             _nss_ldap_map_oc(map, AT##_##at)
-#define AT(at)                   _nss_ldap_map_at(LM_NONE, AT##_##at)
-#define ATM(map, at)             _nss_ldap_map_at(map, AT##_##at)
+#define OC(oc)                   _nss_ldap_map_oc_index(LM_NONE, OCI##_##oc)
+#define OCM(map, oc)             _nss_ldap_map_oc_index(map, OCI##_##oc)
+#define AT(at)                   _nss_ldap_map_at_index(LM_NONE, ATI##_##at)
+#define ATM(map, at)             _nss_ldap_map_at_index(map, ATI##_##at)
 #define DF(at)                   _nss_ldap_map_df(at)
 #define OV(at)                   _nss_ldap_map_ov(at)
-#define MR(at)                   _nss_ldap_map_mr(LM_NONE, AT##_##at)
-#define MRM(map, at)             _nss_ldap_map_mr(map, AT##_##at)
+#define MR(at)                   _nss_ldap_map_mr_index(LM_NONE, ATI##_##at)
+#define MRM(map, at)             _nss_ldap_map_mr_index(map, ATI##_##at)
 
 /**
  * Common attributes, not from RFC 2307.
@@ -128,6 +136,11 @@ extern char _nss_ldap_filt_getautomntbyname[];
 #define AT_description            "description"
 #define AT_l                      "l"
 #define AT_manager                "manager"
+/* RFC 5020; map to distinguishedName for Active Directory */
+#define AT_entryDN                "entryDN"
+
+/* Active Directory LDAP_MATCHING_RULE_IN_CHAIN */
+#define MR_IN_CHAIN               "1.2.840.113556.1.4.1941"
 
 /**
  * Vendor-specific attributes and object classes.
@@ -301,6 +314,88 @@ extern char _nss_ldap_filt_getautomntbyname[];
 #define AT_automountKey           "automountKey"
 #define AT_automountInformation   "automountInformation"
 
+/*
+ * Indices of the attributes and object classes above, so that
+ * mapped names can be looked up in the tables compiled when the
+ * configuration is loaded.
+ */
+enum ldap_attribute
+{
+  ATI_objectClass = 0,
+  ATI_cn,
+  ATI_description,
+  ATI_l,
+  ATI_manager,
+  ATI_entryDN,
+  ATI_rfc822MailMember,
+  ATI_uid,
+  ATI_userPassword,
+  ATI_uidNumber,
+  ATI_gidNumber,
+  ATI_loginShell,
+  ATI_gecos,
+  ATI_homeDirectory,
+#ifdef HAVE_LOGIN_CLASSES
+  ATI_loginClass,
+#endif
+  ATI_shadowLastChange,
+  ATI_shadowMin,
+  ATI_shadowMax,
+  ATI_shadowWarning,
+  ATI_shadowInactive,
+  ATI_shadowExpire,
+  ATI_shadowFlag,
+  ATI_memberUid,
+  ATI_uniqueMember,
+  ATI_memberOf,
+  ATI_ipServicePort,
+  ATI_ipServiceProtocol,
+  ATI_ipProtocolNumber,
+  ATI_oncRpcNumber,
+  ATI_ipHostNumber,
+  ATI_ipNetworkNumber,
+  ATI_ipNetmaskNumber,
+  ATI_nisNetgroupTriple,
+  ATI_memberNisNetgroup,
+  ATI_nisMapName,
+  ATI_nisMapEntry,
+  ATI_macAddress,
+  ATI_bootFile,
+  ATI_bootParameter,
+  ATI_automountMapName,
+  ATI_automountKey,
+  ATI_automountInformation,
+  ATI_MAX
+};
+
+typedef enum ldap_attribute ldap_attribute_t;
+
+enum ldap_objectclass
+{
+  OCI_nisMailAlias = 0,
+  OCI_posixAccount,
+  OCI_shadowAccount,
+  OCI_posixGroup,
+  OCI_ipService,
+  OCI_ipProtocol,
+  OCI_oncRpc,
+  OCI_ipHost,
+  OCI_ipNetwork,
+  OCI_nisNetgroup,
+  OCI_nisMap,
+  OCI_nisObject,
+  OCI_ieee802Device,
+  OCI_bootableDevice,
+  OCI_automountMap,
+  OCI_automount,
+  OCI_MAX
+};
+
+typedef enum ldap_objectclass ldap_objectclass_t;
+
+extern const char *_nss_ldap_attribute_names[ATI_MAX];
+extern const char *_nss_ldap_objectclass_names[OCI_MAX];
+
 /*
  * Map names
  */
@@ -38,10 +38,12 @@
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <netdb.h>
 #include <syslog.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <assert.h>
 
@@ -58,6 +60,7 @@
 
 #include "ldap-nss.h"
 #include "util.h"
+#include "ldap-cache.h"
 
 static char rcsId[] = "$Id$";
 
@@ -79,18 +82,119 @@ static NSS_STATUS do_searchdescriptorconfig (const char *key,
 					     size_t * buflen);
 
 #include <fcntl.h>
+
+/*
+ * The dn2uid cache maps member DNs to user names. Entries are kept
+ * on an LRU list, bounded by nss_dn2uid_cache_size entries and by
+ * nss_dn2uid_cache_bytes of memory, and expire
+ * after nss_dn2uid_cache_ttl seconds. __cache indexes them by DN,
+ * ignoring case.
+ */
+typedef struct dn2uid_entry
+{
+  struct dn2uid_entry *newer;
+  struct dn2uid_entry *older;
+  time_t expires;		/* 0 if the entry never expires */
+  size_t size;			/* bytes charged against the cache */
+  ldap_datum_t key;
+  char *uid;
+} dn2uid_entry_t;
+
 static void *__cache = NULL;
+static dn2uid_entry_t *__cache_newest = NULL;
+static dn2uid_entry_t *__cache_oldest = NULL;
+static size_t __cache_entries = 0;
+static size_t __cache_bytes = 0;
+
+static unsigned long __cache_hits = 0;
+static unsigned long __cache_misses = 0;
+static unsigned long __cache_evictions = 0;
 
 NSS_LDAP_DEFINE_LOCK (__cache_lock);
 
 #define cache_lock()     NSS_LDAP_LOCK(__cache_lock)
 #define cache_unlock()   NSS_LDAP_UNLOCK(__cache_lock)
 
+static void
+dn2uid_cache_unlink (dn2uid_entry_t * e)
+{
+  if (e->newer != NULL)
+    e->newer->older = e->older;
+  else
+    __cache_newest = e->older;
+
+  if (e->older != NULL)
+    e->older->newer = e->newer;
+  else
+    __cache_oldest = e->newer;
+
+  e->newer = e->older = NULL;
+}
+
+static void
+dn2uid_cache_link (dn2uid_entry_t * e)
+{
+  e->newer = NULL;
+  e->older = __cache_newest;
+  if (__cache_newest != NULL)
+    __cache_newest->newer = e;
+  else
+    __cache_oldest = e;
+  __cache_newest = e;
+}
+
+static void
+dn2uid_cache_remove (dn2uid_entry_t * e)
+{
+  (void) _nss_ldap_db_delete (__cache, NSS_LDAP_DB_NORMALIZE_CASE, &e->key);
+  dn2uid_cache_unlink (e);
+
+  __cache_entries--;
+  __cache_bytes -= e->size;
+
+  free (e);
+}
+
+static dn2uid_entry_t *
+dn2uid_cache_find (const char *dn)
+{
+  ldap_datum_t key, val;
+  dn2uid_entry_t *e;
+
+  key.data = (void *) dn;
+  key.size = strlen (dn);
+
+  if (_nss_ldap_db_get (__cache, NSS_LDAP_DB_NORMALIZE_CASE, &key, &val)
+      != NSS_SUCCESS)
+    return NULL;
+
+  assert (val.size == sizeof (e));
+  memcpy (&e, val.data, sizeof (e));
+
+  return e;
+}
+
 static NSS_STATUS
 dn2uid_cache_put (const char *dn, const char *uid)
 {
+  ldap_config_t *cfg = _nss_ldap_get_config ();
+  time_t ttl = LDAP_NSS_DN2UID_CACHE_TTL;
+  size_t maxentries = LDAP_NSS_DN2UID_CACHE_SIZE;
+  size_t maxbytes = LDAP_NSS_DN2UID_CACHE_BYTES;
   NSS_STATUS stat;
-  ldap_datum_t key, val;
+  ldap_datum_t val;
+  dn2uid_entry_t *e;
+  size_t dnlen, uidlen;
+
+  if (cfg != NULL)
+    {
+      ttl = cfg->ldc_dn2uid_cache_ttl;
+      maxentries = cfg->ldc_dn2uid_cache_size;
+      maxbytes = cfg->ldc_dn2uid_cache_bytes;
+    }
+
+  if (maxentries == 0 || maxbytes == 0)
+    return NSS_SUCCESS;
 
   cache_lock ();
 
@@ -104,58 +208,139 @@ dn2uid_cache_put (const char *dn, const char *uid)
 	}
     }
 
-  key.data = (void *) dn;
-  key.size = strlen (dn);
-  val.data = (void *) uid;
-  val.size = strlen (uid);
+  /* replace any existing entry, eg. after a rename */
+  e = dn2uid_cache_find (dn);
+  if (e != NULL)
+    dn2uid_cache_remove (e);
+
+  dnlen = strlen (dn);
+  uidlen = strlen (uid);
+
+  e = (dn2uid_entry_t *) malloc (sizeof (*e) + dnlen + uidlen + 1);
+  if (e == NULL)
+    {
+      cache_unlock ();
+      return NSS_TRYAGAIN;
+    }
+
+  e->key.data = (char *) (e + 1);
+  e->key.size = dnlen;
+  memcpy (e->key.data, dn, dnlen);
+  e->uid = (char *) e->key.data + dnlen;
+  memcpy (e->uid, uid, uidlen + 1);
+  e->size = sizeof (*e) + dnlen + uidlen + 1;
+  e->expires = (ttl != 0) ? time (NULL) + ttl : 0;
 
-  stat = _nss_ldap_db_put (__cache, 0, &key, &val);
+  val.data = (void *) &e;
+  val.size = sizeof (e);
+
+  stat = _nss_ldap_db_put (__cache, NSS_LDAP_DB_NORMALIZE_CASE, &e->key, &val);
+  if (stat != NSS_SUCCESS)
+    {
+      free (e);
+      cache_unlock ();
+      return stat;
+    }
+
+  dn2uid_cache_link (e);
+  __cache_entries++;
+  __cache_bytes += e->size;
+
+  while (__cache_oldest != NULL &&
+	 (__cache_entries > maxentries ||
+	  __cache_bytes > maxbytes))
+    {
+      debug (":== dn2uid_cache_put: evicting %s", __cache_oldest->uid);
+      dn2uid_cache_remove (__cache_oldest);
+      __cache_evictions++;
+    }
+
+  debug (":== dn2uid_cache_put: %lu hits, %lu misses, %lu evictions",
+	 __cache_hits, __cache_misses, __cache_evictions);
 
   cache_unlock ();
 
-  return stat;
+  return NSS_SUCCESS;
 }
 
 static NSS_STATUS
 dn2uid_cache_get (const char *dn, char **uid, char **buffer, size_t * buflen)
 {
-  ldap_datum_t key, val;
-  NSS_STATUS stat;
+  dn2uid_entry_t *e;
+  size_t len;
 
   cache_lock ();
 
   if (__cache == NULL)
     {
+      __cache_misses++;
       cache_unlock ();
       return NSS_NOTFOUND;
     }
 
-  key.data = (void *) dn;
-  key.size = strlen (dn);
+  e = dn2uid_cache_find (dn);
+  if (e != NULL && e->expires != 0 && e->expires <= time (NULL))
+    {
+      dn2uid_cache_remove (e);
+      e = NULL;
+    }
 
-  stat = _nss_ldap_db_get (__cache, 0, &key, &val);
-  if (stat != NSS_SUCCESS)
+  if (e == NULL)
     {
+      __cache_misses++;
       cache_unlock ();
-      return stat;
+      return NSS_NOTFOUND;
     }
 
-  if (*buflen <= val.size)
+  __cache_hits++;
+
+  /* most recently used */
+  dn2uid_cache_unlink (e);
+  dn2uid_cache_link (e);
+
+  len = strlen (e->uid);
+  if (*buflen <= len)
     {
       cache_unlock ();
       return NSS_TRYAGAIN;
     }
 
   *uid = *buffer;
-  memcpy (*uid, (char *) val.data, val.size);
-  (*uid)[val.size] = '\0';
-  *buffer += val.size + 1;
-  *buflen -= val.size + 1;
+  memcpy (*uid, e->uid, len + 1);
+  *buffer += len + 1;
+  *buflen -= len + 1;
 
   cache_unlock ();
   return NSS_SUCCESS;
 }
 
+/*
+ * Is there an unexpired entry for dn? Caller holds the cache lock.
+ */
+static int
+dn2uid_cache_live (const char *dn)
+{
+  dn2uid_entry_t *e;
+
+  if (__cache == NULL)
+    return 0;
+
+  e = dn2uid_cache_find (dn);
+
+  return (e != NULL && (e->expires == 0 || e->expires > time (NULL)));
+}
+
+void
+_nss_ldap_dn2uid_cache_stats (unsigned long *hits, unsigned long *misses,
+			      unsigned long *evictions)
+{
+  cache_lock ();
+  *hits = __cache_hits;
+  *misses = __cache_misses;
+  *evictions = __cache_evictions;
+  cache_unlock ();
+}
+
 #ifdef HPUX
 static int lock_inited = 0;
 #endif
@@ -218,6 +403,147 @@ _nss_ldap_dn2uid (const char *dn, char **uid, char **buffer, size_t * buflen,
   return stat;
 }
 
+/*
+ * Cache the uid of a prefetched entry, unless it is a group, which
+ * the caller expands itself. dn is NULL for search results.
+ */
+static int
+dn2uid_prefetch_entry (LDAPMessage * e, const char *dn)
+{
+  char **uidValues;
+  char *edn = NULL;
+  int found = 0;
+
+  /* nested groups are expanded by the caller */
+  if (_nss_ldap_oc_check (e, OC (posixGroup)) == NSS_SUCCESS)
+    return 0;
+
+  if (dn == NULL)
+    {
+      dn = edn = _nss_ldap_get_dn (e);
+      if (dn == NULL)
+	return 0;
+    }
+
+  uidValues = _nss_ldap_get_values (e, ATM (LM_PASSWD, uid));
+  if (uidValues != NULL)
+    {
+      if (uidValues[0] != NULL &&
+	  dn2uid_cache_put (dn, uidValues[0]) == NSS_SUCCESS)
+	found = 1;
+      ldap_value_free (uidValues);
+    }
+
+  if (edn != NULL)
+    {
+#ifdef HAVE_LDAP_MEMFREE
+      ldap_memfree (edn);
+#else
+      free (edn);
+#endif
+    }
+
+  return found;
+}
+
+static NSS_STATUS
+dn2uid_prefetch_cb (LDAPMessage * e, void *arg)
+{
+  /* entries already cached stay valid if the search is restarted */
+  if (e != NULL)
+    *((int *) arg) += dn2uid_prefetch_entry (e, NULL);
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Resolve the uncached DNs among a group's members with OR-filtered
+ * searches of up to LDAP_NSS_DN2UID_BATCH DNs each, filling the
+ * dn2uid cache so that _nss_ldap_dn2uid() can then answer from it.
+ * If the server cannot search by DN, the members are instead read
+ * with pipelined base searches. DNs not found either way, such as
+ * nested groups or entries outside the passwd search base, are left
+ * to _nss_ldap_dn2uid().
+ */
+void
+_nss_ldap_dn2uid_prefetch (char **dns)
+{
+  ldap_config_t *cfg = _nss_ldap_get_config ();
+  const char *batch[LDAP_NSS_DN2UID_BATCH + 1];
+  LDAPMessage *reads[LDAP_NSS_DN2UID_BATCH];
+  NSS_STATUS stats[LDAP_NSS_DN2UID_BATCH];
+  const char *attrs[3];
+  ldap_args_t a;
+  LDAPMessage *e;
+  size_t i, n;
+  int found, byDN = 1;
+
+  debug ("==> _nss_ldap_dn2uid_prefetch");
+
+  if (cfg != NULL && cfg->ldc_dn2uid_cache_size == 0)
+    {
+      debug ("<== _nss_ldap_dn2uid_prefetch (cache disabled)");
+      return;
+    }
+
+  attrs[0] = ATM (LM_PASSWD, uid);
+  attrs[1] = AT (objectClass);
+  attrs[2] = NULL;
+
+  while (*dns != NULL)
+    {
+      n = 0;
+
+      cache_lock ();
+      for (; *dns != NULL && n < LDAP_NSS_DN2UID_BATCH; dns++)
+	{
+	  if (!dn2uid_cache_live (*dns))
+	    batch[n++] = *dns;
+	}
+      cache_unlock ();
+
+      if (n == 0)
+	continue;
+
+      batch[n] = NULL;
+
+      if (byDN)
+	{
+	  LA_INIT (a);
+	  LA_STRING_LIST (a) = batch;
+	  LA_TYPE (a) = LA_TYPE_STRING_LIST_OR;
+
+	  found = 0;
+	  (void) _nss_ldap_search_stream (&a, _nss_ldap_filt_getpwbydn,
+					  LM_PASSWD, attrs, LDAP_NO_LIMIT,
+					  dn2uid_prefetch_cb, &found);
+
+	  if (found != 0)
+	    continue;
+
+	  /* the server can't search by DN; read the members instead */
+	  byDN = 0;
+	}
+
+      if (_nss_ldap_read_multi (batch, n, attrs, reads, stats) != NSS_SUCCESS)
+	break;
+
+      for (i = 0; i < n; i++)
+	{
+	  if (stats[i] != NSS_SUCCESS)
+	    continue;
+
+	  e = _nss_ldap_first_entry (reads[i]);
+	  if (e != NULL)
+	    (void) dn2uid_prefetch_entry (e, batch[i]);
+
+	  ldap_msgfree (reads[i]);
+	}
+    }
+
+  debug ("<== _nss_ldap_dn2uid_prefetch");
+}
+
 NSS_STATUS
 _nss_ldap_getrdnvalue (LDAPMessage * entry,
 		       const char *rdntype,
@@ -644,10 +970,23 @@ NSS_STATUS _nss_ldap_init_config (ldap_config_t * result)
   result->ldc_reconnect_pol = LP_RECONNECT_HARD_OPEN;
   result->ldc_sasl_secprops = NULL;
   result->ldc_srv_domain = NULL;
+  result->ldc_shm_cache = NULL;
   result->ldc_srv_site = NULL;
+  result->ldc_srv_cache = NULL;
   result->ldc_logdir = NULL;
   result->ldc_debug = 0;
   result->ldc_pagesize = LDAP_PAGESIZE;
+  result->ldc_paged_readahead = LDAP_NSS_PAGED_READAHEAD;
+  result->ldc_pagesize_min = 0;
+  result->ldc_pagesize_max = 0;
+  result->ldc_pool_size = LDAP_NSS_POOLSIZE;
+  result->ldc_cache_ttl = 0;
+  result->ldc_cache_negative_ttl = 0;
+  result->ldc_cache_max_entries = LDAP_NSS_CACHE_MAX_ENTRIES;
+  result->ldc_dn2uid_cache_ttl = LDAP_NSS_DN2UID_CACHE_TTL;
+  result->ldc_dn2uid_cache_size = LDAP_NSS_DN2UID_CACHE_SIZE;
+  result->ldc_dn2uid_cache_bytes = LDAP_NSS_DN2UID_CACHE_BYTES;
+  result->ldc_read_window = LDAP_NSS_READ_WINDOW;
 #if defined(CONFIGURE_KRB5_CCNAME) || defined(CONFIGURE_KRB5_KEYTAB)
   result->ldc_krb5_ccname = NULL;
   result->ldc_krb5_rootccname = NULL;
@@ -671,6 +1010,7 @@ NSS_STATUS _nss_ldap_init_config (ldap_config_t * result)
   result->ldc_reconnect_sleeptime = LDAP_NSS_SLEEPTIME * USECSPERSEC;
   result->ldc_reconnect_maxsleeptime = LDAP_NSS_MAXSLEEPTIME * USECSPERSEC;
   result->ldc_reconnect_maxconntries = LDAP_NSS_MAXCONNTRIES;
+  result->ldc_connect_race = LDAP_NSS_CONNECT_RACE;
   result->ldc_initgroups_ignoreusers = NULL;
 
   for (i = 0; i <= LM_NONE; i++)
@@ -707,6 +1047,12 @@ _nss_ldap_destroy_config (ldap_config_t ** result)
            _nss_ldap_db_close(&(r->ldc_maps[i][j]));
         }
 
+  if (r->ldc_compiled_maps != NULL)
+    {
+      free (r->ldc_compiled_maps);
+      r->ldc_compiled_maps = NULL;
+    }
+
   *result = NULL;
   return NSS_SUCCESS;
 }
@@ -1089,6 +1435,12 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
 	{
 	  result->ldc_reconnect_maxconntries = atoi (v);
 	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CONNECT_RACE))
+	{
+	  result->ldc_connect_race = atoi (v);
+	  if (result->ldc_connect_race < 1)
+	    result->ldc_connect_race = 1;
+	}
       else if (!strcasecmp (k, NSS_LDAP_KEY_SASL_SECPROPS))
 	{
 	  t = &result->ldc_sasl_secprops;
@@ -1105,6 +1457,21 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
 	{
 	  result->ldc_pagesize = atoi (v);
 	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_PAGED_READAHEAD))
+	{
+	  result->ldc_paged_readahead = atoi (v);
+	  if (result->ldc_paged_readahead < 0 ||
+	      result->ldc_paged_readahead > 100)
+	    result->ldc_paged_readahead = LDAP_NSS_PAGED_READAHEAD;
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_PAGESIZE_MIN))
+	{
+	  result->ldc_pagesize_min = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_PAGESIZE_MAX))
+	{
+	  result->ldc_pagesize_max = atoi (v);
+	}
 #if defined(CONFIGURE_KRB5_CCNAME) || defined(CONFIGURE_KRB5_KEYTAB)
       else if (!strcasecmp (k, NSS_LDAP_KEY_KRB5_CCNAME))
 	{
@@ -1283,6 +1650,19 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
 	      break;
 	    }
 	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_INITGROUPS_TRANSITIVE))
+	{
+	  if (!strcasecmp (v, "on") || !strcasecmp (v, "yes")
+	      || !strcasecmp (v, "true"))
+	    {
+	      result->ldc_flags |= NSS_LDAP_FLAGS_INITGROUPS_TRANSITIVE;
+	    }
+	  else if (!strcasecmp (v, "off") || !strcasecmp (v, "no")
+		   || !strcasecmp (v, "false"))
+	    {
+	      result->ldc_flags &= ~(NSS_LDAP_FLAGS_INITGROUPS_TRANSITIVE);
+	    }
+	}
       else if (!strcasecmp (k, NSS_LDAP_KEY_GETGRENT_SKIPMEMBERS))
 	{
 	  if (!strcasecmp (v, "on") || !strcasecmp (v, "yes")
@@ -1307,6 +1687,59 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
 	      result->ldc_flags &= ~(NSS_LDAP_FLAGS_CONNECT_POLICY_ONESHOT);
 	    }
 	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CONCURRENT_SESSIONS))
+	{
+	  if (!strcasecmp (v, "on") || !strcasecmp (v, "yes")
+	      || !strcasecmp (v, "true"))
+	    {
+	      result->ldc_flags |= NSS_LDAP_FLAGS_CONCURRENT_SESSIONS;
+	    }
+	  else if (!strcasecmp (v, "off") || !strcasecmp (v, "no")
+		   || !strcasecmp (v, "false"))
+	    {
+	      result->ldc_flags &= ~(NSS_LDAP_FLAGS_CONCURRENT_SESSIONS);
+	    }
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CONNECTION_POOL_SIZE))
+	{
+	  result->ldc_pool_size = atoi (v);
+	  if (result->ldc_pool_size < 1)
+	    result->ldc_pool_size = 1;
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CACHE_TTL))
+	{
+	  result->ldc_cache_ttl = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CACHE_NEGATIVE_TTL))
+	{
+	  result->ldc_cache_negative_ttl = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_CACHE_MAX_ENTRIES))
+	{
+	  result->ldc_cache_max_entries = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_DN2UID_CACHE_TTL))
+	{
+	  result->ldc_dn2uid_cache_ttl = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_DN2UID_CACHE_SIZE))
+	{
+	  result->ldc_dn2uid_cache_size = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_DN2UID_CACHE_BYTES))
+	{
+	  result->ldc_dn2uid_cache_bytes = atoi (v);
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_READ_WINDOW))
+	{
+	  result->ldc_read_window = atoi (v);
+	  if (result->ldc_read_window < 1)
+	    result->ldc_read_window = 1;
+	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_SHM_CACHE))
+	{
+	  t = &result->ldc_shm_cache;
+	}
       else if (!strcasecmp (k, NSS_LDAP_KEY_SRV_DOMAIN))
 	{
 	  t = &result->ldc_srv_domain;
@@ -1315,6 +1748,10 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
  	{
  	  t = &result->ldc_srv_site;
  	}
+      else if (!strcasecmp (k, NSS_LDAP_KEY_SRV_CACHE))
+	{
+	  t = &result->ldc_srv_cache;
+	}
       else
 	{
 	  /*
@@ -1396,75 +1833,105 @@ _nss_ldap_readconfig (ldap_config_t ** presult, char **buffer, size_t *buflen)
   return stat;
 }
 
+/*
+ * Append str at *bufp, escaping the characters that are special
+ * in a filter, without writing at or beyond limit. On success
+ * *bufp is left pointing after the escaped string.
+ */
 NSS_STATUS
-_nss_ldap_escape_string (const char *str, char *buf, size_t buflen)
+_nss_ldap_escape_append (const char *str, char **bufp, const char *limit)
 {
-  int ret = NSS_TRYAGAIN;
-  char *p = buf;
-  char *limit = p + buflen - 3;
-  const char *s = str;
+  char *p = *bufp;
+  const char *s;
 
-  while (p < limit && *s)
+  for (s = str; *s != '\0'; s++)
     {
+      const char *esc;
+
       switch (*s)
 	{
 	case '*':
-	  strcpy (p, "\\2a");
-	  p += 3;
+	  esc = "\\2a";
 	  break;
 	case '(':
-	  strcpy (p, "\\28");
-	  p += 3;
+	  esc = "\\28";
 	  break;
 	case ')':
-	  strcpy (p, "\\29");
-	  p += 3;
+	  esc = "\\29";
 	  break;
 	case '\\':
-	  strcpy (p, "\\5c");
-	  p += 3;
+	  esc = "\\5c";
 	  break;
 	default:
+	  if (p >= limit)
+	    return NSS_TRYAGAIN;
 	  *p++ = *s;
-	  break;
+	  continue;
 	}
-      s++;
-    }
 
-  if (*s == '\0')
-    {
-      /* got to end */
-      *p = '\0';
-      ret = NSS_SUCCESS;
+      if (limit - p < 3)
+	return NSS_TRYAGAIN;
+      memcpy (p, esc, 3);
+      p += 3;
     }
 
-  return ret;
+  *bufp = p;
+
+  return NSS_SUCCESS;
 }
 
-/* XXX just a linked list for now */
+NSS_STATUS
+_nss_ldap_escape_string (const char *str, char *buf, size_t buflen)
+{
+  char *p = buf;
 
-struct ldap_dictionary
+  if (buflen == 0)
+    return NSS_TRYAGAIN;
+
+  /* leave room for the terminator */
+  if (_nss_ldap_escape_append (str, &p, buf + buflen - 1) != NSS_SUCCESS)
+    return NSS_TRYAGAIN;
+
+  *p = '\0';
+
+  return NSS_SUCCESS;
+}
+
+/*
+ * Open addressing hash table with linear probing. Keys are always
+ * hashed case-folded so that the same table can be searched with
+ * or without NSS_LDAP_DB_NORMALIZE_CASE; the flag only affects
+ * how candidate keys are compared. Deletion shifts the following
+ * entries of the probe sequence back, so no tombstones are needed.
+ */
+
+#define LDAP_DICT_MINSLOTS	16	/* must be a power of two */
+
+struct ldap_dictionary_slot
 {
-  ldap_datum_t key;
+  unsigned long hash;
+  ldap_datum_t key;		/* key.data == NULL if the slot is empty */
   ldap_datum_t value;
-  struct ldap_dictionary *next;
 };
 
-static struct ldap_dictionary *
-do_alloc_dictionary (void)
+struct ldap_dictionary
 {
-  struct ldap_dictionary *dict;
+  struct ldap_dictionary_slot *slots;
+  size_t nslots;
+  size_t count;
+};
 
-  dict = malloc (sizeof (*dict));
-  if (dict == NULL)
-    {
-      return NULL;
-    }
-  NSS_LDAP_DATUM_ZERO (&dict->key);
-  NSS_LDAP_DATUM_ZERO (&dict->value);
-  dict->next = NULL;
+static unsigned long
+do_hash_datum (const ldap_datum_t * key)
+{
+  const unsigned char *p = (const unsigned char *) key->data;
+  unsigned long h = 2166136261UL;
+  size_t i;
+
+  for (i = 0; i < key->size; i++)
+    h = (h ^ (unsigned long) tolower (p[i])) * 16777619UL;
 
-  return dict;
+  return h;
 }
 
 static void
@@ -1478,34 +1945,90 @@ do_free_datum (ldap_datum_t * datum)
   datum->size = 0;
 }
 
-static struct ldap_dictionary *
-do_find_last (struct ldap_dictionary *dict)
+static NSS_STATUS
+do_dup_datum (unsigned flags, ldap_datum_t * dst, const ldap_datum_t * src)
 {
-  struct ldap_dictionary *p;
+  dst->data = malloc (src->size);
+  if (dst->data == NULL)
+    return NSS_TRYAGAIN;
 
-  for (p = dict; p->next != NULL; p = p->next)
-    ;
+  memcpy (dst->data, src->data, src->size);
+  dst->size = src->size;
 
-  return p;
+  return NSS_SUCCESS;
 }
 
-static void
-do_free_dictionary (struct ldap_dictionary *dict)
+/*
+ * Return the slot holding key, or the empty slot where it would
+ * be inserted.
+ */
+static struct ldap_dictionary_slot *
+do_find_slot (struct ldap_dictionary *dict, unsigned flags,
+	      unsigned long hash, const ldap_datum_t * key)
 {
-  do_free_datum (&dict->key);
-  do_free_datum (&dict->value);
-  free (dict);
+  struct ldap_dictionary_slot *slot;
+  size_t i;
+
+  for (i = hash & (dict->nslots - 1);;
+       i = (i + 1) & (dict->nslots - 1))
+    {
+      int cmp;
+
+      slot = &dict->slots[i];
+      if (slot->key.data == NULL)
+	break;
+
+      if (slot->hash != hash || slot->key.size != key->size)
+	continue;
+
+      if (flags & NSS_LDAP_DB_NORMALIZE_CASE)
+	cmp = strncasecmp ((char *)slot->key.data, (char *)key->data, key->size);
+      else
+	cmp = memcmp (slot->key.data, key->data, key->size);
+
+      if (cmp == 0)
+	break;
+    }
+
+  return slot;
 }
 
+/*
+ * Double the table (or allocate the first one) once it is half
+ * full, to keep probe sequences short.
+ */
 static NSS_STATUS
-do_dup_datum (unsigned flags, ldap_datum_t * dst, const ldap_datum_t * src)
+do_grow_dictionary (struct ldap_dictionary *dict)
 {
-  dst->data = malloc (src->size);
-  if (dst->data == NULL)
-    return NSS_TRYAGAIN;
+  struct ldap_dictionary_slot *old = dict->slots;
+  size_t oldslots = dict->nslots;
+  size_t i, j, nslots;
 
-  memcpy (dst->data, src->data, src->size);
-  dst->size = src->size;
+  nslots = (oldslots == 0) ? LDAP_DICT_MINSLOTS : oldslots * 2;
+
+  dict->slots = (struct ldap_dictionary_slot *)
+    calloc (nslots, sizeof (struct ldap_dictionary_slot));
+  if (dict->slots == NULL)
+    {
+      dict->slots = old;
+      return NSS_TRYAGAIN;
+    }
+  dict->nslots = nslots;
+
+  for (i = 0; i < oldslots; i++)
+    {
+      if (old[i].key.data == NULL)
+	continue;
+
+      for (j = old[i].hash & (nslots - 1);
+	   dict->slots[j].key.data != NULL; j = (j + 1) & (nslots - 1))
+	;
+
+      dict->slots[j] = old[i];
+    }
+
+  if (old != NULL)
+    free (old);
 
   return NSS_SUCCESS;
 }
@@ -1513,28 +2036,41 @@ do_dup_datum (unsigned flags, ldap_datum_t * dst, const ldap_datum_t * src)
 void *
 _nss_ldap_db_open (void)
 {
-  return (void *) do_alloc_dictionary ();
+  struct ldap_dictionary *dict;
+
+  dict = malloc (sizeof (*dict));
+  if (dict == NULL)
+    {
+      return NULL;
+    }
+  dict->slots = NULL;
+  dict->nslots = 0;
+  dict->count = 0;
+
+  return (void *) dict;
 }
 
 void
 _nss_ldap_db_close (void **db)
 {
   struct ldap_dictionary *dict;
+  size_t i;
 
   if (! db || ! *db)
     return;
 
   dict = (struct ldap_dictionary *) *db;
 
-  while (dict != NULL)
+  for (i = 0; i < dict->nslots; i++)
     {
-      struct ldap_dictionary *next = dict->next;
-
-      do_free_dictionary (dict);
-
-      dict = next;
+      do_free_datum (&dict->slots[i].key);
+      do_free_datum (&dict->slots[i].value);
     }
 
+  if (dict->slots != NULL)
+    free (dict->slots);
+  free (dict);
+
   *db = NULL;
 }
 
@@ -1545,30 +2081,19 @@ _nss_ldap_db_get (void *db,
 		  ldap_datum_t * value)
 {
   struct ldap_dictionary *dict = (struct ldap_dictionary *) db;
-  struct ldap_dictionary *p;
+  struct ldap_dictionary_slot *slot;
 
-  for (p = dict; p != NULL; p = p->next)
-    {
-      int cmp;
+  if (dict->count == 0)
+    return NSS_NOTFOUND;
 
-      if (p->key.size != key->size)
-	continue;
+  slot = do_find_slot (dict, flags, do_hash_datum (key), key);
+  if (slot->key.data == NULL)
+    return NSS_NOTFOUND;
 
-      if (flags & NSS_LDAP_DB_NORMALIZE_CASE)
-	cmp = strncasecmp ((char *)p->key.data, (char *)key->data, key->size);
-      else
-	cmp = memcmp (p->key.data, key->data, key->size);
+  value->data = slot->value.data;
+  value->size = slot->value.size;
 
-      if (cmp == 0)
-	{
-	  value->data = p->value.data;
-	  value->size = p->value.size;
-
-	  return NSS_SUCCESS;
-	}
-    }
-
-  return NSS_NOTFOUND;
+  return NSS_SUCCESS;
 }
 
 NSS_STATUS
@@ -1578,41 +2103,81 @@ _nss_ldap_db_put (void *db,
 		  const ldap_datum_t * value)
 {
   struct ldap_dictionary *dict = (struct ldap_dictionary *) db;
-  struct ldap_dictionary *p, *q;
+  struct ldap_dictionary_slot *slot;
+  unsigned long hash;
 
   assert (key != NULL);
   assert (key->data != NULL);
 
-  if (dict->key.data == NULL)
-    {
-      /* uninitialized */
-      q = dict;
-      p = NULL;
-    }
-  else
+  if (2 * (dict->count + 1) > dict->nslots)
     {
-      p = do_find_last (dict);
-      assert (p != NULL);
-      assert (p->next == NULL);
-      q = do_alloc_dictionary ();
-      if (q == NULL)
+      if (do_grow_dictionary (dict) != NSS_SUCCESS)
 	return NSS_TRYAGAIN;
     }
 
-  if (do_dup_datum (flags, &q->key, key) != NSS_SUCCESS)
+  hash = do_hash_datum (key);
+
+  slot = do_find_slot (dict, flags, hash, key);
+  if (slot->key.data != NULL)
     {
-      do_free_dictionary (q);
-      return NSS_TRYAGAIN;
+      /* the first value stored under a key wins, as lookups always found it */
+      return NSS_SUCCESS;
     }
 
-  if (do_dup_datum (flags, &q->value, value) != NSS_SUCCESS)
+  /* on failure the slot is left empty */
+  if (do_dup_datum (flags, &slot->key, key) != NSS_SUCCESS)
+    return NSS_TRYAGAIN;
+
+  if (do_dup_datum (flags, &slot->value, value) != NSS_SUCCESS)
     {
-      do_free_dictionary (q);
+      do_free_datum (&slot->key);
       return NSS_TRYAGAIN;
     }
 
-  if (p != NULL)
-    p->next = q;
+  slot->hash = hash;
+  dict->count++;
+
+  return NSS_SUCCESS;
+}
+
+NSS_STATUS
+_nss_ldap_db_delete (void *db,
+		     unsigned flags,
+		     const ldap_datum_t * key)
+{
+  struct ldap_dictionary *dict = (struct ldap_dictionary *) db;
+  struct ldap_dictionary_slot *slot;
+  size_t i, j, home, mask;
+
+  if (dict->count == 0)
+    return NSS_NOTFOUND;
+
+  slot = do_find_slot (dict, flags, do_hash_datum (key), key);
+  if (slot->key.data == NULL)
+    return NSS_NOTFOUND;
+
+  do_free_datum (&slot->key);
+  do_free_datum (&slot->value);
+  dict->count--;
+
+  /*
+   * Move back any later entry of the probe sequence that would no
+   * longer be reachable across the hole.
+   */
+  mask = dict->nslots - 1;
+  i = slot - dict->slots;
+  for (j = (i + 1) & mask; dict->slots[j].key.data != NULL;
+       j = (j + 1) & mask)
+    {
+      home = dict->slots[j].hash & mask;
+      if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+	continue;
+
+      dict->slots[i] = dict->slots[j];
+      NSS_LDAP_DATUM_ZERO (&dict->slots[j].key);
+      NSS_LDAP_DATUM_ZERO (&dict->slots[j].value);
+      i = j;
+    }
 
   return NSS_SUCCESS;
 }
@@ -1651,6 +2216,41 @@ _nss_ldap_namelist_push (struct name_list **head, const char *name)
   return NSS_SUCCESS;
 }
 
+/*
+ * Add a group to a namelist that lives only as long as the
+ * current lookup. The entry comes from the lookup arena, so the
+ * list must not be popped or destroyed.
+ */
+NSS_STATUS
+_nss_ldap_namelist_push_arena (struct name_list **head, const char *name)
+{
+  struct name_list *nl;
+
+  debug ("==> _nss_ldap_namelist_push_arena (%s)", name);
+
+  nl = (struct name_list *) _nss_ldap_arena_alloc (sizeof (*nl));
+  if (nl == NULL)
+    {
+      debug ("<== _nss_ldap_namelist_push_arena");
+      return NSS_TRYAGAIN;
+    }
+
+  nl->name = _nss_ldap_arena_strdup (name);
+  if (nl->name == NULL)
+    {
+      debug ("<== _nss_ldap_namelist_push_arena");
+      return NSS_TRYAGAIN;
+    }
+
+  nl->next = *head;
+
+  *head = nl;
+
+  debug ("<== _nss_ldap_namelist_push_arena");
+
+  return NSS_SUCCESS;
+}
+
 /*
  * Remove last nested netgroup or group from the namelist
  */
@@ -1723,10 +2323,76 @@ _nss_ldap_namelist_find (struct name_list *head, const char *netgroup)
   return found;
 }
 
+/*
+ * Seconds from an arbitrary origin, unaffected by changes to
+ * the system clock.
+ */
+static time_t
+do_monotonic_time (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+# ifdef CLOCK_MONOTONIC_COARSE
+  if (clock_gettime (CLOCK_MONOTONIC_COARSE, &ts) == 0)
+    return ts.tv_sec;
+# endif
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec;
+#endif /* HAVE_CLOCK_GETTIME */
+
+  return time (NULL);
+}
+
+/*
+ * Lookups running concurrently call this holding __config_lock
+ * shared only, so the check state is a single word that is read
+ * and updated atomically; under a lock where the compiler has no
+ * atomic builtins.
+ */
+#ifdef HAVE_SYNC_BUILTINS
+#define do_check_state_load(c)	__sync_fetch_and_add (&(c)->ldc_check_state, 0)
+#define do_check_state_stale(c)	(void) __sync_lock_test_and_set (&(c)->ldc_check_state, LDAP_NSS_CONFIG_STALE)
+#define do_check_state_update(c, old, new) \
+	(void) __sync_bool_compare_and_swap (&(c)->ldc_check_state, (old), (new))
+#else
+NSS_LDAP_DEFINE_LOCK (__check_state_lock);
+
+static long
+do_check_state_load (ldap_config_t * config)
+{
+  long state;
+
+  NSS_LDAP_LOCK (__check_state_lock);
+  state = config->ldc_check_state;
+  NSS_LDAP_UNLOCK (__check_state_lock);
+
+  return state;
+}
+
+static void
+do_check_state_stale (ldap_config_t * config)
+{
+  NSS_LDAP_LOCK (__check_state_lock);
+  config->ldc_check_state = LDAP_NSS_CONFIG_STALE;
+  NSS_LDAP_UNLOCK (__check_state_lock);
+}
+
+static void
+do_check_state_update (ldap_config_t * config, long old, long new)
+{
+  NSS_LDAP_LOCK (__check_state_lock);
+  if (config->ldc_check_state == old)
+    config->ldc_check_state = new;
+  NSS_LDAP_UNLOCK (__check_state_lock);
+}
+#endif /* HAVE_SYNC_BUILTINS */
+
 NSS_STATUS _nss_ldap_validateconfig (ldap_config_t *config)
 {
   struct stat statbuf;
   char *configFilename = NSS_LDAP_PATH_CONF;
+  long state, now;
 
   if (config == NULL)
     {
@@ -1738,6 +2404,26 @@ NSS_STATUS _nss_ldap_validateconfig (ldap_config_t *config)
       return NSS_SUCCESS;
     }
 
+  state = do_check_state_load (config);
+
+  /* a changed configuration stays changed until it is reloaded */
+  if (state == LDAP_NSS_CONFIG_STALE)
+    {
+      _nss_ldap_cache_flush ();
+      return NSS_TRYAGAIN;
+    }
+
+  /*
+   * Called for every lookup; only look at the file system
+   * once every LDAP_NSS_CONFIG_CHECK_INTERVAL seconds.
+   */
+  now = (long) do_monotonic_time ();
+  if (state > 0 && now >= state &&
+      now - state < LDAP_NSS_CONFIG_CHECK_INTERVAL)
+    {
+      return NSS_SUCCESS;
+    }
+
   if (getuid() == geteuid() && getgid() == getegid())
     {
       char *envFilename = getenv("NSS_LDAP_CONFIG_FILE");
@@ -1750,13 +2436,24 @@ NSS_STATUS _nss_ldap_validateconfig (ldap_config_t *config)
 
   if (strcmp(config->ldc_config_filename, configFilename) != 0)
     {
+      do_check_state_stale (config);
+      _nss_ldap_cache_flush ();
       return NSS_TRYAGAIN;
     }
   else if (stat (configFilename, &statbuf) == 0)
     {
-      return (statbuf.st_mtime > config->ldc_mtime) ? NSS_TRYAGAIN : NSS_SUCCESS;
+      if (statbuf.st_mtime > config->ldc_mtime)
+	{
+	  do_check_state_stale (config);
+	  /* cached entries may reflect the old configuration */
+	  _nss_ldap_cache_flush ();
+	  return NSS_TRYAGAIN;
+	}
     }
 
+  /* do not overwrite a staleness another lookup found meanwhile */
+  do_check_state_update (config, state, now);
+
   return NSS_SUCCESS;
 }
 
@@ -46,6 +46,20 @@ NSS_STATUS _nss_ldap_dn2uid (const char *dn,
 			     char **uid, char **buf, size_t * len,
 			     int *pIsNestedGroup, LDAPMessage ** pRes);
 
+/*
+ * resolve a list of member DNs into the dn2uid cache in batches
+ */
+void _nss_ldap_dn2uid_prefetch (char **dns);
+
+/*
+ * dn2uid cache hit, miss and eviction counters, for sizing the
+ * cache with nss_dn2uid_cache_size and nss_dn2uid_cache_bytes.
+ * Exported for use through dlsym().
+ */
+void _nss_ldap_dn2uid_cache_stats (unsigned long *hits,
+				   unsigned long *misses,
+				   unsigned long *evictions);
+
 #define NSS_LDAP_KEY_MAP_ATTRIBUTE      "nss_map_attribute"
 #define NSS_LDAP_KEY_MAP_OBJECTCLASS    "nss_map_objectclass"
 #define NSS_LDAP_KEY_SET_OVERRIDE       "nss_override_attribute_value"
@@ -93,6 +107,7 @@ NSS_STATUS _nss_ldap_dn2uid (const char *dn,
 #define NSS_LDAP_KEY_PAGESIZE		"pagesize"
 #define NSS_LDAP_KEY_INITGROUPS		"nss_initgroups"
 #define NSS_LDAP_KEY_INITGROUPS_IGNOREUSERS	"nss_initgroups_ignoreusers"
+#define NSS_LDAP_KEY_INITGROUPS_TRANSITIVE	"nss_initgroups_transitive"
 #define NSS_LDAP_KEY_GETGRENT_SKIPMEMBERS	"nss_getgrent_skipmembers"
 
 /* more reconnect policy fine-tuning */
@@ -100,12 +115,27 @@ NSS_STATUS _nss_ldap_dn2uid (const char *dn,
 #define NSS_LDAP_KEY_RECONNECT_SLEEPTIME	"nss_reconnect_sleeptime"
 #define NSS_LDAP_KEY_RECONNECT_MAXSLEEPTIME	"nss_reconnect_maxsleeptime"
 #define NSS_LDAP_KEY_RECONNECT_MAXCONNTRIES	"nss_reconnect_maxconntries"
+#define NSS_LDAP_KEY_CONNECT_RACE		"nss_connect_race"
 
 #define NSS_LDAP_KEY_PAGED_RESULTS	"nss_paged_results"
+#define NSS_LDAP_KEY_PAGED_READAHEAD	"nss_paged_readahead"
+#define NSS_LDAP_KEY_PAGESIZE_MIN	"nss_pagesize_min"
+#define NSS_LDAP_KEY_PAGESIZE_MAX	"nss_pagesize_max"
 #define NSS_LDAP_KEY_SCHEMA		"nss_schema"
 #define NSS_LDAP_KEY_SRV_DOMAIN		"nss_srv_domain"
 #define NSS_LDAP_KEY_SRV_SITE		"nss_srv_site"
+#define NSS_LDAP_KEY_SRV_CACHE		"nss_srv_cache"
 #define NSS_LDAP_KEY_CONNECT_POLICY	"nss_connect_policy"
+#define NSS_LDAP_KEY_CONCURRENT_SESSIONS	"nss_concurrent_sessions"
+#define NSS_LDAP_KEY_CONNECTION_POOL_SIZE	"nss_connection_pool_size"
+#define NSS_LDAP_KEY_CACHE_TTL		"nss_cache_ttl"
+#define NSS_LDAP_KEY_CACHE_NEGATIVE_TTL	"nss_cache_negative_ttl"
+#define NSS_LDAP_KEY_CACHE_MAX_ENTRIES	"nss_cache_max_entries"
+#define NSS_LDAP_KEY_SHM_CACHE		"nss_shm_cache"
+#define NSS_LDAP_KEY_DN2UID_CACHE_TTL	"nss_dn2uid_cache_ttl"
+#define NSS_LDAP_KEY_DN2UID_CACHE_SIZE	"nss_dn2uid_cache_size"
+#define NSS_LDAP_KEY_DN2UID_CACHE_BYTES	"nss_dn2uid_cache_bytes"
+#define NSS_LDAP_KEY_READ_WINDOW	"nss_read_window"
 
 /*
  * support separate naming contexts for each map 
@@ -123,6 +153,8 @@ NSS_STATUS _nss_ldap_dn2uid (const char *dn,
 #define NSS_LDAP_FLAGS_RFC2307BIS		0x0004
 #define NSS_LDAP_FLAGS_CONNECT_POLICY_ONESHOT	0x0008
 #define NSS_LDAP_FLAGS_GETGRENT_SKIPMEMBERS	0x0010
+#define NSS_LDAP_FLAGS_CONCURRENT_SESSIONS	0x0020
+#define NSS_LDAP_FLAGS_INITGROUPS_TRANSITIVE	0x0040
 
 /*
  * There are a number of means of obtaining configuration information.
@@ -149,6 +181,12 @@ NSS_STATUS _nss_ldap_validateconfig (ldap_config_t *config);
 NSS_STATUS _nss_ldap_escape_string (const char *str,
 				    char *buf, size_t buflen);
 
+/*
+ * Escape a string onto the end of a filter being built
+ */
+NSS_STATUS _nss_ldap_escape_append (const char *str, char **bufp,
+				    const char *limit);
+
 #define MAP_H_ERRNO(nss_status, herr)   do { \
 		switch ((nss_status)) {		\
 		case NSS_SUCCESS:		\
@@ -212,10 +250,15 @@ NSS_STATUS _nss_ldap_db_get (void *db,
 			     unsigned flags,
 			     const ldap_datum_t * key,
 			     ldap_datum_t * value);
+NSS_STATUS _nss_ldap_db_delete (void *db,
+				unsigned flags,
+				const ldap_datum_t * key);
 
 /* Routines for managing namelists */
 
 NSS_STATUS _nss_ldap_namelist_push (struct name_list **head, const char *name);
+NSS_STATUS _nss_ldap_namelist_push_arena (struct name_list **head,
+					  const char *name);
 void _nss_ldap_namelist_pop (struct name_list **head);
 int _nss_ldap_namelist_find (struct name_list *head, const char *netgroup);
 void _nss_ldap_namelist_destroy (struct name_list **head);